@@ -0,0 +1,265 @@
+#include "fast_detector.h"
+#include <string.h>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FAST_NEON 1
+#endif
+
+using namespace cv;
+
+//the circle, clockwise from the top
+static const int kCircleX[16] = { 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1 };
+static const int kCircleY[16] = { -3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3 };
+//arc length that makes a corner
+static const int kArc = 9;
+
+//the largest difference a 9 pixel arc around p has everywhere along it,
+//brighter or darker; the pixel is a corner when that is > threshold
+static int cornerScore(const uchar *p, const int *circle)
+{
+    //differences twice round, so every arc is contiguous
+    int d[16 + kArc - 1];
+    for (int k = 0; k < 16; k++)
+        d[k] = p[circle[k]] - p[0];
+    for (int k = 16; k < 16 + kArc - 1; k++)
+        d[k] = d[k - 16];
+
+    int bright = 0, dark = 0;
+    for (int k = 0; k < 16; k++) {
+        int lo = d[k], hi = d[k];
+        for (int j = 1; j < kArc; j++) {
+            lo = std::min(lo, d[k + j]);
+            hi = std::max(hi, d[k + j]);
+        }
+        bright = std::max(bright, lo);
+        dark   = std::max(dark, -hi);
+    }
+    return std::max(bright, dark);
+}
+
+#if defined(__AVX2__)
+//per lane, the largest of the 16 arcs' smallest difference: runs of 2, 4
+//and 8 first, so 64 min instead of 128
+static inline __m256i arcScore(const __m256i *d)
+{
+    __m256i m2[16], m4[16], best = _mm256_setzero_si256();
+    for (int k = 0; k < 16; k++)
+        m2[k] = _mm256_min_epu8(d[k], d[(k + 1) & 15]);
+    for (int k = 0; k < 16; k++)
+        m4[k] = _mm256_min_epu8(m2[k], m2[(k + 2) & 15]);
+    for (int k = 0; k < 16; k++) {
+        __m256i m9 = _mm256_min_epu8(_mm256_min_epu8(m4[k], m4[(k + 4) & 15]), d[(k + 8) & 15]);
+        best = _mm256_max_epu8(best, m9);
+    }
+    return best;
+}
+#elif defined(FAST_NEON)
+static inline uint8x16_t arcScore(const uint8x16_t *d)
+{
+    uint8x16_t m2[16], m4[16], best = vdupq_n_u8(0);
+    for (int k = 0; k < 16; k++)
+        m2[k] = vminq_u8(d[k], d[(k + 1) & 15]);
+    for (int k = 0; k < 16; k++)
+        m4[k] = vminq_u8(m2[k], m2[(k + 2) & 15]);
+    for (int k = 0; k < 16; k++)
+        best = vmaxq_u8(best, vminq_u8(vminq_u8(m4[k], m4[(k + 4) & 15]), d[(k + 8) & 15]));
+    return best;
+}
+#endif
+
+FastDetector::FastDetector(int threshold, int cellSize, int border)
+    : threshold_(std::min(254, std::max(1, threshold))),
+      cellSize_(std::max(8, cellSize)),
+      border_(std::max(3, border))
+{
+}
+
+//corners of a row between the borders: their scores into scores[x], their
+//x into xs in increasing order
+void FastDetector::detectRow(const uchar *row, int step, int cols, uchar *scores,
+                             std::vector<int> &xs)
+{
+    int circle[16];
+    for (int k = 0; k < 16; k++)
+        circle[k] = kCircleY[k] * step + kCircleX[k];
+
+    int x = border_, end = cols - border_;
+#if defined(__AVX2__)
+    //differences saturate at 0, so ring - centre > threshold is
+    //subs(subs(ring, centre), threshold) != 0. A 9 pixel arc always takes
+    //in two neighbouring pixels of the four at 0, 4, 8 and 12 o'clock,
+    //which rejects most pixels after four loads
+    const __m256i t      = _mm256_set1_epi8((char)threshold_);
+    const __m256i corner = _mm256_set1_epi8((char)(threshold_ + 1));
+    for (; x + 32 <= end; x += 32) {
+        const uchar *p = row + x;
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i a[4], maybe = _mm256_setzero_si256();
+        for (int k = 0; k < 4; k++)
+            a[k] = _mm256_loadu_si256((const __m256i *)(p + circle[4 * k]));
+        for (int k = 0; k < 4; k++) {
+            __m256i b0 = _mm256_subs_epu8(_mm256_subs_epu8(a[k], v), t);
+            __m256i b1 = _mm256_subs_epu8(_mm256_subs_epu8(a[(k + 1) & 3], v), t);
+            __m256i d0 = _mm256_subs_epu8(_mm256_subs_epu8(v, a[k]), t);
+            __m256i d1 = _mm256_subs_epu8(_mm256_subs_epu8(v, a[(k + 1) & 3]), t);
+            maybe = _mm256_or_si256(maybe, _mm256_or_si256(_mm256_min_epu8(b0, b1), _mm256_min_epu8(d0, d1)));
+        }
+        if (_mm256_testz_si256(maybe, maybe))
+            continue;
+
+        //the full test is the score: brighter arcs, then darker ones
+        __m256i d[16];
+        for (int k = 0; k < 16; k++)
+            d[k] = _mm256_subs_epu8(_mm256_loadu_si256((const __m256i *)(p + circle[k])), v);
+        __m256i score = arcScore(d);
+        for (int k = 0; k < 16; k++)
+            d[k] = _mm256_subs_epu8(v, _mm256_loadu_si256((const __m256i *)(p + circle[k])));
+        score = _mm256_max_epu8(score, arcScore(d));
+
+        __m256i is = _mm256_cmpeq_epi8(_mm256_max_epu8(score, corner), score);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(is);
+        if (mask == 0)
+            continue;
+        _mm256_storeu_si256((__m256i *)(scores + x), _mm256_and_si256(score, is));
+        while (mask != 0) {
+            xs.push_back(x + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#elif defined(FAST_NEON)
+    const uint8x16_t t = vdupq_n_u8((uint8_t)threshold_);
+    for (; x + 16 <= end; x += 16) {
+        const uchar *p = row + x;
+        uint8x16_t v = vld1q_u8(p);
+        uint8x16_t a[4], maybe = vdupq_n_u8(0);
+        for (int k = 0; k < 4; k++)
+            a[k] = vld1q_u8(p + circle[4 * k]);
+        for (int k = 0; k < 4; k++) {
+            uint8x16_t b0 = vqsubq_u8(vqsubq_u8(a[k], v), t);
+            uint8x16_t b1 = vqsubq_u8(vqsubq_u8(a[(k + 1) & 3], v), t);
+            uint8x16_t d0 = vqsubq_u8(vqsubq_u8(v, a[k]), t);
+            uint8x16_t d1 = vqsubq_u8(vqsubq_u8(v, a[(k + 1) & 3]), t);
+            maybe = vorrq_u8(maybe, vorrq_u8(vminq_u8(b0, b1), vminq_u8(d0, d1)));
+        }
+        uint64x2_t any = vreinterpretq_u64_u8(maybe);
+        if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) == 0)
+            continue;
+
+        uint8x16_t d[16];
+        for (int k = 0; k < 16; k++)
+            d[k] = vqsubq_u8(vld1q_u8(p + circle[k]), v);
+        uint8x16_t score = arcScore(d);
+        for (int k = 0; k < 16; k++)
+            d[k] = vqsubq_u8(v, vld1q_u8(p + circle[k]));
+        score = vmaxq_u8(score, arcScore(d));
+
+        uint8x16_t is = vcgtq_u8(score, t);
+        any = vreinterpretq_u64_u8(is);
+        if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) == 0)
+            continue;
+        vst1q_u8(scores + x, vandq_u8(score, is));
+        for (int i = 0; i < 16; i++) {
+            if (scores[x + i] != 0)
+                xs.push_back(x + i);
+        }
+    }
+#endif
+    for (; x < end; x++) {
+        const uchar *p = row + x;
+        int bright = p[0] + threshold_, dark = p[0] - threshold_;
+        int b0 = p[circle[0]] > bright, b1 = p[circle[4]] > bright;
+        int b2 = p[circle[8]] > bright, b3 = p[circle[12]] > bright;
+        int d0 = p[circle[0]] < dark, d1 = p[circle[4]] < dark;
+        int d2 = p[circle[8]] < dark, d3 = p[circle[12]] < dark;
+        if (!((b0 & b1) | (b1 & b2) | (b2 & b3) | (b3 & b0) | (d0 & d1) | (d1 & d2) | (d2 & d3) | (d3 & d0)))
+            continue;
+        int score = cornerScore(p, circle);
+        if (score > threshold_) {
+            scores[x] = (uchar)score;
+            xs.push_back(x);
+        }
+    }
+}
+
+//corners of row y that beat all 8 neighbours go to their cell
+void FastDetector::suppressRow(int y, const uchar *above, const uchar *scores, const uchar *below,
+                               const std::vector<int> &xs, int gridCols)
+{
+    std::vector<Corner> *cells = &cells_[(y / cellSize_) * gridCols];
+    for (size_t i = 0; i < xs.size(); i++) {
+        int x = xs[i], s = scores[x];
+        if (s <= scores[x - 1] || s <= scores[x + 1]
+            || s <= above[x - 1] || s <= above[x] || s <= above[x + 1]
+            || s <= below[x - 1] || s <= below[x] || s <= below[x + 1])
+            continue;
+        Corner c;
+        c.x     = (short)x;
+        c.y     = (short)y;
+        c.score = s;
+        cells[x / cellSize_].push_back(c);
+    }
+}
+
+bool FastDetector::stronger(const Corner &a, const Corner &b)
+{
+    return a.score > b.score;
+}
+
+void FastDetector::detect(const Mat &gray, int maxKeys, std::vector<KeyPoint> &keys)
+{
+    keys.clear();
+    int cols = gray.cols, rows = gray.rows;
+    if (gray.type() != CV_8UC1 || maxKeys <= 0 || cols <= 2 * border_ || rows <= 2 * border_)
+        return;
+
+    int gridCols = (cols + cellSize_ - 1) / cellSize_;
+    int gridRows = (rows + cellSize_ - 1) / cellSize_;
+    cells_.resize(gridCols * gridRows);
+    for (size_t i = 0; i < cells_.size(); i++)
+        cells_[i].clear();
+    spare_.clear();
+
+    //row y's scores and corners live in slot y % 3, rows without any are
+    //all zero
+    scoreRows_.assign(3 * cols, 0);
+    for (int i = 0; i < 3; i++)
+        rowCorners_[i].clear();
+
+    int step = (int)gray.step;
+    int end  = rows - border_;
+    for (int y = border_; y < end; y++) {
+        uchar *s = &scoreRows_[(y % 3) * cols];
+        memset(s, 0, cols);
+        rowCorners_[y % 3].clear();
+        detectRow(gray.ptr<uchar>(y), step, cols, s, rowCorners_[y % 3]);
+        if (y > border_)
+            suppressRow(y - 1, &scoreRows_[((y - 2) % 3) * cols], &scoreRows_[((y - 1) % 3) * cols], s,
+                        rowCorners_[(y - 1) % 3], gridCols);
+    }
+    memset(&scoreRows_[(end % 3) * cols], 0, cols);
+    suppressRow(end - 1, &scoreRows_[((end - 2) % 3) * cols], &scoreRows_[((end - 1) % 3) * cols],
+                &scoreRows_[(end % 3) * cols], rowCorners_[(end - 1) % 3], gridCols);
+
+    //each cell's share, then the strongest of the rest
+    size_t share = maxKeys / cells_.size();
+    for (size_t i = 0; i < cells_.size(); i++) {
+        std::vector<Corner> &cell = cells_[i];
+        if (cell.size() > share) {
+            std::nth_element(cell.begin(), cell.begin() + share, cell.end(), stronger);
+            spare_.insert(spare_.end(), cell.begin() + share, cell.end());
+            cell.resize(share);
+        }
+        for (size_t j = 0; j < cell.size(); j++)
+            keys.push_back(KeyPoint(Point2f(cell[j].x, cell[j].y), 7.f, -1, (float)cell[j].score, 0));
+    }
+    size_t left = maxKeys - keys.size();
+    if (spare_.size() > left) {
+        std::nth_element(spare_.begin(), spare_.begin() + left, spare_.end(), stronger);
+        spare_.resize(left);
+    }
+    for (size_t j = 0; j < spare_.size(); j++)
+        keys.push_back(KeyPoint(Point2f(spare_[j].x, spare_[j].y), 7.f, -1, (float)spare_[j].score, 0));
+}
@@ -0,0 +1,64 @@
+/**
+ * FAST-9 corners, spread over the image by a grid.
+ *
+ * A pixel is a corner when 9 contiguous pixels of the 16 on the radius 3
+ * circle around it are all brighter, or all darker, than it by more than
+ * the threshold. Its score is the largest difference such an arc has
+ * everywhere along it (so always > threshold). Corners that aren't the
+ * strict maximum of their 3x3 neighbourhood are dropped, then the image is
+ * cut into cells and each keeps only its best, so that a few strongly
+ * textured patches can't take every keypoint tracking gets.
+ *
+ * Pixels are tested 32 at a time with AVX2, 16 with NEON, one at a time
+ * otherwise; all give identical output. Four pixels of the circle reject
+ * most of them, and for the rest the score is worked out straight away
+ * with saturating differences, which doubles as the full segment test.
+ * Buffers are kept between frames, so frames of one size allocate nothing.
+ * With AVX2 a 640x480 frame takes well under 1 ms.
+ */
+
+#ifndef FAST_DETECTOR_H
+#define FAST_DETECTOR_H
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+class FastDetector {
+public:
+    //corners closer than border to the image edge aren't reported, at least
+    //3 for the circle to fit
+    FastDetector(int threshold, int cellSize, int border = 3);
+
+    //at most maxKeys corners of an 8 bit gray image, each cell's best
+    //first: every cell gets an equal share and what is left over goes to
+    //the strongest. KeyPoint response is the score, size 7 and octave 0
+    void detect(const cv::Mat &gray, int maxKeys, std::vector<cv::KeyPoint> &keys);
+
+    int threshold() const { return threshold_; }
+    int border() const { return border_; }
+
+private:
+    FastDetector(const FastDetector &);
+    FastDetector &operator=(const FastDetector &);
+
+    struct Corner {
+        short x, y;
+        int   score;
+    };
+
+    static bool stronger(const Corner &a, const Corner &b);
+    void detectRow(const uchar *row, int step, int cols, uchar *scores, std::vector<int> &xs);
+    void suppressRow(int y, const uchar *above, const uchar *scores, const uchar *below,
+                     const std::vector<int> &xs, int gridCols);
+
+    int threshold_;
+    int cellSize_;
+    int border_;
+
+    std::vector<uchar>               scoreRows_;   // 3 rows of scores, 0 for none
+    std::vector<int>                 rowCorners_[3];
+    std::vector<std::vector<Corner> > cells_;
+    std::vector<Corner>              spare_;       // past their cell's share
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "geometry.h"
+#include <math.h>
+
+using namespace cv;
+
+//rays closer to parallel than about a degree give no usable depth
+static const double kMinParallaxCos = 0.9998;
+
+static Vec3d ray(const Camera &cam, const Pose &pose, const Point2f &p)
+{
+    Vec3d d = pose.R.t() * Vec3d((p.x - cam.cx) / cam.fx, (p.y - cam.cy) / cam.fy, 1);
+    return d * (1 / norm(d));
+}
+
+static bool reprojects(const Camera &cam, const Pose &pose, const Vec3d &x, const Point2f &p,
+                       double maxError)
+{
+    Vec3d xc = pose * x;
+    if (xc[2] <= 0)
+        return false;
+    Point2d q = cam.project(xc);
+    double dx = q.x - p.x, dy = q.y - p.y;
+    return dx * dx + dy * dy <= maxError * maxError;
+}
+
+bool triangulate(const Camera &cam, const Pose &pa, const Point2f &a,
+                 const Pose &pb, const Point2f &b, double maxError, Vec3d &x)
+{
+    Vec3d ca = pa.center(), cb = pb.center();
+    Vec3d da = ray(cam, pa, a), db = ray(cam, pb, b);
+
+    double B = da.dot(db);
+    if (B > kMinParallaxCos)
+        return false;
+
+    //closest points of the two rays, both directions being unit length
+    Vec3d  w = ca - cb;
+    double D = da.dot(w), E = db.dot(w);
+    double denom = 1 - B * B;
+    double s = (B * E - D) / denom;
+    double u = (E - B * D) / denom;
+    x = ((ca + da * s) + (cb + db * u)) * 0.5;
+
+    return reprojects(cam, pa, x, a, maxError) && reprojects(cam, pb, x, b, maxError);
+}
+
+Matx33d rotation(const Vec3d &rvec)
+{
+    Mat R;
+    Rodrigues(Mat(rvec), R);
+    return Matx33d((const double *)R.data);
+}
+
+Vec3d rotationVector(const Matx33d &R)
+{
+    Mat rvec;
+    Rodrigues(Mat(R), rvec);
+    return Vec3d((const double *)rvec.data);
+}
+
+Pose interpolate(const Pose &delta, double f)
+{
+    return Pose(rotation(rotationVector(delta.R) * f), delta.t * f);
+}
+
+void writeTum(FILE *f, uint64_t stampNs, const Pose &pose)
+{
+    //orientation of the camera in the world, as a unit quaternion
+    Matx33d R = pose.R.t();
+    double  qw, qx, qy, qz;
+    double  tr = R(0, 0) + R(1, 1) + R(2, 2);
+    if (tr > 0) {
+        double s = 2 * sqrt(tr + 1);
+        qw = s / 4;
+        qx = (R(2, 1) - R(1, 2)) / s;
+        qy = (R(0, 2) - R(2, 0)) / s;
+        qz = (R(1, 0) - R(0, 1)) / s;
+    } else if (R(0, 0) > R(1, 1) && R(0, 0) > R(2, 2)) {
+        double s = 2 * sqrt(1 + R(0, 0) - R(1, 1) - R(2, 2));
+        qw = (R(2, 1) - R(1, 2)) / s;
+        qx = s / 4;
+        qy = (R(0, 1) + R(1, 0)) / s;
+        qz = (R(0, 2) + R(2, 0)) / s;
+    } else if (R(1, 1) > R(2, 2)) {
+        double s = 2 * sqrt(1 + R(1, 1) - R(0, 0) - R(2, 2));
+        qw = (R(0, 2) - R(2, 0)) / s;
+        qx = (R(0, 1) + R(1, 0)) / s;
+        qy = s / 4;
+        qz = (R(1, 2) + R(2, 1)) / s;
+    } else {
+        double s = 2 * sqrt(1 + R(2, 2) - R(0, 0) - R(1, 1));
+        qw = (R(1, 0) - R(0, 1)) / s;
+        qx = (R(0, 2) + R(2, 0)) / s;
+        qy = (R(1, 2) + R(2, 1)) / s;
+        qz = s / 4;
+    }
+
+    Vec3d c = pose.center();
+    fprintf(f, "%llu.%09llu %.6f %.6f %.6f %.9f %.9f %.9f %.9f\n",
+            (unsigned long long)(stampNs / 1000000000ull), (unsigned long long)(stampNs % 1000000000ull),
+            c[0], c[1], c[2], qx, qy, qz, qw);
+}
@@ -0,0 +1,37 @@
+/**
+ * Small pieces of multi-view geometry the SLAM threads share.
+ */
+
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include "slam_types.h"
+#include <stdio.h>
+
+//world point seen at a in the camera at pose pa and at b in pb, by the
+//midpoint of the two rays; false unless it is in front of both cameras,
+//reprojects within maxError pixels in both and the rays meet at an angle
+//wide enough to give it a depth
+bool triangulate(const Camera &cam, const Pose &pa, const cv::Point2f &a,
+                 const Pose &pb, const cv::Point2f &b, double maxError, cv::Vec3d &x);
+
+//rotation vector <-> matrix
+cv::Matx33d rotation(const cv::Vec3d &rvec);
+cv::Vec3d   rotationVector(const cv::Matx33d &R);
+
+//fraction f of a world correction, f in [0, 1]; used to spread a loop
+//correction over the keyframes of the loop
+Pose interpolate(const Pose &delta, double f);
+
+//delta applied to a camera pose (delta moves the world, so the camera
+//sees it through its inverse)
+inline Pose corrected(const Pose &pose, const Pose &delta)
+{
+    return pose * delta.inverse();
+}
+
+//"stamp tx ty tz qx qy qz qw": the camera's position and orientation in
+//the world, the TUM RGB-D benchmark's trajectory format
+void writeTum(FILE *f, uint64_t stampNs, const Pose &pose);
+
+#endif
@@ -0,0 +1,284 @@
+#include "hamming_matcher.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#define HAMMING_AVX512 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAMMING_NEON 1
+#endif
+
+using namespace cv;
+
+static const int kDescBytes = 32;
+//more than any distance, for "none yet"
+static const int kNone      = 1 << 20;
+
+static inline int hamming(const uchar *a, const uchar *b)
+{
+#if defined(HAMMING_NEON)
+    uint8x16_t c = vaddq_u8(vcntq_u8(veorq_u8(vld1q_u8(a), vld1q_u8(b))),
+                            vcntq_u8(veorq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16))));
+    uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(c)));
+    return (int)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+#else
+    //POPCNT when the compiler targets it
+    uint64_t x[4], y[4];
+    memcpy(x, a, kDescBytes);
+    memcpy(y, b, kDescBytes);
+    return __builtin_popcountll(x[0] ^ y[0]) + __builtin_popcountll(x[1] ^ y[1])
+         + __builtin_popcountll(x[2] ^ y[2]) + __builtin_popcountll(x[3] ^ y[3]);
+#endif
+}
+
+static bool usable(const Mat &desc)
+{
+    return desc.type() == CV_8UC1 && desc.cols == kDescBytes;
+}
+
+HammingMatcher::HammingMatcher()
+    : cellSize_(0),
+      gridCols_(0),
+      gridRows_(0)
+{
+}
+
+void HammingMatcher::setTrain(const Mat &desc)
+{
+    train_ = usable(desc) ? desc : Mat();
+    where_.clear();
+    cellStart_.clear();
+    cellRows_.clear();
+    gridCols_ = gridRows_ = 0;
+
+#if defined(HAMMING_AVX512)
+    //block b, qword j, lane l: qword j of train row 8b + l; missing rows of
+    //the last block are zero, match() keeps them out
+    int blocks = (train_.rows + 7) / 8;
+    blocks_.assign(blocks * 32, 0);
+    for (int t = 0; t < train_.rows; t++) {
+        uint64_t d[4];
+        memcpy(d, train_.ptr<uchar>(t), kDescBytes);
+        for (int j = 0; j < 4; j++)
+            blocks_[(t / 8) * 32 + j * 8 + t % 8] = d[j];
+    }
+#endif
+}
+
+void HammingMatcher::setTrain(const Mat &desc, const std::vector<KeyPoint> &keys, int cellSize)
+{
+    setTrain(desc);
+    if (train_.empty() || keys.size() != (size_t)train_.rows)
+        return;
+
+    //counting sort of the rows by cell
+    cellSize_ = std::max(1, cellSize);
+    where_.resize(keys.size());
+    float maxX = 0, maxY = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+        where_[i] = Point2f(std::max(0.f, keys[i].pt.x), std::max(0.f, keys[i].pt.y));
+        maxX = std::max(maxX, where_[i].x);
+        maxY = std::max(maxY, where_[i].y);
+    }
+    gridCols_ = (int)(maxX / cellSize_) + 1;
+    gridRows_ = (int)(maxY / cellSize_) + 1;
+    cellStart_.assign(gridCols_ * gridRows_ + 1, 0);
+    for (size_t i = 0; i < where_.size(); i++)
+        cellStart_[(int)(where_[i].y / cellSize_) * gridCols_ + (int)(where_[i].x / cellSize_) + 1]++;
+    for (size_t c = 1; c < cellStart_.size(); c++)
+        cellStart_[c] += cellStart_[c - 1];
+    cellRows_.resize(where_.size());
+    std::vector<int> fill(cellStart_.begin(), cellStart_.end() - 1);
+    for (size_t i = 0; i < where_.size(); i++)
+        cellRows_[fill[(int)(where_[i].y / cellSize_) * gridCols_ + (int)(where_[i].x / cellSize_)]++] = (int)i;
+}
+
+#if defined(HAMMING_AVX512)
+//Q queries from row q against every block of train rows at once, so each
+//block is loaded once for all of them and their updates overlap. Per lane
+//the best distance, its train row and the second best are kept, and
+//merged across lanes at the end
+template<int Q>
+void HammingMatcher::matchBlocks(const Mat &query, int q, int blocks, int n, bool crossCheck)
+{
+    const __m512i  big   = _mm512_set1_epi64(kNone);
+    const __m512i  eight = _mm512_set1_epi64(8);
+    const __mmask8 last  = n % 8 == 0 ? 0xff : (__mmask8)((1 << (n % 8)) - 1);
+
+    __m512i qd[Q][4], best[Q], second[Q], bestIdx[Q], self[Q];
+    for (int k = 0; k < Q; k++) {
+        uint64_t d[4];
+        memcpy(d, query.ptr<uchar>(q + k), kDescBytes);
+        for (int j = 0; j < 4; j++)
+            qd[k][j] = _mm512_set1_epi64((long long)d[j]);
+        best[k]    = big;
+        second[k]  = big;
+        bestIdx[k] = _mm512_set1_epi64(-1);
+        self[k]    = _mm512_set1_epi64(q + k);
+    }
+
+    __m512i idx = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+    for (int b = 0; b < blocks; b++) {
+        const uint64_t *blk = &blocks_[b * 32];
+        __m512i t0 = _mm512_loadu_si512(blk), t1 = _mm512_loadu_si512(blk + 8);
+        __m512i t2 = _mm512_loadu_si512(blk + 16), t3 = _mm512_loadu_si512(blk + 24);
+        for (int k = 0; k < Q; k++) {
+            __m512i d = _mm512_add_epi64(
+                _mm512_add_epi64(_mm512_popcnt_epi64(_mm512_xor_si512(qd[k][0], t0)),
+                                 _mm512_popcnt_epi64(_mm512_xor_si512(qd[k][1], t1))),
+                _mm512_add_epi64(_mm512_popcnt_epi64(_mm512_xor_si512(qd[k][2], t2)),
+                                 _mm512_popcnt_epi64(_mm512_xor_si512(qd[k][3], t3))));
+            if (b == blocks - 1)
+                d = _mm512_mask_mov_epi64(big, last, d);
+
+            __mmask8 better = _mm512_cmplt_epi64_mask(d, best[k]);
+            second[k]  = _mm512_min_epi64(second[k], _mm512_max_epi64(d, best[k]));
+            best[k]    = _mm512_min_epi64(best[k], d);
+            bestIdx[k] = _mm512_mask_mov_epi64(bestIdx[k], better, idx);
+
+            if (crossCheck) {
+                int64_t *tb = &trainBest_[b * 8], *ti = &trainBestIdx_[b * 8];
+                __m512i  was  = _mm512_loadu_si512(tb);
+                __mmask8 mine = _mm512_cmplt_epi64_mask(d, was);
+                _mm512_storeu_si512(tb, _mm512_mask_mov_epi64(was, mine, d));
+                _mm512_storeu_si512(ti, _mm512_mask_mov_epi64(_mm512_loadu_si512(ti), mine, self[k]));
+            }
+        }
+        idx = _mm512_add_epi64(idx, eight);
+    }
+
+    for (int k = 0; k < Q; k++) {
+        int64_t b1[8], b2[8], i1[8];
+        _mm512_storeu_si512(b1, best[k]);
+        _mm512_storeu_si512(b2, second[k]);
+        _mm512_storeu_si512(i1, bestIdx[k]);
+        int w = 0;
+        for (int l = 1; l < 8; l++) {
+            if (b1[l] < b1[w] || (b1[l] == b1[w] && i1[l] < i1[w]))
+                w = l;
+        }
+        Candidate &c = found_[q + k];
+        c.best     = (int)b1[w];
+        c.trainIdx = (int)i1[w];
+        c.second   = (int)b2[w];
+        for (int l = 0; l < 8; l++) {
+            if (l != w)
+                c.second = std::min(c.second, (int)b1[l]);
+        }
+    }
+}
+#endif
+
+void HammingMatcher::match(const Mat &query, float ratio, int maxDistance, bool crossCheck,
+                           std::vector<DMatch> &matches)
+{
+    matches.clear();
+    int n = train_.rows;
+    if (!usable(query) || query.rows == 0 || n == 0)
+        return;
+
+    Candidate none = { kNone, kNone, -1 };
+    found_.assign(query.rows, none);
+    trainBest_.assign(((n + 7) / 8) * 8, kNone);
+    trainBestIdx_.assign(trainBest_.size(), -1);
+
+#if defined(HAMMING_AVX512)
+    int blocks = (n + 7) / 8;
+    int q = 0;
+    for (; q + 4 <= query.rows; q += 4)
+        matchBlocks<4>(query, q, blocks, n, crossCheck);
+    for (; q < query.rows; q++)
+        matchBlocks<1>(query, q, blocks, n, crossCheck);
+#else
+    for (int q = 0; q < query.rows; q++) {
+        const uchar *qd = query.ptr<uchar>(q);
+        Candidate   &c  = found_[q];
+        for (int t = 0; t < n; t++) {
+            int d = hamming(qd, train_.ptr<uchar>(t));
+            if (d < c.best) {
+                c.second   = c.best;
+                c.best     = d;
+                c.trainIdx = t;
+            } else if (d < c.second) {
+                c.second = d;
+            }
+            if (crossCheck && d < trainBest_[t]) {
+                trainBest_[t]    = d;
+                trainBestIdx_[t] = q;
+            }
+        }
+    }
+#endif
+    keep(found_, ratio, maxDistance, crossCheck, matches);
+}
+
+void HammingMatcher::matchWindowed(const Mat &query, const std::vector<Point2f> &where, float radius,
+                                   float ratio, int maxDistance, bool crossCheck,
+                                   std::vector<DMatch> &matches)
+{
+    matches.clear();
+    if (!usable(query) || where.size() != (size_t)query.rows || where_.empty())
+        return;
+
+    Candidate none = { kNone, kNone, -1 };
+    found_.assign(query.rows, none);
+    trainBest_.assign(train_.rows, kNone);
+    trainBestIdx_.assign(train_.rows, -1);
+
+    float r2 = radius * radius;
+    for (int q = 0; q < query.rows; q++) {
+        float x = where[q].x, y = where[q].y;
+        if (!(x >= 0) || !(y >= 0))
+            continue;
+        int cx0 = (int)((x - radius) / cellSize_), cx1 = (int)((x + radius) / cellSize_);
+        int cy0 = (int)((y - radius) / cellSize_), cy1 = (int)((y + radius) / cellSize_);
+        cx0 = std::max(0, cx0);
+        cy0 = std::max(0, cy0);
+        cx1 = std::min(gridCols_ - 1, cx1);
+        cy1 = std::min(gridRows_ - 1, cy1);
+
+        const uchar *qd = query.ptr<uchar>(q);
+        Candidate   &c  = found_[q];
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                int cell = cy * gridCols_ + cx;
+                for (int k = cellStart_[cell]; k < cellStart_[cell + 1]; k++) {
+                    int   t  = cellRows_[k];
+                    float dx = where_[t].x - x, dy = where_[t].y - y;
+                    if (dx * dx + dy * dy > r2)
+                        continue;
+                    int d = hamming(qd, train_.ptr<uchar>(t));
+                    if (d < c.best || (d == c.best && t < c.trainIdx)) {
+                        c.second   = c.best;
+                        c.best     = d;
+                        c.trainIdx = t;
+                    } else if (d < c.second) {
+                        c.second = d;
+                    }
+                    if (crossCheck && d < trainBest_[t]) {
+                        trainBest_[t]    = d;
+                        trainBestIdx_[t] = q;
+                    }
+                }
+            }
+        }
+    }
+    keep(found_, ratio, maxDistance, crossCheck, matches);
+}
+
+void HammingMatcher::keep(const std::vector<Candidate> &found, float ratio, int maxDistance,
+                          bool crossCheck, std::vector<DMatch> &matches) const
+{
+    for (size_t q = 0; q < found.size(); q++) {
+        const Candidate &c = found[q];
+        if (c.trainIdx < 0 || c.best > maxDistance)
+            continue;
+        if (ratio < 1 && c.second != kNone && c.best >= ratio * c.second)
+            continue;
+        if (crossCheck && trainBestIdx_[c.trainIdx] != (int64_t)q)
+            continue;
+        matches.push_back(DMatch((int)q, c.trainIdx, (float)c.best));
+    }
+}
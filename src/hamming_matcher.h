@@ -0,0 +1,75 @@
+/**
+ * Nearest neighbours of 256 bit descriptors by Hamming distance.
+ *
+ * match() compares every query descriptor with every train descriptor.
+ * With AVX-512 VPOPCNTDQ the train set is laid out transposed in blocks of
+ * eight, so one query is compared with eight of them in four XORs and four
+ * population counts, and the best and second best are kept per lane
+ * without leaving the vector registers. Otherwise each pair costs four
+ * 64 bit POPCNTs, or NEON's per byte counts.
+ *
+ * matchWindowed() is for when it is known roughly where each query should
+ * be found, as tracking knows from where the map points project: train
+ * descriptors are indexed by position in a grid, and a query is only
+ * compared with those within a radius of where it is expected.
+ *
+ * Both keep a match only if its distance is at most maxDistance, if it is
+ * clearly better than the second best (best < ratio x second, ratio >= 1
+ * turns that off; a lone candidate always passes) and, with crossCheck,
+ * if the query is also the train descriptor's best among all queries that
+ * were compared with it.
+ */
+
+#ifndef HAMMING_MATCHER_H
+#define HAMMING_MATCHER_H
+
+#include "opencv2/opencv.hpp"
+#include <stdint.h>
+#include <vector>
+
+class HammingMatcher {
+public:
+    HammingMatcher();
+
+    //the descriptors to search, 32 byte rows of CV_8UC1; positions, one
+    //per row, and the grid cell size are only needed for matchWindowed()
+    void setTrain(const cv::Mat &desc);
+    void setTrain(const cv::Mat &desc, const std::vector<cv::KeyPoint> &keys, int cellSize);
+
+    //DMatch queryIdx and trainIdx are rows of query and of the train set
+    void match(const cv::Mat &query, float ratio, int maxDistance, bool crossCheck,
+               std::vector<cv::DMatch> &matches);
+
+    //query row i only against train descriptors within radius of where[i],
+    //skipped if where[i].x is negative
+    void matchWindowed(const cv::Mat &query, const std::vector<cv::Point2f> &where, float radius,
+                       float ratio, int maxDistance, bool crossCheck, std::vector<cv::DMatch> &matches);
+
+private:
+    HammingMatcher(const HammingMatcher &);
+    HammingMatcher &operator=(const HammingMatcher &);
+
+    struct Candidate {
+        int best, second, trainIdx;
+    };
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+    template<int Q>
+    void matchBlocks(const cv::Mat &query, int q, int blocks, int n, bool crossCheck);
+#endif
+    void keep(const std::vector<Candidate> &found, float ratio, int maxDistance, bool crossCheck,
+              std::vector<cv::DMatch> &matches) const;
+
+    cv::Mat                    train_;
+    std::vector<uint64_t>      blocks_;        // AVX-512 only: blocks of 8 transposed
+    std::vector<cv::Point2f>   where_;         // train positions
+    int                        cellSize_;
+    int                        gridCols_, gridRows_;
+    std::vector<int>           cellStart_;     // train rows of cell c: cellRows_[cellStart_[c]..cellStart_[c + 1])
+    std::vector<int>           cellRows_;
+    std::vector<Candidate>     found_;         // per query
+    std::vector<int64_t>       trainBest_;     // per train row, distance to its best query
+    std::vector<int64_t>       trainBestIdx_;  // and which query that is
+};
+
+#endif
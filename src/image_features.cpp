@@ -0,0 +1,86 @@
+#include "image_features.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace cv;
+
+//FAST threshold, and the cells keypoints are spread over on each level
+static const int    kFastThreshold = 20;
+static const int    kCellSize      = 32;
+//pyramid, as ORB's defaults
+static const int    kLevels        = 8;
+static const double kScale         = 1.2;
+
+FeatureExtractor::FeatureExtractor(int maxFeatures)
+    : maxFeatures_(maxFeatures),
+      fast_(kFastThreshold, kCellSize, kOrbRadius + 1),
+      current_(0),
+      built_(false)
+{
+}
+
+void FeatureExtractor::extract(const Mat &gray, std::vector<KeyPoint> &keys, Mat &desc)
+{
+    buildPyramid(gray);
+    extract(keys, desc);
+}
+
+bool FeatureExtractor::buildPyramid(const Mat &gray)
+{
+    //smoothed levels are only made if keys are wanted
+    current_ ^= 1;
+    built_    = pyramids_[current_].build(gray, kLevels, kScale, false);
+    return built_;
+}
+
+void FeatureExtractor::extract(std::vector<KeyPoint> &keys, Mat &desc)
+{
+    keys.clear();
+    samples_.clear();
+    if (!built_) {
+        desc.release();
+        return;
+    }
+    ImagePyramid &pyr = pyramids_[current_];
+    pyr.smooth();
+
+    //shares shrinking by the scale factor from level to level; what a level
+    //can't use goes to the next one
+    int    levels = pyr.levels();
+    double f      = 1 / kScale;
+    double share  = maxFeatures_ * (1 - f) / (1 - pow(f, levels));
+    int    left   = maxFeatures_, unused = 0;
+    for (int i = 0; i < levels && left > 0; i++, share *= f) {
+        int want = i + 1 < levels ? std::min(left, cvRound(share) + unused) : left;
+        const Mat &level = pyr.level(i);
+        fast_.detect(level, want, levelKeys_);
+
+        double s = pyr.scale(i);
+        for (size_t k = 0; k < levelKeys_.size(); k++) {
+            Sample smp;
+            smp.x   = (int)levelKeys_[k].pt.x;
+            smp.y   = (int)levelKeys_[k].pt.y;
+            smp.bin = orb_.angleBin(level, smp.x, smp.y);
+            samples_.push_back(smp);
+            keys.push_back(KeyPoint(Point2f((float)(smp.x * s), (float)(smp.y * s)),
+                                    (float)((2 * kOrbRadius + 1) * s),
+                                    smp.bin * 360.f / kOrbAngles, levelKeys_[k].response, i));
+        }
+        unused = want - (int)levelKeys_.size();
+        left  -= (int)levelKeys_.size();
+    }
+
+    desc.create((int)keys.size(), kOrbBytes, CV_8UC1);
+    for (size_t k = 0; k < keys.size(); k++) {
+        const Sample &smp = samples_[k];
+        orb_.describe(pyr.smoothed(keys[k].octave), smp.x, smp.y, smp.bin, desc.ptr<uchar>((int)k));
+    }
+}
+
+void matchDescriptors(const Mat &query, const Mat &train, float ratio, bool crossCheck,
+                      std::vector<DMatch> &matches)
+{
+    HammingMatcher matcher;
+    matcher.setTrain(train);
+    matcher.match(query, ratio, kMaxMatchDistance, crossCheck, matches);
+}
@@ -0,0 +1,73 @@
+/**
+ * Keypoints, binary descriptors and descriptor matching for the SLAM
+ * frontend.
+ *
+ * Keys are FAST corners found on every level of a scale pyramid, each
+ * level getting a share of them in proportion to its size, and described
+ * by oriented BRIEF (orb_descriptor.h): ORB, put together from parts that
+ * keep their buffers from frame to frame. Key coordinates are level 0
+ * pixels, octave is the level.
+ *
+ * Descriptors are 256 bit (32 byte) rows compared by Hamming distance;
+ * everything downstream only depends on that, not on how they are made.
+ */
+
+#ifndef IMAGE_FEATURES_H
+#define IMAGE_FEATURES_H
+
+#include "opencv2/opencv.hpp"
+#include "fast_detector.h"
+#include "image_pyramid.h"
+#include "orb_descriptor.h"
+#include "hamming_matcher.h"
+#include <vector>
+
+class FeatureExtractor {
+public:
+    explicit FeatureExtractor(int maxFeatures);
+
+    //keys and one kOrbBytes descriptor row per key, all in one block, from
+    //an 8 bit gray image
+    void extract(const cv::Mat &gray, std::vector<cv::KeyPoint> &keys, cv::Mat &desc);
+
+    //the same in two steps, for frames that may not need keys: the pyramid
+    //of an 8 bit gray image (false for anything else), then keys from it
+    bool buildPyramid(const cv::Mat &gray);
+    void extract(std::vector<cv::KeyPoint> &keys, cv::Mat &desc);
+
+    //the pyramid of the last frame built, and of the one before it; the
+    //smoothed levels only once keys were extracted from it
+    const ImagePyramid &pyramid() const { return pyramids_[current_]; }
+    const ImagePyramid &lastPyramid() const { return pyramids_[current_ ^ 1]; }
+
+private:
+    FeatureExtractor(const FeatureExtractor &);
+    FeatureExtractor &operator=(const FeatureExtractor &);
+
+    //where a key is on its level
+    struct Sample {
+        int x, y, bin;
+    };
+
+    int                       maxFeatures_;
+    FastDetector              fast_;
+    OrbDescriber              orb_;
+    ImagePyramid              pyramids_[2];
+    int                       current_;    // which one is this frame's
+    bool                      built_;      // it is usable
+    std::vector<cv::KeyPoint> levelKeys_;
+    std::vector<Sample>       samples_;    // one per key
+};
+
+//descriptors further apart than this never match (ORB-SLAM's TH_HIGH)
+static const int kMaxMatchDistance = 100;
+
+//for each row of query, its nearest row of train when that one is clearly
+//nearer than the second nearest (distance < ratio x second's) and, with
+//crossCheck, the query row is that train row's nearest too; DMatch
+//queryIdx/trainIdx index the rows. For one-off searches: HammingMatcher
+//keeps the train set for searching it again, or only near given positions
+void matchDescriptors(const cv::Mat &query, const cv::Mat &train, float ratio, bool crossCheck,
+                      std::vector<cv::DMatch> &matches);
+
+#endif
@@ -0,0 +1,68 @@
+#include "image_pyramid.h"
+#include <math.h>
+
+using namespace cv;
+
+//levels smaller than this aren't worth building
+static const int kMinLevelSize = 16;
+
+ImagePyramid::ImagePyramid()
+    : step_(0),
+      isSmoothed_(false)
+{
+}
+
+bool ImagePyramid::build(const Mat &gray, int levels, double scale, bool smoothed)
+{
+    if (gray.type() != CV_8UC1 || gray.empty() || levels < 1 || scale <= 1)
+        return false;
+
+    //sizes first, so the arena is sized once
+    std::vector<Size> sizes;
+    scales_.clear();
+    for (int i = 0; i < levels; i++) {
+        double s = pow(scale, i);
+        Size size(cvRound(gray.cols / s), cvRound(gray.rows / s));
+        if (i > 0 && (size.width < kMinLevelSize || size.height < kMinLevelSize))
+            break;
+        sizes.push_back(size);
+        scales_.push_back(s);
+    }
+
+    //rows padded to 32 bytes for the SIMD code reading them
+    step_ = (gray.cols + 31) & ~(size_t)31;
+    size_t rows = 0;
+    for (size_t i = 0; i < sizes.size(); i++)
+        rows += sizes[i].height;
+    size_t bytes = rows * step_ * 2;
+    if (arena_.size() < bytes)
+        arena_.resize(bytes);
+
+    levels_.resize(sizes.size());
+    smoothed_.resize(sizes.size());
+    uchar *p = &arena_[0];
+    for (size_t i = 0; i < sizes.size(); i++) {
+        levels_[i] = Mat(sizes[i], CV_8UC1, p, step_);
+        p += sizes[i].height * step_;
+        smoothed_[i] = Mat(sizes[i], CV_8UC1, p, step_);
+        p += sizes[i].height * step_;
+    }
+
+    //the headers have the right size and type, so nothing below reallocates
+    gray.copyTo(levels_[0]);
+    for (size_t i = 1; i < levels_.size(); i++)
+        resize(levels_[i - 1], levels_[i], sizes[i], 0, 0, INTER_LINEAR);
+    isSmoothed_ = false;
+    if (smoothed)
+        smooth();
+    return true;
+}
+
+void ImagePyramid::smooth()
+{
+    if (isSmoothed_)
+        return;
+    for (size_t i = 0; i < smoothed_.size(); i++)
+        GaussianBlur(levels_[i], smoothed_[i], Size(7, 7), 2, 2, BORDER_REFLECT_101);
+    isSmoothed_ = true;
+}
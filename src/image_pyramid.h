@@ -0,0 +1,55 @@
+/**
+ * Scale pyramid of a gray frame, every level in one buffer.
+ *
+ * Level 0 is a copy of the frame and each level after it is the one
+ * before shrunk by the scale factor. All levels, and their smoothed copies
+ * when asked for, live in a single arena with one row stride, so that a
+ * pixel offset worked out once holds on every level. The arena is kept
+ * from frame to frame and only grows: after the first frame of a size
+ * building a pyramid allocates nothing. Levels are Mat headers over the
+ * arena, valid until the next build().
+ *
+ * Smoothing can wait: room for the smoothed copies is always kept, and
+ * smooth() fills it in for a pyramid built without them, so a frame that
+ * only needs the plain levels (optical flow) doesn't pay for the blur.
+ */
+
+#ifndef IMAGE_PYRAMID_H
+#define IMAGE_PYRAMID_H
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+class ImagePyramid {
+public:
+    ImagePyramid();
+
+    //levels levels of an 8 bit gray image, each scale times smaller than
+    //the one before; with smoothed, each also blurred by a 7x7 Gaussian of
+    //sigma 2. false for anything but CV_8UC1
+    bool build(const cv::Mat &gray, int levels, double scale, bool smoothed);
+    //the smoothed copies, if build() wasn't asked for them
+    void smooth();
+
+    int            levels() const { return (int)levels_.size(); }
+    const cv::Mat &level(int i) const { return levels_[i]; }
+    //only once build() or smooth() made them
+    const cv::Mat &smoothed(int i) const { return smoothed_[i]; }
+    //level i's pixel size in level 0 pixels
+    double         scale(int i) const { return scales_[i]; }
+    //row stride of every level, in bytes
+    size_t         step() const { return step_; }
+
+private:
+    ImagePyramid(const ImagePyramid &);
+    ImagePyramid &operator=(const ImagePyramid &);
+
+    std::vector<uchar>   arena_;
+    size_t               step_;
+    std::vector<cv::Mat> levels_;
+    std::vector<cv::Mat> smoothed_;
+    std::vector<double>  scales_;
+    bool                 isSmoothed_;
+};
+
+#endif
@@ -0,0 +1,406 @@
+#include "klt_tracker.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KLT_NEON 1
+#endif
+
+using namespace cv;
+
+//the window is kWin pixels square, read with a pixel round it for the
+//gradients; buffer rows are kLanes wide whatever is used of them
+static const int kHalf  = 6;
+static const int kWin   = 2 * kHalf + 1;
+static const int kPatch = kWin + 2;
+static const int kLanes = 16;
+//pyramid levels used, every kLevelStride-th up to kMaxLevel: 1.2^2 apart,
+//the coarsest a third of the size of level 0
+static const int kLevelStride = 2;
+static const int kMaxLevel    = 6;
+//Gauss-Newton steps per level, and the step that counts as converged
+static const int   kMaxSteps = 10;
+static const float kMinStep  = 0.03f;
+//smallest eigenvalue of the window's gradient matrix, per pixel, in grey
+//levels squared per pixel squared: below it there is no texture to track
+static const double kMinEigen = 0.1;
+//forward-backward: how near the start a point must come back, in pixels
+static const float kMaxBackError = 0.7f;
+//bilinear weights, fixed point
+static const int kWeightBits = 14;
+
+struct Weights {
+    int w00, w01, w10, w11;
+};
+
+//the top left pixel of a size pixel square with corner (x, y) on img, and
+//the weights of it and its neighbours; NULL if the square (and the pixel
+//beyond, for interpolation) isn't inside img
+static const uchar *corner(const Mat &img, float x, float y, int size, Weights &w)
+{
+    if (!(x >= 0) || !(y >= 0))
+        return NULL;
+    int ix = (int)x, iy = (int)y;
+    if (ix + size >= img.cols || iy + size >= img.rows)
+        return NULL;
+    float a = x - ix, b = y - iy;
+    w.w00 = cvRound((1 - a) * (1 - b) * (1 << kWeightBits));
+    w.w01 = cvRound(a * (1 - b) * (1 << kWeightBits));
+    w.w10 = cvRound((1 - a) * b * (1 << kWeightBits));
+    w.w11 = (1 << kWeightBits) - w.w00 - w.w01 - w.w10;
+    return img.ptr<uchar>(iy) + ix;
+}
+
+//x * k / 32768, rounded, as the SIMD rounding multiplies do it
+static inline int mulRound(int x, int k)
+{
+    return (x * k + (1 << 14)) >> 15;
+}
+
+//the Scharr kernel, 3 10 3, divided by 32 so that gradients keep the
+//scale of the intensities: 3/32 and 10/32 of 32768
+static const int kScharr3  = 3072;
+static const int kScharr10 = 10240;
+
+#if defined(__AVX2__)
+//16 pixels of a row from p, bilinearly, with 5 fractional bits; w0 and w1
+//hold the weight pairs of the row and of the one below
+static inline __m256i interpolateRow(const uchar *p, size_t step, __m256i w0, __m256i w1)
+{
+    const __m256i half = _mm256_set1_epi32(1 << (kWeightBits - 6));
+    __m128i a = _mm_loadu_si128((const __m128i *)p), b = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + step)), d = _mm_loadu_si128((const __m128i *)(p + step + 1));
+    //pixel pairs side by side, so one multiply-add weighs both
+    __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b)), w0),
+                                  _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(c, d)), w1));
+    __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b)), w0),
+                                  _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(c, d)), w1));
+    lo = _mm256_srai_epi32(_mm256_add_epi32(lo, half), kWeightBits - 5);
+    hi = _mm256_srai_epi32(_mm256_add_epi32(hi, half), kWeightBits - 5);
+    //packs works within 128 bit halves: put the quarters back in order
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+}
+
+//lanes N along, zeros shifted in at the top
+template<int N>
+static inline __m256i laneShift(__m256i v)
+{
+    return _mm256_alignr_epi8(_mm256_permute2x128_si256(v, v, 0x81), v, 2 * N);
+}
+
+static inline int64_t sum32(__m256i v)
+{
+    int32_t s[8];
+    _mm256_storeu_si256((__m256i *)s, v);
+    return (int64_t)s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+}
+#elif defined(KLT_NEON)
+static inline int16x8_t interpolate8(uint8x8_t a, uint8x8_t b, uint8x8_t c, uint8x8_t d, const Weights &w)
+{
+    uint16x8_t a16 = vmovl_u8(a), b16 = vmovl_u8(b), c16 = vmovl_u8(c), d16 = vmovl_u8(d);
+    uint32x4_t lo = vmull_n_u16(vget_low_u16(a16), (uint16_t)w.w00);
+    lo = vmlal_n_u16(lo, vget_low_u16(b16), (uint16_t)w.w01);
+    lo = vmlal_n_u16(lo, vget_low_u16(c16), (uint16_t)w.w10);
+    lo = vmlal_n_u16(lo, vget_low_u16(d16), (uint16_t)w.w11);
+    uint32x4_t hi = vmull_n_u16(vget_high_u16(a16), (uint16_t)w.w00);
+    hi = vmlal_n_u16(hi, vget_high_u16(b16), (uint16_t)w.w01);
+    hi = vmlal_n_u16(hi, vget_high_u16(c16), (uint16_t)w.w10);
+    hi = vmlal_n_u16(hi, vget_high_u16(d16), (uint16_t)w.w11);
+    return vreinterpretq_s16_u16(vcombine_u16(vrshrn_n_u32(lo, kWeightBits - 5),
+                                              vrshrn_n_u32(hi, kWeightBits - 5)));
+}
+
+//16 pixels of a row from p, bilinearly, with 5 fractional bits
+static inline void interpolateRow(const uchar *p, size_t step, const Weights &w, int16x8_t &lo, int16x8_t &hi)
+{
+    uint8x16_t a = vld1q_u8(p), b = vld1q_u8(p + 1), c = vld1q_u8(p + step), d = vld1q_u8(p + step + 1);
+    lo = interpolate8(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c), vget_low_u8(d), w);
+    hi = interpolate8(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c), vget_high_u8(d), w);
+}
+
+//sums of products of the 16 lanes of a and b, two per 32 bit lane
+static inline int32x4_t multiplyAdd(int32x4_t s, int16x8_t a, int16x8_t b)
+{
+    s = vmlal_s16(s, vget_low_s16(a), vget_low_s16(b));
+    return vmlal_s16(s, vget_high_s16(a), vget_high_s16(b));
+}
+
+static inline int64_t sum32(int32x4_t v)
+{
+    return (int64_t)vgetq_lane_s32(v, 0) + vgetq_lane_s32(v, 1) + vgetq_lane_s32(v, 2) + vgetq_lane_s32(v, 3);
+}
+#endif
+
+//the first frame's window at p: its pixels into win, their Scharr gradients
+//in the intensities' scale into dx and dy, and the sums over it of dx dx,
+//dx dy and dy dy. Rows are kLanes long; gradient lanes past the window are
+//zeroed so they add nothing to any sum. 32 bit lanes are enough for the
+//sums: each gets at most 2 x 13 products of gradients, which are under 4096
+static void prepareWindow(const uchar *p, size_t step, const Weights &w, int16_t *win, int16_t *dx, int16_t *dy,
+                          int64_t &a11, int64_t &a12, int64_t &a22)
+{
+#if defined(__AVX2__)
+    //rows of the patch are made in turn and kept in registers, three at a
+    //time: stored and read back one or two lanes along they would stall
+    const __m256i k3 = _mm256_set1_epi16(kScharr3), k10 = _mm256_set1_epi16(kScharr10);
+    const __m256i used = _mm256_setr_epi16(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0);
+    __m256i w0 = _mm256_set1_epi32(w.w00 | w.w01 << 16), w1 = _mm256_set1_epi32(w.w10 | w.w11 << 16);
+    __m256i r0 = interpolateRow(p, step, w0, w1), r1 = interpolateRow(p + step, step, w0, w1);
+    __m256i s11 = _mm256_setzero_si256(), s12 = s11, s22 = s11;
+    p += 2 * step;
+    for (int r = 0; r < kWin; r++, p += step, win += kLanes, dx += kLanes, dy += kLanes) {
+        __m256i r2 = interpolateRow(p, step, w0, w1);
+        __m256i a1 = laneShift<1>(r0), a2 = laneShift<2>(r0);
+        __m256i b1 = laneShift<1>(r1), b2 = laneShift<2>(r1);
+        __m256i c1 = laneShift<1>(r2), c2 = laneShift<2>(r2);
+
+        __m256i ex = _mm256_add_epi16(_mm256_sub_epi16(a2, r0), _mm256_sub_epi16(c2, r2));
+        __m256i gx = _mm256_add_epi16(_mm256_mulhrs_epi16(ex, k3), _mm256_mulhrs_epi16(_mm256_sub_epi16(b2, r1), k10));
+        __m256i ey = _mm256_add_epi16(_mm256_sub_epi16(r2, r0), _mm256_sub_epi16(c2, a2));
+        __m256i gy = _mm256_add_epi16(_mm256_mulhrs_epi16(ey, k3), _mm256_mulhrs_epi16(_mm256_sub_epi16(c1, a1), k10));
+        gx = _mm256_and_si256(gx, used);
+        gy = _mm256_and_si256(gy, used);
+        _mm256_storeu_si256((__m256i *)win, b1);
+        _mm256_storeu_si256((__m256i *)dx, gx);
+        _mm256_storeu_si256((__m256i *)dy, gy);
+        s11 = _mm256_add_epi32(s11, _mm256_madd_epi16(gx, gx));
+        s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(gx, gy));
+        s22 = _mm256_add_epi32(s22, _mm256_madd_epi16(gy, gy));
+        r0 = r1;
+        r1 = r2;
+    }
+    a11 = sum32(s11);
+    a12 = sum32(s12);
+    a22 = sum32(s22);
+#elif defined(KLT_NEON)
+    static const int16_t usedLanes[kLanes] = { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0 };
+    const int16x8_t zero = vdupq_n_s16(0);
+    int16x8_t row[3][2];
+    interpolateRow(p, step, w, row[0][0], row[0][1]);
+    interpolateRow(p + step, step, w, row[1][0], row[1][1]);
+    int32x4_t s11 = vdupq_n_s32(0), s12 = s11, s22 = s11, t11 = s11, t12 = s11, t22 = s11;
+    p += 2 * step;
+    for (int r = 0; r < kWin; r++, p += step, win += kLanes, dx += kLanes, dy += kLanes) {
+        interpolateRow(p, step, w, row[2][0], row[2][1]);
+        int16x8_t g[2][2];
+        for (int h = 0; h < 2; h++) {
+            //lanes one and two along, across the two halves of a row
+            int16x8_t a0 = row[0][h], b0 = row[1][h], c0 = row[2][h];
+            int16x8_t an = h ? zero : row[0][1], bn = h ? zero : row[1][1], cn = h ? zero : row[2][1];
+            int16x8_t a1 = vextq_s16(a0, an, 1), a2 = vextq_s16(a0, an, 2);
+            int16x8_t b1 = vextq_s16(b0, bn, 1), b2 = vextq_s16(b0, bn, 2);
+            int16x8_t c1 = vextq_s16(c0, cn, 1), c2 = vextq_s16(c0, cn, 2);
+            int16x8_t used = vld1q_s16(usedLanes + 8 * h);
+
+            int16x8_t ex = vaddq_s16(vsubq_s16(a2, a0), vsubq_s16(c2, c0));
+            int16x8_t gx = vaddq_s16(vqrdmulhq_n_s16(ex, kScharr3), vqrdmulhq_n_s16(vsubq_s16(b2, b0), kScharr10));
+            int16x8_t ey = vaddq_s16(vsubq_s16(c0, a0), vsubq_s16(c2, a2));
+            int16x8_t gy = vaddq_s16(vqrdmulhq_n_s16(ey, kScharr3), vqrdmulhq_n_s16(vsubq_s16(c1, a1), kScharr10));
+            g[h][0] = vandq_s16(gx, used);
+            g[h][1] = vandq_s16(gy, used);
+            vst1q_s16(win + 8 * h, b1);
+            vst1q_s16(dx + 8 * h, g[h][0]);
+            vst1q_s16(dy + 8 * h, g[h][1]);
+        }
+        s11 = multiplyAdd(s11, g[0][0], g[0][0]);
+        s12 = multiplyAdd(s12, g[0][0], g[0][1]);
+        s22 = multiplyAdd(s22, g[0][1], g[0][1]);
+        t11 = multiplyAdd(t11, g[1][0], g[1][0]);
+        t12 = multiplyAdd(t12, g[1][0], g[1][1]);
+        t22 = multiplyAdd(t22, g[1][1], g[1][1]);
+        for (int h = 0; h < 2; h++) {
+            row[0][h] = row[1][h];
+            row[1][h] = row[2][h];
+        }
+    }
+    a11 = sum32(s11) + sum32(t11);
+    a12 = sum32(s12) + sum32(t12);
+    a22 = sum32(s22) + sum32(t22);
+#else
+    //the patch first, kLanes pixels of each row as the SIMD code makes
+    //them, past which the shifted lanes are zero
+    const int half = 1 << (kWeightBits - 6);
+    int16_t patch[kPatch][kLanes + 2];
+    for (int r = 0; r < kPatch; r++, p += step) {
+        for (int c = 0; c < kLanes; c++)
+            patch[r][c] = (int16_t)((p[c] * w.w00 + p[c + 1] * w.w01 + p[step + c] * w.w10 + p[step + c + 1] * w.w11
+                                     + half) >> (kWeightBits - 5));
+        patch[r][kLanes] = patch[r][kLanes + 1] = 0;
+    }
+
+    a11 = a12 = a22 = 0;
+    for (int r = 0; r < kWin; r++, win += kLanes, dx += kLanes, dy += kLanes) {
+        const int16_t *p0 = patch[r], *p1 = patch[r + 1], *p2 = patch[r + 2];
+        for (int c = 0; c < kLanes; c++) {
+            win[c] = p1[c + 1];
+            if (c >= kWin) {
+                dx[c] = dy[c] = 0;
+                continue;
+            }
+            dx[c] = (int16_t)(mulRound((p0[c + 2] - p0[c]) + (p2[c + 2] - p2[c]), kScharr3)
+                            + mulRound(p1[c + 2] - p1[c], kScharr10));
+            dy[c] = (int16_t)(mulRound((p2[c] - p0[c]) + (p2[c + 2] - p0[c + 2]), kScharr3)
+                            + mulRound(p2[c + 1] - p0[c + 1], kScharr10));
+            a11 += dx[c] * dx[c];
+            a12 += dx[c] * dy[c];
+            a22 += dy[c] * dy[c];
+        }
+    }
+#endif
+}
+
+//sums over the window of (J - I) dx and (J - I) dy, J interpolated from p
+//and I the window of the first frame, rows kLanes apart
+static void mismatch(const uchar *p, size_t step, const Weights &w, const int16_t *win,
+                     const int16_t *dx, const int16_t *dy, int64_t &b1, int64_t &b2)
+{
+#if defined(__AVX2__)
+    __m256i w0 = _mm256_set1_epi32(w.w00 | w.w01 << 16), w1 = _mm256_set1_epi32(w.w10 | w.w11 << 16);
+    __m256i s1 = _mm256_setzero_si256(), s2 = s1;
+    for (int r = 0; r < kWin; r++, p += step, win += kLanes, dx += kLanes, dy += kLanes) {
+        __m256i diff = _mm256_sub_epi16(interpolateRow(p, step, w0, w1), _mm256_loadu_si256((const __m256i *)win));
+        s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(diff, _mm256_loadu_si256((const __m256i *)dx)));
+        s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(diff, _mm256_loadu_si256((const __m256i *)dy)));
+    }
+    b1 = sum32(s1);
+    b2 = sum32(s2);
+#elif defined(KLT_NEON)
+    int32x4_t s1 = vdupq_n_s32(0), s2 = s1, t1 = s1, t2 = s1;
+    for (int r = 0; r < kWin; r++, p += step, win += kLanes, dx += kLanes, dy += kLanes) {
+        int16x8_t lo, hi;
+        interpolateRow(p, step, w, lo, hi);
+        lo = vsubq_s16(lo, vld1q_s16(win));
+        hi = vsubq_s16(hi, vld1q_s16(win + 8));
+        s1 = multiplyAdd(s1, lo, vld1q_s16(dx));
+        s2 = multiplyAdd(s2, lo, vld1q_s16(dy));
+        t1 = multiplyAdd(t1, hi, vld1q_s16(dx + 8));
+        t2 = multiplyAdd(t2, hi, vld1q_s16(dy + 8));
+    }
+    b1 = sum32(s1) + sum32(t1);
+    b2 = sum32(s2) + sum32(t2);
+#else
+    const int half = 1 << (kWeightBits - 6);
+    b1 = b2 = 0;
+    for (int r = 0; r < kWin; r++, p += step, win += kLanes, dx += kLanes, dy += kLanes) {
+        for (int c = 0; c < kWin; c++) {
+            int j = (p[c] * w.w00 + p[c + 1] * w.w01 + p[step + c] * w.w10 + p[step + c + 1] * w.w11
+                     + half) >> (kWeightBits - 5);
+            b1 += (j - win[c]) * dx[c];
+            b2 += (j - win[c]) * dy[c];
+        }
+    }
+#endif
+}
+
+//level 0 pixel coordinates to a level's and back, pixel centres lining up
+//as resize() lines them up
+static inline float toLevel(float v, double s) { return (float)((v + 0.5) / s - 0.5); }
+static inline float fromLevel(float v, double s) { return (float)((v + 0.5) * s - 0.5); }
+
+//the first level a point dist pixels from its guess is followed from:
+//the finest on which that is under half a window
+static int levelFor(const ImagePyramid &pyr, float dist)
+{
+    int l = 0;
+    while (l + kLevelStride <= kMaxLevel && l + kLevelStride < pyr.levels() && dist > kHalf * 0.5 * pyr.scale(l))
+        l += kLevelStride;
+    return l;
+}
+
+KltTracker::KltTracker()
+{
+    memset(win_, 0, sizeof(win_));
+    memset(dx_, 0, sizeof(dx_));
+    memset(dy_, 0, sizeof(dy_));
+}
+
+void KltTracker::track(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<Point2f> &pts,
+                       std::vector<Point2f> &nextPts, std::vector<uchar> &status)
+{
+    if (nextPts.size() != pts.size())
+        nextPts = pts;
+    status.assign(pts.size(), 0);
+    if (prev.levels() == 0 || next.levels() == 0 || prev.level(0).size() != next.level(0).size())
+        return;
+
+    float maxBack2 = kMaxBackError * kMaxBackError;
+    for (size_t i = 0; i < pts.size(); i++) {
+        Point2f guess = nextPts[i];
+        if (!trackPoint(prev, next, pts[i], nextPts[i], kMaxLevel))
+            continue;
+        //back again, with the guess's motion undone so it is no help there;
+        //it is off by as much as the guess was, so no coarser levels are
+        //needed than cover that
+        Point2f back = nextPts[i] - (guess - pts[i]), off = nextPts[i] - guess;
+        if (!trackPoint(next, prev, nextPts[i], back, levelFor(next, sqrtf(off.x * off.x + off.y * off.y))))
+            continue;
+        Point2f e = back - pts[i];
+        status[i] = e.x * e.x + e.y * e.y <= maxBack2;
+    }
+}
+
+bool KltTracker::trackPoint(const ImagePyramid &from, const ImagePyramid &to, Point2f p, Point2f &q, int top)
+{
+    top = std::min(std::min(from.levels(), to.levels()) - 1, top);
+    top -= top % kLevelStride;
+
+    for (int l = top; l >= 0; l -= kLevelStride) {
+        const Mat &a = from.level(l), &b = to.level(l);
+        double s = from.scale(l);
+        float px = toLevel(p.x, s), py = toLevel(p.y, s);
+        float qx = toLevel(q.x, s), qy = toLevel(q.y, s);
+
+        //the first frame's window and its gradients; a point too near the
+        //edge or in too flat a window for a coarse level starts on a finer one
+        Weights w;
+        const uchar *src = corner(a, px - kHalf - 1, py - kHalf - 1, kPatch, w);
+        if (!src) {
+            if (l == 0)
+                return false;
+            continue;
+        }
+        int64_t i11, i12, i22;
+        prepareWindow(src, a.step, w, win_, dx_, dy_, i11, i12, i22);
+
+        //gradients are 32 times the grey level change per pixel: sums of
+        //their products over 1024 are in grey levels squared
+        const double scale = 1.0 / 1024;
+        double a11 = i11 * scale, a12 = i12 * scale, a22 = i22 * scale;
+        double det = a11 * a22 - a12 * a12;
+        double minEigen = (a11 + a22 - sqrt((a11 - a22) * (a11 - a22) + 4 * a12 * a12)) / (2 * kWin * kWin);
+        if (minEigen < kMinEigen || det < 1e-7) {
+            if (l == 0)
+                return false;
+            continue;
+        }
+
+        float lastX = 0, lastY = 0;
+        for (int k = 0; k < kMaxSteps; k++) {
+            const uchar *dst = corner(b, qx - kHalf, qy - kHalf, kWin, w);
+            if (!dst)
+                return false;
+            int64_t j1, j2;
+            mismatch(dst, b.step, w, win_, dx_, dy_, j1, j2);
+            double b1 = j1 * scale, b2 = j2 * scale;
+            float stepX = (float)((a12 * b2 - a22 * b1) / det);
+            float stepY = (float)((a12 * b1 - a11 * b2) / det);
+            qx += stepX;
+            qy += stepY;
+            if (stepX * stepX + stepY * stepY < kMinStep * kMinStep)
+                break;
+            //going back and forth across the answer: it is halfway
+            if (k > 0 && fabsf(stepX + lastX) < 0.01f && fabsf(stepY + lastY) < 0.01f) {
+                qx -= stepX * 0.5f;
+                qy -= stepY * 0.5f;
+                break;
+            }
+            lastX = stepX;
+            lastY = stepY;
+        }
+        q = Point2f(fromLevel(qx, s), fromLevel(qy, s));
+    }
+    return true;
+}
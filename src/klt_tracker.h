@@ -0,0 +1,60 @@
+/**
+ * Pyramidal Lucas-Kanade optical flow: where points of one frame are in
+ * the next, without keypoints or descriptors.
+ *
+ * A 13x13 window around each point is followed from the coarsest level
+ * it fits on down to level 0, every second level of the 1.2 scale
+ * pyramids FeatureExtractor builds anyway, so flow costs no pyramid of
+ * its own. On each level the window of the first frame is interpolated
+ * once, its gradients taken from it by a Scharr kernel, and the window of
+ * the second frame interpolated again at every Gauss-Newton step until
+ * the step is under kMinStep pixels.
+ *
+ * Everything on the pixels is fixed point, as in OpenCV's
+ * calcOpticalFlowPyrLK: bilinear weights of 14 bits, intensities with 5
+ * fractional bits in 16 bit lanes, and sums in 32 bit lanes that can't
+ * overflow for a window this size. A window row is one register of 16
+ * lanes with AVX2 and two with NEON, otherwise it is done a pixel at a
+ * time; all give identical results.
+ *
+ * Each point is then tracked back from where it was found, and dropped
+ * unless it comes back to within kMaxBackError of where it started. 500
+ * points there and back take about 1 ms with AVX2.
+ */
+
+#ifndef KLT_TRACKER_H
+#define KLT_TRACKER_H
+
+#include "opencv2/opencv.hpp"
+#include "image_pyramid.h"
+#include <stdint.h>
+#include <vector>
+
+class KltTracker {
+public:
+    KltTracker();
+
+    //pts, level 0 pixels of the frame prev was built from, into next's.
+    //On input next holds a guess for each point (from a motion model, say)
+    //or is empty to start from pts themselves. status[i] is 0 for points
+    //lost: too near the edge, in a window without texture, or failing the
+    //forward-backward check
+    void track(const ImagePyramid &prev, const ImagePyramid &next, const std::vector<cv::Point2f> &pts,
+               std::vector<cv::Point2f> &nextPts, std::vector<uchar> &status);
+
+private:
+    KltTracker(const KltTracker &);
+    KltTracker &operator=(const KltTracker &);
+
+    //one point from from to to, q being the guess on input, starting on
+    //level top; false if lost
+    bool trackPoint(const ImagePyramid &from, const ImagePyramid &to, cv::Point2f p, cv::Point2f &q, int top);
+
+    //the first frame's window, 5 fractional bits, and its gradients; rows
+    //of 16 lanes, the gradients zero past the window's 13 columns
+    int16_t win_[13 * 16];
+    int16_t dx_[13 * 16];
+    int16_t dy_[13 * 16];
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "local_mapping.h"
+#include "geometry.h"
+#include "image_features.h"
+#include <math.h>
+#include <set>
+
+using namespace cv;
+
+//keyframes whose points make up the local map tracking gets, and a cap on
+//its size so that tracking's cost doesn't grow with the map
+static const size_t kLocalKeyFrames  = 8;
+static const size_t kMaxLocalPoints  = 4000;
+//a new point must have been seen by this many keyframes once this many
+//keyframes have come after the one that made it, or it goes
+static const int      kMinSeen       = 3;
+static const uint64_t kCullAfter     = 3;
+static const float    kMatchRatio    = 0.8f;
+static const double   kMaxReprojection = 2.5;
+
+LocalMapping::LocalMapping(const Camera &cam, SpscQueue<KeyFramePtr> &keyFrames,
+                           SpscQueue<LocalMapPtr> &localMaps, SpscQueue<LoopKeyFramePtr> &toLoop,
+                           SpscQueue<LoopCorrection> &corrections)
+    : cam_(cam),
+      keyFramesIn_(keyFrames),
+      localMaps_(localMaps),
+      toLoop_(toLoop),
+      corrections_(corrections),
+      mapId_(0),
+      nextPoint_(0),
+      keyFrameCount_(0),
+      pointCount_(0),
+      loopCount_(0),
+      loopSkipped_(0)
+{
+}
+
+void *LocalMapping::thread(void *arg)
+{
+    static_cast<LocalMapping *>(arg)->run();
+    return NULL;
+}
+
+void LocalMapping::run()
+{
+    for (;;) {
+        //corrections are applied between keyframes, never during one
+        LoopCorrection c;
+        while (corrections_.tryPop(c))
+            applyCorrection(c);
+
+        KeyFramePtr kf;
+        if (keyFramesIn_.pop(kf, 50))
+            addKeyFrame(kf);
+        else if (keyFramesIn_.drained())
+            break;
+    }
+    toLoop_.close();
+}
+
+void LocalMapping::newMap(uint32_t mapId)
+{
+    for (size_t i = 0; i < keyFrames_.size(); i++) {
+        TrajectoryPose p;
+        p.stampNs = keyFrames_[i].kf->stampNs;
+        p.pose    = keyFrames_[i].pose;
+        finished_.push_back(p);
+    }
+    keyFrames_.clear();
+    points_.clear();
+    recent_.clear();
+    corrected_ = Pose();
+    mapId_     = mapId;
+}
+
+void LocalMapping::addKeyFrame(const KeyFramePtr &kf)
+{
+    if (kf->mapId != mapId_)
+        newMap(kf->mapId);
+
+    //tracking may not have seen the latest loop correction yet
+    KeyFrameState s;
+    s.kf     = kf;
+    s.pose   = corrected(kf->pose, corrected_ * kf->corrected.inverse());
+    s.points = kf->points;
+    for (size_t i = 0; i < s.points.size(); i++) {
+        if (s.points[i] < 0)
+            continue;
+        std::map<int64_t, MapPoint>::iterator p = points_.find(s.points[i]);
+        if (p == points_.end())
+            s.points[i] = -1;   // culled since tracking got it
+        else
+            p->second.seen++;
+    }
+
+    if (!keyFrames_.empty())
+        triangulateWith(s, keyFrames_.back());
+    keyFrames_.push_back(s);
+    cull(kf->id);
+    publish();
+
+    //loop closing gets it as it is now, with the world position of every
+    //point it sees
+    std::shared_ptr<LoopKeyFrame> lk = std::make_shared<LoopKeyFrame>();
+    lk->kf        = kf;
+    lk->pose      = s.pose;
+    lk->corrected = corrected_;
+    lk->points.assign(s.points.size(), Vec3d(NAN, NAN, NAN));
+    for (size_t i = 0; i < s.points.size(); i++) {
+        if (s.points[i] >= 0)
+            lk->points[i] = points_[s.points[i]].pos;
+    }
+    if (!toLoop_.tryPush(lk))
+        __atomic_add_fetch(&loopSkipped_, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&keyFrameCount_, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&pointCount_, points_.size(), __ATOMIC_RELAXED);
+}
+
+void LocalMapping::triangulateWith(KeyFrameState &cur, KeyFrameState &prev)
+{
+    //only keys neither keyframe has a point for yet
+    std::vector<int> ci, pi;
+    Mat cd, pd;
+    for (size_t i = 0; i < cur.points.size(); i++) {
+        if (cur.points[i] < 0) {
+            ci.push_back((int)i);
+            cd.push_back(cur.kf->desc.row((int)i));
+        }
+    }
+    for (size_t i = 0; i < prev.points.size(); i++) {
+        if (prev.points[i] < 0) {
+            pi.push_back((int)i);
+            pd.push_back(prev.kf->desc.row((int)i));
+        }
+    }
+
+    std::vector<DMatch> m;
+    matchDescriptors(cd, pd, kMatchRatio, true, m);
+    for (size_t i = 0; i < m.size(); i++) {
+        int c = ci[m[i].queryIdx], p = pi[m[i].trainIdx];
+        Vec3d x;
+        if (prev.points[p] >= 0
+            || !triangulate(cam_, cur.pose, cur.kf->keys[c].pt, prev.pose, prev.kf->keys[p].pt,
+                            kMaxReprojection, x))
+            continue;
+
+        MapPoint mp;
+        mp.pos           = x;
+        mp.desc          = cur.kf->desc.row(c).clone();
+        mp.seen          = 2;
+        mp.firstKeyFrame = cur.kf->id;
+        points_[nextPoint_] = mp;
+        recent_.push_back(nextPoint_);
+        cur.points[c] = prev.points[p] = nextPoint_++;
+    }
+}
+
+void LocalMapping::cull(uint64_t current)
+{
+    while (!recent_.empty()) {
+        std::map<int64_t, MapPoint>::iterator p = points_.find(recent_.front());
+        if (p != points_.end()) {
+            if (p->second.firstKeyFrame + kCullAfter > current)
+                break;
+            if (p->second.seen < kMinSeen)
+                points_.erase(p);
+        }
+        recent_.pop_front();
+    }
+}
+
+void LocalMapping::publish()
+{
+    if (keyFrames_.empty())
+        return;
+
+    //newest keyframes first, so the cap cuts the oldest points
+    std::set<int64_t> ids;
+    for (size_t k = keyFrames_.size(); k-- > 0 && k + kLocalKeyFrames >= keyFrames_.size(); ) {
+        const std::vector<int64_t> &pts = keyFrames_[k].points;
+        for (size_t i = 0; i < pts.size() && ids.size() < kMaxLocalPoints; i++) {
+            if (pts[i] >= 0 && points_.count(pts[i]))
+                ids.insert(pts[i]);
+        }
+    }
+
+    std::shared_ptr<LocalMap> lm = std::make_shared<LocalMap>();
+    lm->mapId        = mapId_;
+    lm->lastKeyFrame = keyFrames_.back().kf->id;
+    lm->corrected    = corrected_;
+    lm->desc.create((int)ids.size(), keyFrames_.back().kf->desc.cols, CV_8UC1);
+    int row = 0;
+    for (std::set<int64_t>::iterator i = ids.begin(); i != ids.end(); ++i, row++) {
+        const MapPoint &mp = points_[*i];
+        lm->ids.push_back(*i);
+        lm->points.push_back(mp.pos);
+        mp.desc.copyTo(lm->desc.row(row));
+    }
+
+    //tracking takes them every frame; if it hasn't, the next one will do
+    localMaps_.tryPush(lm);
+}
+
+void LocalMapping::applyCorrection(const LoopCorrection &c)
+{
+    if (c.mapId != mapId_ || keyFrames_.empty() || c.to <= c.from)
+        return;
+
+    //each keyframe after `from` moves by its share of the correction, and
+    //each point with the keyframe that made it
+    uint64_t base = keyFrames_[0].kf->id;
+    std::vector<Pose> share(keyFrames_.size());
+    for (size_t i = 0; i < keyFrames_.size(); i++) {
+        uint64_t id = keyFrames_[i].kf->id;
+        if (id <= c.from)
+            continue;
+        share[i] = id >= c.to ? c.delta : interpolate(c.delta, (double)(id - c.from) / (c.to - c.from));
+        keyFrames_[i].pose = corrected(keyFrames_[i].pose, share[i]);
+    }
+    for (std::map<int64_t, MapPoint>::iterator p = points_.begin(); p != points_.end(); ++p) {
+        uint64_t k = p->second.firstKeyFrame - base;
+        if (p->second.firstKeyFrame > c.from && k < share.size())
+            p->second.pos = share[k] * p->second.pos;
+    }
+
+    corrected_ = c.delta * corrected_;
+    __atomic_add_fetch(&loopCount_, 1, __ATOMIC_RELAXED);
+    publish();
+}
+
+bool LocalMapping::writeTrajectory(const char *path) const
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "# keyframe trajectory: stamp tx ty tz qx qy qz qw\n");
+    for (size_t i = 0; i < finished_.size(); i++)
+        writeTum(f, finished_[i].stampNs, finished_[i].pose);
+    for (size_t i = 0; i < keyFrames_.size(); i++)
+        writeTum(f, keyFrames_[i].kf->stampNs, keyFrames_[i].pose);
+    return fclose(f) == 0;
+}
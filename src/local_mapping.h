@@ -0,0 +1,92 @@
+/**
+ * Local mapping: grows the map from the keyframes tracking sends.
+ *
+ * Each keyframe adds observations to the map points tracking matched, and
+ * its unmatched keys are matched against the previous keyframe's and
+ * triangulated into new points. Points nobody sees again within a few
+ * keyframes are culled. After every keyframe the points of the newest
+ * kLocalKeyFrames keyframes are published to tracking as a LocalMap, and
+ * the keyframe goes on to loop closing.
+ *
+ * The map belongs to this thread alone. Loop corrections arrive as
+ * LoopCorrection messages and are applied here, between keyframes.
+ */
+
+#ifndef LOCAL_MAPPING_H
+#define LOCAL_MAPPING_H
+
+#include "slam_types.h"
+#include "spsc_queue.h"
+#include <map>
+#include <deque>
+
+class LocalMapping {
+public:
+    LocalMapping(const Camera &cam, SpscQueue<KeyFramePtr> &keyFrames,
+                 SpscQueue<LocalMapPtr> &localMaps, SpscQueue<LoopKeyFramePtr> &toLoop,
+                 SpscQueue<LoopCorrection> &corrections);
+
+    //pthread entry point, arg is the LocalMapping
+    static void *thread(void *arg);
+    //until the keyframe queue is closed and drained; then closes toLoop
+    void run();
+
+    //every keyframe's pose as it ended up, in TUM format; only once run()
+    //has returned. A new map after tracking was lost has its own origin
+    bool writeTrajectory(const char *path) const;
+
+    //for the report, from any thread
+    uint64_t keyFrames() const { return __atomic_load_n(&keyFrameCount_, __ATOMIC_RELAXED); }
+    uint64_t mapPoints() const { return __atomic_load_n(&pointCount_, __ATOMIC_RELAXED); }
+    uint64_t loops() const     { return __atomic_load_n(&loopCount_, __ATOMIC_RELAXED); }
+    //keyframes loop closing was too busy to take
+    uint64_t skippedLoopKeyFrames() const { return __atomic_load_n(&loopSkipped_, __ATOMIC_RELAXED); }
+
+private:
+    LocalMapping(const LocalMapping &);
+    LocalMapping &operator=(const LocalMapping &);
+
+    struct MapPoint {
+        cv::Vec3d pos;
+        cv::Mat   desc;     // of the key it was first seen at
+        int       seen;     // keyframes observing it
+        uint64_t  firstKeyFrame;
+    };
+    struct KeyFrameState {
+        KeyFramePtr          kf;
+        Pose                 pose;      // corrected by every loop since
+        std::vector<int64_t> points;    // map point at each key, -1 for none
+    };
+    struct TrajectoryPose {
+        uint64_t stampNs;
+        Pose     pose;
+    };
+
+    void newMap(uint32_t mapId);
+    void addKeyFrame(const KeyFramePtr &kf);
+    void triangulateWith(KeyFrameState &cur, KeyFrameState &prev);
+    void cull(uint64_t current);
+    void applyCorrection(const LoopCorrection &c);
+    void publish();
+
+    Camera                      cam_;
+    SpscQueue<KeyFramePtr>     &keyFramesIn_;
+    SpscQueue<LocalMapPtr>     &localMaps_;
+    SpscQueue<LoopKeyFramePtr> &toLoop_;
+    SpscQueue<LoopCorrection>  &corrections_;
+
+    uint32_t                     mapId_;
+    std::vector<KeyFrameState>   keyFrames_;   // this map's, by id
+    std::map<int64_t, MapPoint>  points_;
+    std::deque<int64_t>          recent_;      // new points, not yet past culling
+    int64_t                      nextPoint_;
+    Pose                         corrected_;   // LocalMap::corrected
+    std::vector<TrajectoryPose>  finished_;    // keyframes of earlier maps
+
+    uint64_t keyFrameCount_;
+    uint64_t pointCount_;
+    uint64_t loopCount_;
+    uint64_t loopSkipped_;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "loop_closing.h"
+#include "geometry.h"
+#include "image_features.h"
+#include <math.h>
+#include <iostream>
+
+using namespace cv;
+
+//keyframes a loop must span, and keyframes after a loop before the next
+static const uint64_t kMinLoopGap     = 40;
+static const uint64_t kLoopCooldown   = 20;
+//descriptor matches a candidate needs, PnP inliers to accept it
+static const size_t   kMinLoopMatches = 80;
+static const size_t   kMinLoopInliers = 40;
+static const float    kMatchRatio     = 0.75f;
+
+static inline bool hasPoint(const Vec3d &x)
+{
+    return x[0] == x[0];    // NaN for keys without a map point
+}
+
+LoopClosing::LoopClosing(const Camera &cam, SpscQueue<LoopKeyFramePtr> &keyFrames,
+                         SpscQueue<LoopCorrection> &corrections)
+    : cam_(cam),
+      keyFrames_(keyFrames),
+      corrections_(corrections),
+      mapId_(0),
+      lastLoop_(0)
+{
+}
+
+void *LoopClosing::thread(void *arg)
+{
+    static_cast<LoopClosing *>(arg)->run();
+    return NULL;
+}
+
+void LoopClosing::run()
+{
+    LoopKeyFramePtr lk;
+    while (keyFrames_.pop(lk))
+        add(lk);
+    corrections_.close();
+}
+
+void LoopClosing::add(const LoopKeyFramePtr &lk)
+{
+    if (lk->kf->mapId != mapId_) {
+        entries_.clear();
+        corrected_ = Pose();
+        mapId_     = lk->kf->mapId;
+        lastLoop_  = 0;
+    }
+
+    //mapping may have sent it before applying our latest correction
+    Pose  missing = corrected_ * lk->corrected.inverse();
+    Entry e;
+    e.kf     = lk->kf;
+    e.pose   = corrected(lk->pose, missing);
+    e.points = lk->points;
+    for (size_t i = 0; i < e.points.size(); i++) {
+        if (hasPoint(e.points[i]))
+            e.points[i] = missing * e.points[i];
+    }
+
+    LoopCorrection c;
+    bool found = detect(e, c);
+    entries_.push_back(e);
+    //mapping is behind on corrections: leave this loop to be found again
+    //from a later keyframe rather than correct ours and not its map
+    if (found && corrections_.tryPush(c)) {
+        apply(c);
+        lastLoop_ = e.kf->id;
+    }
+}
+
+bool LoopClosing::detect(const Entry &cur, LoopCorrection &c)
+{
+    uint64_t id = cur.kf->id;
+    if (lastLoop_ != 0 && id < lastLoop_ + kLoopCooldown)
+        return false;
+
+    //the older keyframe sharing the most descriptors
+    size_t best = 0;
+    std::vector<DMatch> m, bestMatches;
+    for (size_t i = 0; i < entries_.size() && entries_[i].kf->id + kMinLoopGap <= id; i++) {
+        matchDescriptors(cur.kf->desc, entries_[i].kf->desc, kMatchRatio, true, m);
+        if (m.size() > bestMatches.size()) {
+            best = i;
+            bestMatches.swap(m);
+        }
+    }
+    if (bestMatches.size() < kMinLoopMatches)
+        return false;
+
+    //where the old keyframe's points say we are
+    const Entry &old = entries_[best];
+    std::vector<Point3f> obj;
+    std::vector<Point2f> img;
+    for (size_t i = 0; i < bestMatches.size(); i++) {
+        const Vec3d &x = old.points[bestMatches[i].trainIdx];
+        if (!hasPoint(x))
+            continue;
+        obj.push_back(Point3f((float)x[0], (float)x[1], (float)x[2]));
+        img.push_back(cur.kf->keys[bestMatches[i].queryIdx].pt);
+    }
+    if (obj.size() < kMinLoopInliers)
+        return false;
+
+    Mat rvec, tvec;
+    std::vector<int> inliers;
+    if (!solvePnPRansac(obj, img, Mat(cam_.K()), noArray(), rvec, tvec, false, 200, 3.0f, 0.99, inliers)
+        || inliers.size() < kMinLoopInliers)
+        return false;
+    Pose there(rotation(Vec3d((const double *)rvec.data)), Vec3d((const double *)tvec.data));
+
+    c.mapId = mapId_;
+    c.from  = old.kf->id;
+    c.to    = id;
+    c.delta = there.inverse() * cur.pose;
+    std::cout << "Loop closed: keyframe " << id << " is back at keyframe " << c.from << ", "
+              << inliers.size() << " inliers, drift " << norm(cur.pose.center() - there.center())
+              << std::endl;
+    return true;
+}
+
+void LoopClosing::apply(const LoopCorrection &c)
+{
+    for (size_t i = 0; i < entries_.size(); i++) {
+        Entry &e = entries_[i];
+        uint64_t id = e.kf->id;
+        if (id <= c.from)
+            continue;
+        Pose share = id >= c.to ? c.delta : interpolate(c.delta, (double)(id - c.from) / (c.to - c.from));
+        e.pose = corrected(e.pose, share);
+        for (size_t k = 0; k < e.points.size(); k++) {
+            if (hasPoint(e.points[k]))
+                e.points[k] = share * e.points[k];
+        }
+    }
+    corrected_ = c.delta * corrected_;
+}
@@ -0,0 +1,58 @@
+/**
+ * Loop closing: notices when the camera is back somewhere it has been and
+ * takes out the drift accumulated on the way round.
+ *
+ * Every keyframe from mapping is compared with the keyframes of the same
+ * map at least kMinLoopGap older. The one sharing the most descriptor
+ * matches, if it shares enough, is checked geometrically: the new
+ * keyframe's keys are located against the old keyframe's map points by
+ * PnP. If enough of them agree, the pose that gives is where the new
+ * keyframe really is. The difference to where tracking put it goes to
+ * mapping as a LoopCorrection, spread along the keyframes of the loop.
+ *
+ * This is a cheap stand-in for a pose graph optimisation. It corrects
+ * rotation and position but not scale drift, and it runs only here, so
+ * however long it takes, tracking and mapping carry on.
+ */
+
+#ifndef LOOP_CLOSING_H
+#define LOOP_CLOSING_H
+
+#include "slam_types.h"
+#include "spsc_queue.h"
+
+class LoopClosing {
+public:
+    LoopClosing(const Camera &cam, SpscQueue<LoopKeyFramePtr> &keyFrames,
+                SpscQueue<LoopCorrection> &corrections);
+
+    //pthread entry point, arg is the LoopClosing
+    static void *thread(void *arg);
+    //until the keyframe queue is closed and drained
+    void run();
+
+private:
+    LoopClosing(const LoopClosing &);
+    LoopClosing &operator=(const LoopClosing &);
+
+    struct Entry {
+        KeyFramePtr            kf;
+        Pose                   pose;
+        std::vector<cv::Vec3d> points;
+    };
+
+    void add(const LoopKeyFramePtr &lk);
+    bool detect(const Entry &cur, LoopCorrection &c);
+    void apply(const LoopCorrection &c);
+
+    Camera                      cam_;
+    SpscQueue<LoopKeyFramePtr> &keyFrames_;
+    SpscQueue<LoopCorrection>  &corrections_;
+
+    uint32_t           mapId_;
+    std::vector<Entry> entries_;    // this map's keyframes, by id
+    Pose               corrected_;  // every correction made to this map
+    uint64_t           lastLoop_;   // keyframe id of the last loop found
+};
+
+#endif
@@ -0,0 +1,388 @@
+/**
+ * SLAM node: camera poses and a sparse map from the video server's frames.
+ *
+ * Frames come from a running server (TCP, shared memory or multicast), a
+ * recording made with cv_video_cli -w, or straight from any source the
+ * server itself takes (synth:, file:, dir:, a device). Four threads pass
+ * them along bounded lock-free queues (spsc_queue.h):
+ *
+ *   input -> tracking -> local mapping -> loop closing
+ *               ^------------'   ^-------------'
+ *             local maps       loop corrections
+ *
+ * Nothing ever waits on a thread further down the line: a full queue
+ * drops (frames while tracking is behind) or defers (keyframes while
+ * mapping is busy) instead. Tracking matches against a local map of
+ * bounded size, so what a frame costs it stays flat however big the map
+ * grows.
+ */
+
+#include "opencv2/opencv.hpp"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include "frame_protocol.h"
+#include "frame_codec.h"
+#include "frame_source.h"
+#include "stream_reader.h"
+#include "spsc_queue.h"
+#include "tracking.h"
+#include "local_mapping.h"
+#include "loop_closing.h"
+
+using namespace cv;
+
+// frames waiting for tracking; more would only add latency, and those
+// that don't fit are dropped
+static const size_t kFrameSlots      = 2;
+// keyframes waiting for mapping, and for loop closing
+static const size_t kKeyFrameSlots   = 4;
+static const size_t kLoopSlots       = 16;
+
+// where frames come from: a stream from the server or a local source
+struct Input {
+    StreamReader *reader;
+    FrameSource  *source;
+    FrameDecoder  decoder;
+    Mat           img;
+    int           camera;
+    uint64_t      seq;          // ours, for local sources
+    uint64_t      dropped;      // tracking was behind
+    uint64_t      bad;          // undecodable or not an 8 bit image
+
+    Input() : reader(NULL), source(NULL), camera(0), seq(0), dropped(0), bad(0) {}
+};
+
+Input                  input;
+SpscQueue<InputFrame> *frames;
+bool                   stopping = false;    // input thread: stop reading
+volatile sig_atomic_t  interrupted = 0;
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void onSigint(int)
+{
+    interrupted = 1;
+}
+
+static void usage()
+{
+    std::cerr << "Usage: slam [options] <serverIP> <serverPort> [codec]\n"
+              << "       slam [options] shm <segment name>\n"
+              << "       slam [options] mcast <group:port>\n"
+              << "       slam [options] log <file>\n"
+              << "       slam [options] source <spec>\n"
+              << "codec  : raw | jpeg | png | qoi | delta (raw default), lossless ones track best\n"
+              << "spec   : any source the server takes, e.g. synth:640x480@30, file:clip.avi, 0\n"
+              << "-k calib.yml   : camera_matrix (and image_width/height it is for) of the frames,\n"
+              << "                 as for the server's undistort stage, which the frames should\n"
+              << "                 have been through; without it the focal length is guessed\n"
+              << "-n features    : keypoints per frame (1000 default)\n"
+              << "-f             : track frames between keyframes by optical flow, without\n"
+              << "                 keypoints; for high frame rate streams\n"
+              << "-C camera      : which of the server's cameras to follow (0 default)\n"
+              << "-S stream      : which of its processing streams (0 default)\n"
+              << "-o file        : write the keyframe trajectory there at the end, TUM format\n"
+              << "-i seconds     : report interval (1 default)\n"
+              << "-d seconds     : run time, then exit (until the stream ends or ^C default)"
+              << std::endl;
+}
+
+//8 bit gray copy of a frame as it came, in a buffer of its own; a stereo
+//pair's left half
+static bool toGray(const Mat &img, uint16_t pair, Mat &gray)
+{
+    //the last frame's buffer may still be queued for tracking, and
+    //cvtColor() would write straight into it
+    gray.release();
+    if (img.depth() != CV_8U)
+        return false;
+    Mat view = isStereoPair(pair) ? img.colRange(0, img.cols / 2) : img;
+    if (view.channels() == 3)
+        cvtColor(view, gray, CV_BGR2GRAY);
+    else if (view.channels() == 4)
+        cvtColor(view, gray, CV_BGRA2GRAY);
+    else if (view.channels() == 1)
+        gray = view.clone();
+    else
+        return false;
+    return true;
+}
+
+//next frame of our camera, blocking; false at the end of the input
+static bool readFrame(InputFrame &f)
+{
+    for (;;) {
+        if (__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+            return false;
+
+        uint16_t pair;
+        if (input.source != NULL) {
+            if (!input.source->read(input.img))
+                return false;
+            f.seq     = ++input.seq;
+            f.stampNs = input.source->stampNs();
+            pair      = input.source->pair();
+        } else {
+            FrameHeader    h;
+            const uint8_t *payload;
+            if (!input.reader->next(h, payload))
+                return false;
+            if (h.camera != input.camera)
+                continue;
+            if (!input.decoder.decode(h, payload, h.payloadLen, input.img) || !input.reader->stillValid()) {
+                input.bad++;
+                continue;
+            }
+            f.seq     = h.seq;
+            f.stampNs = h.stampNs;
+            pair      = h.pair;
+        }
+
+        if (!toGray(input.img, pair, f.gray)) {
+            if (input.bad++ == 0)
+                std::cerr << "frames must be 8 bit gray or colour images, skipping others" << std::endl;
+            continue;
+        }
+        f.arrivedNs = monotonicNs();
+        return true;
+    }
+}
+
+void *inputThread(void *)
+{
+    InputFrame f;
+    while (readFrame(f)) {
+        //tracking is behind: this frame is lost rather than waited for. Only
+        //tracking pops the queue, so it is the new one that goes; those
+        //queued are at most kFrameSlots frames old
+        if (!frames->tryPush(f))
+            __atomic_add_fetch(&input.dropped, 1, __ATOMIC_RELAXED);
+    }
+    frames->close();
+    return NULL;
+}
+
+//nearest rank percentile of sorted samples, in ms
+static double percentileMs(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.999999);
+    rank = std::min(sorted.size(), std::max((size_t)1, rank));
+    return sorted[rank - 1] / 1000.0;
+}
+
+static void report(double secs, TrackingStats &s, const LocalMapping &mapping)
+{
+    std::sort(s.latencyUs.begin(), s.latencyUs.end());
+    std::cout << std::fixed << std::setprecision(1)
+              << "fps " << s.frames / secs
+              << "  tracked " << s.tracked << "/" << s.frames
+              << " (flow " << s.flowed << ")"
+              << "  track ms p50 " << percentileMs(s.latencyUs, 50)
+              << " p99 " << percentileMs(s.latencyUs, 99)
+              << " max " << (s.latencyUs.empty() ? 0 : s.latencyUs.back() / 1000.0)
+              << "  keyframes " << mapping.keyFrames()
+              << " (+" << s.keyFrames << ", deferred " << s.skippedKeyFrames << ")"
+              << "  points " << mapping.mapPoints()
+              << "  loops " << mapping.loops()
+              << "  dropped " << __atomic_load_n(&input.dropped, __ATOMIC_RELAXED)
+              << std::endl;
+    std::cout.unsetf(std::ios_base::floatfield);
+}
+
+int main(int argc, char** argv)
+{
+    const char *calibPath = NULL;
+    const char *trajectoryPath = NULL;
+    int         features = 1000;
+    bool        flow = false;
+    int         stream = 0;
+    double      reportSecs = 1;
+    double      durationSecs = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "k:n:fC:S:o:i:d:")) != -1) {
+        switch (opt) {
+        case 'k':
+            calibPath = optarg;
+            break;
+        case 'n':
+            features = atoi(optarg);
+            break;
+        case 'f':
+            flow = true;
+            break;
+        case 'C':
+            input.camera = atoi(optarg);
+            break;
+        case 'S':
+            stream = atoi(optarg);
+            break;
+        case 'o':
+            trajectoryPath = optarg;
+            break;
+        case 'i':
+            reportSecs = atof(optarg);
+            break;
+        case 'd':
+            durationSecs = atof(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (features < 50 || input.camera < 0 || input.camera >= kMaxCameras || stream < 0
+        || stream > 255 || reportSecs <= 0) {
+        usage();
+        return 1;
+    }
+
+    //positional arguments from here on, argv[0] being the first of them
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "source") == 0) {
+        if ((input.source = FrameSource::open(argv[2])) == NULL)
+            return 1;
+        input.camera = 0;
+    } else if (strcmp(argv[1], "shm") == 0) {
+        input.reader = new ShmReader(argv[2]);
+        input.camera = 0;
+    } else if (strcmp(argv[1], "mcast") == 0) {
+        if ((input.reader = McastReader::join(argv[2], 100)) == NULL)
+            return 1;
+        input.camera = 0;
+    } else if (strcmp(argv[1], "log") == 0) {
+        if ((input.reader = LogReader::open(argv[2], 1u << input.camera)) == NULL)
+            return 1;
+    } else {
+        int codec = CODEC_RAW;
+        if (argc > 3 && (codec = parseCodec(argv[3])) < 0) {
+            std::cerr << "unknown codec " << argv[3] << std::endl;
+            return 1;
+        }
+        //policy 0, latest: tracking wants the newest frame, one that waited
+        //in the server's queue is as good as dropped anyway
+        input.reader = TcpReader::connect(argv[1], atoi(argv[2]), codec, 0, stream,
+                                          1u << input.camera);
+        if (input.reader == NULL)
+            return 1;
+    }
+
+    //the first frame tells us the image size the intrinsics are for
+    InputFrame first;
+    if (!readFrame(first)) {
+        std::cerr << "no frames" << std::endl;
+        return 1;
+    }
+
+    Camera cam;
+    cam.fx = cam.fy = first.gray.cols;
+    cam.cx = first.gray.cols / 2.0;
+    cam.cy = first.gray.rows / 2.0;
+    if (calibPath != NULL) {
+        FileStorage fs(calibPath, FileStorage::READ);
+        Mat K;
+        if (fs.isOpened())
+            fs["camera_matrix"] >> K;
+        if (K.rows != 3 || K.cols != 3) {
+            std::cerr << calibPath << " has no camera_matrix" << std::endl;
+            return 1;
+        }
+        K.convertTo(K, CV_64F);
+        //calibrated at another size, e.g. before the server's resize stage
+        double sx = 1, sy = 1;
+        if (!fs["image_width"].empty() && !fs["image_height"].empty()
+            && (int)fs["image_width"] > 0 && (int)fs["image_height"] > 0) {
+            sx = first.gray.cols / (double)(int)fs["image_width"];
+            sy = first.gray.rows / (double)(int)fs["image_height"];
+        }
+        cam.fx = K.at<double>(0, 0) * sx;
+        cam.cx = K.at<double>(0, 2) * sx;
+        cam.fy = K.at<double>(1, 1) * sy;
+        cam.cy = K.at<double>(1, 2) * sy;
+    } else {
+        std::cout << "No calibration, guessing focal length " << cam.fx << " px" << std::endl;
+    }
+    std::cout << "Frames " << first.gray.cols << "x" << first.gray.rows << ", fx " << cam.fx
+              << " fy " << cam.fy << " cx " << cam.cx << " cy " << cam.cy << std::endl;
+
+    SpscQueue<InputFrame>      frameQueue(kFrameSlots);
+    SpscQueue<KeyFramePtr>     keyFrames(kKeyFrameSlots);
+    SpscQueue<LocalMapPtr>     localMaps(kKeyFrameSlots);
+    SpscQueue<LoopKeyFramePtr> loopKeyFrames(kLoopSlots);
+    SpscQueue<LoopCorrection>  corrections(kKeyFrameSlots);
+    frames = &frameQueue;
+    frames->tryPush(first);
+
+    Tracking     tracking(cam, features, flow, frameQueue, keyFrames, localMaps);
+    LocalMapping mapping(cam, keyFrames, localMaps, loopKeyFrames, corrections);
+    LoopClosing  loopClosing(cam, loopKeyFrames, corrections);
+
+    pthread_t tracking_id, mapping_id, loop_id, input_id;
+    if (pthread_create(&loop_id, NULL, LoopClosing::thread, &loopClosing) != 0
+        || pthread_create(&mapping_id, NULL, LocalMapping::thread, &mapping) != 0
+        || pthread_create(&tracking_id, NULL, Tracking::thread, &tracking) != 0
+        || pthread_create(&input_id, NULL, inputThread, NULL) != 0) {
+        perror("Can't start SLAM threads");
+        return 1;
+    }
+    signal(SIGINT, onSigint);
+
+    //report until the input ends, time is up or ^C
+    uint64_t start = monotonicNs();
+    uint64_t last = start;
+    uint64_t end = durationSecs > 0 ? start + (uint64_t)(durationSecs * 1e9) : 0;
+    while (!frameQueue.drained()) {
+        usleep(10000);
+        uint64_t now = monotonicNs();
+        if (interrupted || (end != 0 && now >= end)) {
+            __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+            if (input.reader != NULL)
+                input.reader->cancel();
+            break;
+        }
+        if (now - last >= (uint64_t)(reportSecs * 1e9)) {
+            TrackingStats s;
+            tracking.takeStats(s);
+            report((now - last) / 1e9, s, mapping);
+            last = now;
+        }
+    }
+
+    //each thread drains what it has and closes the queue after it
+    pthread_join(input_id, NULL);
+    pthread_join(tracking_id, NULL);
+    pthread_join(mapping_id, NULL);
+    pthread_join(loop_id, NULL);
+
+    std::cout << "Done: " << mapping.keyFrames() << " keyframes, " << mapping.mapPoints()
+              << " map points, " << mapping.loops() << " loops closed, " << input.dropped
+              << " frames dropped while tracking was behind, " << input.bad << " bad frames"
+              << std::endl;
+    if (trajectoryPath != NULL && mapping.writeTrajectory(trajectoryPath))
+        std::cout << "Keyframe trajectory written to " << trajectoryPath << std::endl;
+
+    delete input.reader;
+    delete input.source;
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "orb_descriptor.h"
+#include <stdint.h>
+#include <math.h>
+
+using namespace cv;
+
+namespace {
+
+//---- the sampling pattern, built by the compiler ----
+
+struct OrbPair {
+    int8_t x1, y1, x2, y2;
+};
+struct OrbPairs {
+    OrbPair pair[kOrbBytes * 8];
+};
+struct OrbPattern {
+    OrbPairs angle[kOrbAngles];
+};
+
+template<int... I> struct Indices {};
+template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+constexpr double kPi = 3.14159265358979323846;
+//pattern points are pulled in to this radius, so that turned and rounded
+//they still lie within kOrbRadius
+constexpr double kPatternRadius = kOrbRadius - 1;
+constexpr double kPatternSigma  = 5;
+
+//integer hash (lowbias32), a stateless stand-in for a random generator
+constexpr uint32_t hash3(uint32_t x) { return x ^ (x >> 16); }
+constexpr uint32_t hash2(uint32_t x) { return hash3((x ^ (x >> 15)) * 0x846ca68bu); }
+constexpr uint32_t hash1(uint32_t x) { return hash2((x ^ (x >> 16)) * 0x7feb352du); }
+//uniform in [-1, 1)
+constexpr double uniform(uint32_t i) { return (hash1(i * 0x9e3779b9u + 1) >> 8) / 8388608.0 - 1.0; }
+//sum of three uniforms: near enough Gaussian, sigma 1
+constexpr double gaussian(int i) { return uniform(3 * i) + uniform(3 * i + 1) + uniform(3 * i + 2); }
+
+constexpr double sqrtIterate(double v, double g, int n) { return n == 0 ? g : sqrtIterate(v, 0.5 * (g + v / g), n - 1); }
+constexpr double squareRoot(double v) { return v <= 0 ? 0 : sqrtIterate(v, v > 1 ? v : 1, 40); }
+constexpr double sinSeries(double x2, double term, int n, double sum)
+{
+    return n > 20 ? sum : sinSeries(x2, -term * x2 / ((2 * n) * (2 * n + 1)), n + 1, sum + term);
+}
+//a in [0, 2 pi], brought into [-pi, pi] where the series converges fast
+constexpr double wrapped(double a) { return a > kPi ? a - 2 * kPi : a; }
+constexpr double sine(double a) { return sinSeries(wrapped(a) * wrapped(a), wrapped(a), 1, 0); }
+constexpr double cosine(double a) { return sine(a + kPi / 2 > 2 * kPi ? a - 1.5 * kPi : a + kPi / 2); }
+constexpr int8_t rounded(double v) { return (int8_t)(v >= 0 ? (int)(v + 0.5) : -(int)(-v + 0.5)); }
+
+//point p (0 or 1) of pair t before turning, coordinate c (0 x, 1 y)
+constexpr double rawCoord(int t, int p, int c) { return kPatternSigma * gaussian(4 * t + 2 * p + c); }
+constexpr double pullIn(double r2) { return r2 > kPatternRadius * kPatternRadius ? kPatternRadius / squareRoot(r2) : 1; }
+constexpr double coord(int t, int p, int c)
+{
+    return rawCoord(t, p, c) * pullIn(rawCoord(t, p, 0) * rawCoord(t, p, 0) + rawCoord(t, p, 1) * rawCoord(t, p, 1));
+}
+
+constexpr double binAngle(int b) { return b * 2 * kPi / kOrbAngles; }
+constexpr int8_t turnedX(int b, int t, int p) { return rounded(cosine(binAngle(b)) * coord(t, p, 0) - sine(binAngle(b)) * coord(t, p, 1)); }
+constexpr int8_t turnedY(int b, int t, int p) { return rounded(sine(binAngle(b)) * coord(t, p, 0) + cosine(binAngle(b)) * coord(t, p, 1)); }
+constexpr OrbPair turnedPair(int b, int t) { return OrbPair{ turnedX(b, t, 0), turnedY(b, t, 0), turnedX(b, t, 1), turnedY(b, t, 1) }; }
+
+template<int... T> constexpr OrbPairs turnedPairs(int b, Indices<T...>) { return OrbPairs{{ turnedPair(b, T)... }}; }
+template<int... B> constexpr OrbPattern pattern(Indices<B...>)
+{
+    return OrbPattern{{ turnedPairs(B, MakeIndices<kOrbBytes * 8>::type())... }};
+}
+
+constexpr OrbPattern kPattern = pattern(MakeIndices<kOrbAngles>::type());
+
+} // namespace
+
+OrbDescriber::OrbDescriber()
+    : step_(0)
+{
+    for (int v = 0; v <= kOrbRadius; v++)
+        discWidth_[v] = cvRound(sqrt((double)kOrbRadius * kOrbRadius - v * v));
+}
+
+int OrbDescriber::angleBin(const Mat &level, int x, int y) const
+{
+    //first moments of the disc; the centre row once, the others in pairs
+    int step = (int)level.step;
+    const uchar *c = level.ptr<uchar>(y) + x;
+    int m10 = 0, m01 = 0;
+    for (int u = -kOrbRadius; u <= kOrbRadius; u++)
+        m10 += u * c[u];
+    for (int v = 1; v <= kOrbRadius; v++) {
+        int diff = 0;
+        for (int u = -discWidth_[v]; u <= discWidth_[v]; u++) {
+            int below = c[v * step + u], above = c[-v * step + u];
+            diff += below - above;
+            m10  += u * (below + above);
+        }
+        m01 += v * diff;
+    }
+
+    int bin = (int)floor(atan2((double)m01, (double)m10) * kOrbAngles / (2 * CV_PI) + 0.5);
+    return (bin + kOrbAngles) % kOrbAngles;
+}
+
+void OrbDescriber::describe(const Mat &smoothed, int x, int y, int bin, uchar *out)
+{
+    if (smoothed.step != step_) {
+        step_ = smoothed.step;
+        offsets_.resize(kOrbAngles * kOrbBytes * 8 * 2);
+        int *o = &offsets_[0];
+        for (int b = 0; b < kOrbAngles; b++) {
+            for (int t = 0; t < kOrbBytes * 8; t++) {
+                const OrbPair &p = kPattern.angle[b].pair[t];
+                *o++ = p.y1 * (int)step_ + p.x1;
+                *o++ = p.y2 * (int)step_ + p.x2;
+            }
+        }
+    }
+
+    const uchar *c = smoothed.ptr<uchar>(y) + x;
+    const int   *o = &offsets_[bin * kOrbBytes * 8 * 2];
+    for (int i = 0; i < kOrbBytes; i++, o += 16) {
+        out[i] = (uchar)((c[o[0]] < c[o[1]])
+                       | (c[o[2]] < c[o[3]]) << 1
+                       | (c[o[4]] < c[o[5]]) << 2
+                       | (c[o[6]] < c[o[7]]) << 3
+                       | (c[o[8]] < c[o[9]]) << 4
+                       | (c[o[10]] < c[o[11]]) << 5
+                       | (c[o[12]] < c[o[13]]) << 6
+                       | (c[o[14]] < c[o[15]]) << 7);
+    }
+}
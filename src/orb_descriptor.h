@@ -0,0 +1,48 @@
+/**
+ * Oriented BRIEF descriptors, as ORB makes them.
+ *
+ * A key's orientation is the direction from it to the intensity centroid
+ * of the disc of radius kOrbRadius around it, rounded to one of kOrbAngles
+ * steps of 12 degrees. Its descriptor is 256 comparisons of pixel pairs of
+ * the smoothed image around it, the pairs turned by that angle so the bits
+ * don't change as the camera rolls.
+ *
+ * The pairs are drawn from an isotropic Gaussian (BRIEF's G II pattern)
+ * rather than ORB's learned ones. All 30 turned copies are worked out at
+ * compile time into one constexpr table. At run time they are turned into
+ * pixel offsets once per row stride, which ImagePyramid keeps the same on
+ * every level.
+ */
+
+#ifndef ORB_DESCRIPTOR_H
+#define ORB_DESCRIPTOR_H
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+static const int kOrbBytes  = 32;     // 256 bits
+static const int kOrbAngles = 30;
+//pairs and centroid stay this close to the key, keys must be further from
+//the image edge
+static const int kOrbRadius = 15;
+
+class OrbDescriber {
+public:
+    OrbDescriber();
+
+    //orientation step, 0..kOrbAngles - 1, of the key at (x, y) of a level
+    int angleBin(const cv::Mat &level, int x, int y) const;
+
+    //kOrbBytes of descriptor for the key at (x, y) of a smoothed level
+    void describe(const cv::Mat &smoothed, int x, int y, int bin, uchar *out);
+
+private:
+    OrbDescriber(const OrbDescriber &);
+    OrbDescriber &operator=(const OrbDescriber &);
+
+    int              discWidth_[kOrbRadius + 1];   // half width of each row of the disc
+    size_t           step_;
+    std::vector<int> offsets_;     // per angle, per pair: 2 pixel offsets for rows of step_
+};
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * What the SLAM threads hand each other.
+ *
+ * Poses are world to camera: a world point x is at R x + t in the camera.
+ * Keyframes, local map snapshots and the rest are immutable once queued
+ * and shared through shared_ptr, so no thread ever locks or waits on
+ * another's data; whatever a thread changes afterwards it keeps a copy of.
+ *
+ * The world is monocular: its scale is whatever the first two keyframes'
+ * baseline made it, and everything after stays consistent with that.
+ */
+
+#ifndef SLAM_TYPES_H
+#define SLAM_TYPES_H
+
+#include "opencv2/opencv.hpp"
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+struct Pose {
+    cv::Matx33d R;
+    cv::Vec3d   t;
+
+    Pose() : R(cv::Matx33d::eye()), t(0, 0, 0) {}
+    Pose(const cv::Matx33d &r, const cv::Vec3d &tr) : R(r), t(tr) {}
+
+    //o first, then this
+    Pose operator*(const Pose &o) const { return Pose(R * o.R, R * o.t + t); }
+    cv::Vec3d operator*(const cv::Vec3d &x) const { return R * x + t; }
+    Pose inverse() const { cv::Matx33d rt = R.t(); return Pose(rt, -(rt * t)); }
+    //camera position in the world
+    cv::Vec3d center() const { return -(R.t() * t); }
+};
+
+//pinhole intrinsics; frames are expected undistorted already (the
+//server's undistort stage)
+struct Camera {
+    double fx, fy, cx, cy;
+
+    cv::Matx33d K() const { return cv::Matx33d(fx, 0, cx, 0, fy, cy, 0, 0, 1); }
+    cv::Point2d project(const cv::Vec3d &xc) const
+    {
+        return cv::Point2d(fx * xc[0] / xc[2] + cx, fy * xc[1] / xc[2] + cy);
+    }
+};
+
+//made by tracking, never changed afterwards; mapping and loop closing keep
+//their own, corrected, copies of the pose
+struct KeyFrame {
+    uint64_t                  id;       // 0, 1, ... in tracking order
+    uint32_t                  mapId;    // a new map starts after tracking is lost
+    uint64_t                  seq;
+    uint64_t                  stampNs;
+    Pose                      pose;
+    std::vector<cv::KeyPoint> keys;
+    cv::Mat                   desc;     // a row of 32 bytes per key
+    std::vector<int64_t>      points;   // map point seen at each key, -1 if none
+    Pose                      corrected; // LocalMap::corrected that pose includes
+};
+typedef std::shared_ptr<const KeyFrame> KeyFramePtr;
+
+//the part of the map around the newest keyframes that tracking matches
+//against; its size is bounded, so tracking costs the same however big
+//the map grows
+struct LocalMap {
+    uint32_t                mapId;
+    uint64_t                lastKeyFrame;   // newest keyframe it includes
+    //product of every loop correction made to this map so far, see
+    //LoopCorrection; tracking applies to its own pose whatever part of
+    //it hasn't been applied yet
+    Pose                    corrected;
+    std::vector<int64_t>    ids;
+    std::vector<cv::Vec3d>  points;
+    cv::Mat                 desc;           // a row per point
+};
+typedef std::shared_ptr<const LocalMap> LocalMapPtr;
+
+//a keyframe as mapping last knew it, for loop closing: pose and the
+//world position of the map point at each key (NaN for none)
+struct LoopKeyFrame {
+    KeyFramePtr            kf;
+    Pose                   pose;
+    std::vector<cv::Vec3d> points;
+    Pose                   corrected;   // as in KeyFrame
+};
+typedef std::shared_ptr<const LoopKeyFrame> LoopKeyFramePtr;
+
+//keyframe `to` was found to be where `from` was: the world from `to` on
+//moves by delta (a world to world transform), keyframes between the two
+//by part of it, see interpolate()
+struct LoopCorrection {
+    uint32_t mapId;
+    uint64_t from, to;
+    Pose     delta;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * Bounded lock-free queue between exactly one producer and one consumer
+ * thread, the only way the SLAM threads talk to each other.
+ *
+ * tryPush() never blocks: when the queue is full it fails and the producer
+ * decides what to do about it (tracking skips a keyframe rather than wait
+ * for mapping). The consumer may block in pop(), on a semaphore the
+ * producer posts after every push; posting never blocks either. close()
+ * ends the stream: pop() returns false once the queue is drained.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t slots)
+        : slots_(slots < 2 ? 2 : slots),
+          head_(0),
+          tail_(0),
+          closed_(false)
+    {
+        sem_init(&items_, 0, 0);
+    }
+
+    ~SpscQueue()
+    {
+        sem_destroy(&items_);
+    }
+
+    //producer: false if full (or closed), item untouched
+    bool tryPush(const T &item)
+    {
+        if (__atomic_load_n(&closed_, __ATOMIC_ACQUIRE)
+            || head_ - __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) >= slots_.size())
+            return false;
+        slots_[head_ % slots_.size()] = item;
+        __atomic_store_n(&head_, head_ + 1, __ATOMIC_RELEASE);
+        sem_post(&items_);
+        return true;
+    }
+
+    //producer: no more items; the consumer gets what is queued, then false
+    void close()
+    {
+        __atomic_store_n(&closed_, true, __ATOMIC_RELEASE);
+        sem_post(&items_);
+    }
+
+    //consumer: oldest item, false if there is none right now
+    bool tryPop(T &item)
+    {
+        if (__atomic_load_n(&head_, __ATOMIC_ACQUIRE) == tail_)
+            return false;
+        T &slot = slots_[tail_ % slots_.size()];
+        item = slot;
+        slot = T();     // drop the queue's reference now, not when it's reused
+        __atomic_store_n(&tail_, tail_ + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    //consumer: wait up to timeoutMs (forever if negative) for an item;
+    //false on timeout, or once the queue is closed and drained
+    bool pop(T &item, int timeoutMs = -1)
+    {
+        for (;;) {
+            if (tryPop(item))
+                return true;
+            if (__atomic_load_n(&closed_, __ATOMIC_ACQUIRE)) {
+                //a push that raced with close() is still delivered
+                return tryPop(item);
+            }
+            if (!wait(timeoutMs))
+                return false;
+        }
+    }
+
+    //consumer: closed and nothing left to pop
+    bool drained() const
+    {
+        return __atomic_load_n(&closed_, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&head_, __ATOMIC_ACQUIRE) == tail_;
+    }
+
+    size_t size() const
+    {
+        return __atomic_load_n(&head_, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+    }
+
+private:
+    SpscQueue(const SpscQueue &);
+    SpscQueue &operator=(const SpscQueue &);
+
+    //one post per push or close, so a wakeup may find the item already
+    //taken by an earlier tryPop(); callers just go round again
+    bool wait(int timeoutMs)
+    {
+        if (timeoutMs < 0) {
+            while (sem_wait(&items_) < 0 && errno == EINTR) {}
+            return true;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += timeoutMs / 1000;
+        ts.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&items_, &ts) < 0) {
+            if (errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<T> slots_;
+    uint64_t       head_;   // written by the producer only
+    uint64_t       tail_;   // written by the consumer only
+    bool           closed_;
+    sem_t          items_;
+};
+
+#endif
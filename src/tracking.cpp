@@ -0,0 +1,362 @@
+#include "tracking.h"
+#include "geometry.h"
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+
+using namespace cv;
+
+//nearest descriptor must beat the second nearest by this much
+static const float  kMatchRatio       = 0.8f;
+//initialisation: matches, median pixel motion, essential matrix inliers
+//and triangulated points needed; frames to wait for them before trying
+//another first frame
+static const size_t kMinInitMatches   = 100;
+static const double kMinInitParallax  = 20;
+static const int    kMinInitInliers   = 80;
+static const size_t kMinInitPoints    = 50;
+static const uint64_t kMaxInitFrames  = 60;
+//tracking: keys searched within this many pixels of where a map point
+//should be, in a grid of this cell size; too few matches found so and all
+//keys are searched
+static const float  kWindowRadius     = 15;
+static const int    kWindowCell       = 32;
+static const size_t kMinWindowMatches = 50;
+//PnP inliers below which tracking is lost
+static const size_t kMinTrackInliers  = 20;
+//keyframes: at least this many frames apart, and made when the inliers
+//drop below this share of the last keyframe's, or after kMaxKeyFrameGap
+static const int    kMinKeyFrameGap   = 5;
+static const int    kMaxKeyFrameGap   = 30;
+static const double kKeyFrameInliers  = 0.7;
+//flow: points left after following them, and PnP inliers among them,
+//below which a frame is matched instead
+static const size_t kMinFlowPoints    = 40;
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Tracking::Tracking(const Camera &cam, int maxFeatures, bool flow, SpscQueue<InputFrame> &frames,
+                   SpscQueue<KeyFramePtr> &keyFrames, SpscQueue<LocalMapPtr> &localMaps)
+    : cam_(cam),
+      extractor_(maxFeatures),
+      frames_(frames),
+      keyFrames_(keyFrames),
+      localMaps_(localMaps),
+      tracking_(false),
+      mapId_(0),
+      nextKeyFrame_(0),
+      sinceKeyFrame_(0),
+      keyFrameInliers_(0),
+      flow_(flow)
+{
+    pthread_mutex_init(&lock_, NULL);
+}
+
+Tracking::~Tracking()
+{
+    pthread_mutex_destroy(&lock_);
+}
+
+void *Tracking::thread(void *arg)
+{
+    static_cast<Tracking *>(arg)->run();
+    return NULL;
+}
+
+void Tracking::run()
+{
+    InputFrame in;
+    while (frames_.pop(in))
+        process(in);
+    keyFrames_.close();
+}
+
+void Tracking::takeStats(TrackingStats &out)
+{
+    pthread_mutex_lock(&lock_);
+    out = stats_;
+    stats_ = TrackingStats();
+    pthread_mutex_unlock(&lock_);
+}
+
+void Tracking::process(const InputFrame &in)
+{
+    Frame f;
+    f.seq     = in.seq;
+    f.stampNs = in.stampNs;
+    bool built = extractor_.buildPyramid(in.gray);
+
+    adoptLocalMap();
+
+    //keypoints only if optical flow can't do without them
+    bool ok, lost = false, flowed = false;
+    if (tracking_ && built && trackFlow()) {
+        ok = flowed = true;
+    } else {
+        extractor_.extract(f.keys, f.desc);
+        if (!tracking_) {
+            ok = initialise(f);
+        } else if (!(ok = track(f))) {
+            std::cout << "Tracking lost at frame " << f.seq << ", starting a new map" << std::endl;
+            startOver(f);
+            lost = true;
+        }
+    }
+
+    uint64_t us = (monotonicNs() - in.arrivedNs) / 1000;
+    pthread_mutex_lock(&lock_);
+    stats_.frames++;
+    stats_.tracked += ok;
+    stats_.lost    += lost;
+    stats_.flowed  += flowed;
+    stats_.latencyUs.push_back((uint32_t)std::min(us, (uint64_t)UINT32_MAX));
+    pthread_mutex_unlock(&lock_);
+}
+
+void Tracking::startOver(const Frame &f)
+{
+    tracking_ = false;
+    mapId_++;
+    map_.reset();
+    applied_ = Pose();
+    ref_     = f;
+    flowPixels_.clear();
+}
+
+bool Tracking::initialise(const Frame &f)
+{
+    if (ref_.keys.size() < kMinInitMatches) {
+        ref_ = f;
+        return false;
+    }
+
+    std::vector<DMatch> m;
+    matchDescriptors(f.desc, ref_.desc, kMatchRatio, true, m);
+    if (m.size() < kMinInitMatches) {
+        //the view moved on without us finding a baseline, start again from here
+        if (f.seq > ref_.seq + kMaxInitFrames)
+            ref_ = f;
+        return false;
+    }
+
+    //enough camera motion that depths come out of it
+    std::vector<Point2f> pr, pc;
+    std::vector<double>  moved;
+    for (size_t i = 0; i < m.size(); i++) {
+        pr.push_back(ref_.keys[m[i].trainIdx].pt);
+        pc.push_back(f.keys[m[i].queryIdx].pt);
+        moved.push_back(norm(pc.back() - pr.back()));
+    }
+    std::nth_element(moved.begin(), moved.begin() + moved.size() / 2, moved.end());
+    if (moved[moved.size() / 2] < kMinInitParallax)
+        return false;
+
+    Mat K(cam_.K()), mask, R, t;
+    Mat E = findEssentialMat(pr, pc, K, RANSAC, 0.999, 1.0, mask);
+    if (E.rows < 3)
+        return false;
+    if (recoverPose(E.rowRange(0, 3), pr, pc, K, R, t, mask) < kMinInitInliers)
+        return false;
+    Pose origin, cur(Matx33d((const double *)R.data), Vec3d((const double *)t.data));
+
+    //our own small map to track against until mapping publishes its own
+    std::shared_ptr<LocalMap> lm = std::make_shared<LocalMap>();
+    for (size_t i = 0; i < m.size(); i++) {
+        Vec3d x;
+        if (!mask.at<uchar>((int)i) || !triangulate(cam_, origin, pr[i], cur, pc[i], 2.0, x))
+            continue;
+        lm->ids.push_back(-1);
+        lm->points.push_back(x);
+        lm->desc.push_back(f.desc.row(m[i].queryIdx));
+    }
+    if (lm->points.size() < kMinInitPoints)
+        return false;
+
+    //mapping builds the real map from these two the same way
+    std::vector<int64_t> none;
+    if (!sendKeyFrame(ref_, origin, none))
+        return false;
+    if (!sendKeyFrame(f, cur, none)) {
+        //mapping has the first alone: the next try starts a map of its own
+        mapId_++;
+        return false;
+    }
+
+    lm->mapId        = mapId_;
+    lm->lastKeyFrame = nextKeyFrame_ - 1;
+    map_             = lm;
+    applied_         = Pose();
+    pose_            = cur;
+    velocity_        = Pose();
+    sinceKeyFrame_   = 0;
+    keyFrameInliers_ = (int)lm->points.size();
+    tracking_        = true;
+    std::cout << "Map " << mapId_ << " started at frame " << f.seq << " with "
+              << lm->points.size() << " points" << std::endl;
+    return true;
+}
+
+bool Tracking::track(const Frame &f)
+{
+    //where the last frame's motion would have taken us, and where each map
+    //point is seen from there; only keys near that are compared with it
+    Pose guess = velocity_ * pose_;
+    where_.resize(map_->points.size());
+    for (size_t i = 0; i < map_->points.size(); i++) {
+        Vec3d xc = guess * map_->points[i];
+        Point2d p = xc[2] > 0 ? cam_.project(xc) : Point2d(-1, -1);
+        where_[i] = Point2f((float)p.x, (float)p.y);
+    }
+
+    //DMatch queryIdx is the map point, trainIdx the key
+    std::vector<DMatch> m;
+    matcher_.setTrain(f.desc, f.keys, kWindowCell);
+    matcher_.matchWindowed(map_->desc, where_, kWindowRadius, kMatchRatio, kMaxMatchDistance, true, m);
+    if (m.size() < kMinWindowMatches)
+        matcher_.match(map_->desc, kMatchRatio, kMaxMatchDistance, true, m);   // moved unlike the last frame
+    if (m.size() < kMinTrackInliers)
+        return false;
+
+    std::vector<Point3f> obj;
+    std::vector<Point2f> img;
+    for (size_t i = 0; i < m.size(); i++) {
+        const Vec3d &x = map_->points[m[i].queryIdx];
+        obj.push_back(Point3f((float)x[0], (float)x[1], (float)x[2]));
+        img.push_back(f.keys[m[i].trainIdx].pt);
+    }
+
+    Mat rvec(rotationVector(guess.R)), tvec(guess.t);
+    std::vector<int> inliers;
+    if (!solvePnPRansac(obj, img, Mat(cam_.K()), noArray(), rvec, tvec, true, 100, 3.0f, 0.99, inliers)
+        || inliers.size() < kMinTrackInliers)
+        return false;
+
+    Pose pose(rotation(Vec3d((const double *)rvec.data)), Vec3d((const double *)tvec.data));
+    velocity_ = pose * pose_.inverse();
+    pose_     = pose;
+
+    if (flow_) {
+        flowPoints_.resize(inliers.size());
+        flowPixels_.resize(inliers.size());
+        for (size_t i = 0; i < inliers.size(); i++) {
+            flowPoints_[i] = obj[inliers[i]];
+            flowPixels_[i] = img[inliers[i]];
+        }
+    }
+
+    sinceKeyFrame_++;
+    if (sinceKeyFrame_ >= kMinKeyFrameGap
+        && (inliers.size() < kKeyFrameInliers * keyFrameInliers_ || sinceKeyFrame_ >= kMaxKeyFrameGap)) {
+        std::vector<int64_t> points(f.keys.size(), -1);
+        for (size_t i = 0; i < inliers.size(); i++) {
+            const DMatch &d = m[inliers[i]];
+            points[d.trainIdx] = map_->ids[d.queryIdx];
+        }
+        if (sendKeyFrame(f, pose_, points)) {
+            sinceKeyFrame_   = 0;
+            keyFrameInliers_ = (int)inliers.size();
+        }
+    }
+    return true;
+}
+
+bool Tracking::trackFlow()
+{
+    //a keyframe due next needs keypoints
+    if (!flow_ || flowPixels_.size() < kMinFlowPoints || sinceKeyFrame_ + 1 >= kMaxKeyFrameGap)
+        return false;
+
+    //each point followed from where the last frame's motion puts it
+    Pose guess = velocity_ * pose_;
+    flowNext_.resize(flowPoints_.size());
+    for (size_t i = 0; i < flowPoints_.size(); i++) {
+        const Point3f &x = flowPoints_[i];
+        Vec3d xc = guess * Vec3d(x.x, x.y, x.z);
+        Point2d p = xc[2] > 0 ? cam_.project(xc) : Point2d(flowPixels_[i].x, flowPixels_[i].y);
+        flowNext_[i] = Point2f((float)p.x, (float)p.y);
+    }
+    klt_.track(extractor_.lastPyramid(), extractor_.pyramid(), flowPixels_, flowNext_, flowFound_);
+
+    std::vector<Point3f> obj;
+    std::vector<Point2f> img;
+    for (size_t i = 0; i < flowFound_.size(); i++) {
+        if (flowFound_[i]) {
+            obj.push_back(flowPoints_[i]);
+            img.push_back(flowNext_[i]);
+        }
+    }
+    if (obj.size() < kMinFlowPoints)
+        return false;
+
+    Mat rvec(rotationVector(guess.R)), tvec(guess.t);
+    std::vector<int> inliers;
+    if (!solvePnPRansac(obj, img, Mat(cam_.K()), noArray(), rvec, tvec, true, 100, 3.0f, 0.99, inliers)
+        || inliers.size() < kMinFlowPoints)
+        return false;
+    //the map in view is thinning out: let a frame with keypoints decide
+    //whether that makes a keyframe
+    if (sinceKeyFrame_ + 1 >= kMinKeyFrameGap && inliers.size() < kKeyFrameInliers * keyFrameInliers_)
+        return false;
+
+    Pose pose(rotation(Vec3d((const double *)rvec.data)), Vec3d((const double *)tvec.data));
+    velocity_ = pose * pose_.inverse();
+    pose_     = pose;
+    sinceKeyFrame_++;
+
+    flowPoints_.resize(inliers.size());
+    flowPixels_.resize(inliers.size());
+    for (size_t i = 0; i < inliers.size(); i++) {
+        flowPoints_[i] = obj[inliers[i]];
+        flowPixels_[i] = img[inliers[i]];
+    }
+    return true;
+}
+
+void Tracking::adoptLocalMap()
+{
+    LocalMapPtr lm, newest;
+    while (localMaps_.tryPop(lm)) {
+        if (lm->mapId == mapId_)
+            newest = lm;
+    }
+    if (!newest || !tracking_)
+        return;
+
+    //a loop closed since we last looked: the world moved, and we with it
+    pose_    = corrected(pose_, newest->corrected * applied_.inverse());
+    applied_ = newest->corrected;
+    map_     = newest;
+    //the points flow follows may have moved with it: match the next frame
+    flowPixels_.clear();
+}
+
+bool Tracking::sendKeyFrame(const Frame &f, const Pose &pose, const std::vector<int64_t> &points)
+{
+    std::shared_ptr<KeyFrame> kf = std::make_shared<KeyFrame>();
+    kf->id        = nextKeyFrame_;
+    kf->mapId     = mapId_;
+    kf->seq       = f.seq;
+    kf->stampNs   = f.stampNs;
+    kf->pose      = pose;
+    kf->keys      = f.keys;
+    kf->desc      = f.desc;
+    kf->points    = points.empty() ? std::vector<int64_t>(f.keys.size(), -1) : points;
+    kf->corrected = applied_;
+
+    //mapping still busy with the ones before: skip it, try again next frame
+    bool sent = keyFrames_.tryPush(kf);
+    if (sent)
+        nextKeyFrame_++;
+    pthread_mutex_lock(&lock_);
+    if (sent)
+        stats_.keyFrames++;
+    else
+        stats_.skippedKeyFrames++;
+    pthread_mutex_unlock(&lock_);
+    return sent;
+}
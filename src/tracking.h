@@ -0,0 +1,117 @@
+/**
+ * Tracking: the camera pose for every frame, as soon as it arrives.
+ *
+ * Two keyframes are made from the first pair of frames far enough apart to
+ * give an essential matrix, with the first camera as the world origin.
+ * From then on every frame is matched against the local map mapping
+ * publishes and its pose solved by PnP, starting from a constant velocity
+ * guess. When too few map points are left in view a keyframe goes to
+ * mapping; if mapping hasn't taken the last ones yet, the keyframe is
+ * skipped and tried again on the next frame, tracking never waits.
+ *
+ * When matching fails tracking is lost and starts a new map from scratch.
+ *
+ * With flow on, frames in between are tracked without keypoints at all:
+ * the points the last frame's pose rests on are followed into the next by
+ * optical flow (klt_tracker.h), on the pyramids feature extraction builds
+ * anyway, and the pose solved from them. Keypoints and matching are back
+ * for a frame when too few of those points are left, when a keyframe is
+ * due, and after every new local map.
+ */
+
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include "slam_types.h"
+#include "spsc_queue.h"
+#include "image_features.h"
+#include "klt_tracker.h"
+#include <pthread.h>
+
+//a frame from the input thread
+struct InputFrame {
+    uint64_t seq;
+    uint64_t stampNs;     // capture time, frameClockNs()
+    uint64_t arrivedNs;   // monotonic, when the input thread had it
+    cv::Mat  gray;
+};
+
+struct TrackingStats {
+    uint64_t              frames;
+    uint64_t              tracked;
+    uint64_t              lost;        // times tracking was lost
+    uint64_t              flowed;      // tracked by optical flow alone
+    uint64_t              keyFrames;
+    uint64_t              skippedKeyFrames;  // mapping was busy
+    std::vector<uint32_t> latencyUs;   // arrival to pose, per frame
+
+    TrackingStats() : frames(0), tracked(0), lost(0), flowed(0), keyFrames(0), skippedKeyFrames(0) {}
+};
+
+class Tracking {
+public:
+    //with flow, frames between keyframes are tracked by optical flow
+    Tracking(const Camera &cam, int maxFeatures, bool flow, SpscQueue<InputFrame> &frames,
+             SpscQueue<KeyFramePtr> &keyFrames, SpscQueue<LocalMapPtr> &localMaps);
+    ~Tracking();
+
+    //pthread entry point, arg is the Tracking
+    static void *thread(void *arg);
+    //until the frame queue is closed and drained; then closes keyFrames
+    void run();
+
+    //figures since the last call, from any thread
+    void takeStats(TrackingStats &out);
+
+private:
+    Tracking(const Tracking &);
+    Tracking &operator=(const Tracking &);
+
+    struct Frame {
+        uint64_t                  seq;
+        uint64_t                  stampNs;
+        std::vector<cv::KeyPoint> keys;
+        cv::Mat                   desc;
+    };
+
+    void process(const InputFrame &in);
+    bool initialise(const Frame &f);
+    bool track(const Frame &f);
+    bool trackFlow();
+    void adoptLocalMap();
+    bool sendKeyFrame(const Frame &f, const Pose &pose, const std::vector<int64_t> &points);
+    void startOver(const Frame &f);
+
+    Camera                  cam_;
+    FeatureExtractor        extractor_;
+    HammingMatcher          matcher_;
+    std::vector<cv::Point2f> where_;        // tracking: map points projected by the motion model
+    KltTracker              klt_;
+    SpscQueue<InputFrame>  &frames_;
+    SpscQueue<KeyFramePtr> &keyFrames_;
+    SpscQueue<LocalMapPtr> &localMaps_;
+
+    bool        tracking_;      // false while initialising
+    uint32_t    mapId_;
+    uint64_t    nextKeyFrame_;
+    Frame       ref_;           // initialising: the frame to start from
+    LocalMapPtr map_;           // what we match against
+    Pose        applied_;       // part of map_->corrected we have applied
+    Pose        pose_;          // last frame's
+    Pose        velocity_;      // last frame's pose relative to the one before
+    int         sinceKeyFrame_; // frames
+    int         keyFrameInliers_;
+
+    //flow: the points the last pose was solved from, where they were in the
+    //last frame, and scratch for following them
+    bool                     flow_;
+    std::vector<cv::Point3f> flowPoints_;
+    std::vector<cv::Point2f> flowPixels_;
+    std::vector<cv::Point2f> flowNext_;
+    std::vector<uchar>       flowFound_;
+
+    pthread_mutex_t lock_;      // guards stats_ only
+    TrackingStats   stats_;
+};
+
+#endif
@@ -5,12 +5,100 @@
  */
 
 #include "opencv2/opencv.hpp"
-#include <sys/socket.h> 
-#include <arpa/inet.h>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <time.h>
+#include "frame_protocol.h"
+#include "frame_codec.h"
+#include "stream_reader.h"
+#include "frame_queue.h"
+#include "stream_stats.h"
+#include "frame_log.h"
 
 using namespace cv;
 
+void *receive(void *);
+
+// frames the display hasn't caught up with; a few are plenty since it
+// only ever shows the newest
+static const size_t kQueueSlots = 4;
+
+// per camera: the receive thread's decoder and sequence tracking, and the
+// queue between it and the display
+struct CameraView {
+    FrameQueue   queue;
+    FrameDecoder decoder;   // delta payloads refer to this camera's frames
+    uint64_t     lastSeq;
+    uint64_t     dropped;   // receive side: gaps, undecodable, display behind
+    uint64_t     skipped;   // display side: superseded before being shown
+    std::string  window;
+
+    CameraView() : queue(kQueueSlots), lastSeq(0), dropped(0), skipped(0) {}
+};
+
+StreamReader *reader;
+CameraView   *views[kMaxCameras];       // NULL for cameras not asked for
+bool          streamEnded = false;  // set by the receive thread
+
+// -H: no window, just statistics every reportSecs for durationSecs (0 =
+// until the stream ends)
+bool          headless = false;
+double        reportSecs = 1;
+double        durationSecs = 0;
+StreamStats   stats;
+
+// -w: everything received goes to this log too, NULL if not recording
+FrameLogWriter *recorder = NULL;
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//write the recording's index and say how it went
+static void finishRecording()
+{
+    if (recorder == NULL)
+        return;
+    bool ok = recorder->close();
+    std::cout << (ok ? "Recorded " : "Recording failed after ") << recorder->frames() << " frames, "
+              << recorder->bytes() / 1e6 << " MB; waited for the disk " << recorder->stalls()
+              << " times" << std::endl;
+    delete recorder;
+    recorder = NULL;
+}
+
+static void usage()
+{
+    std::cerr << "Usage: cv_video_cli [options] <serverIP> <serverPort> [codec] [policy]\n"
+              << "       cv_video_cli [options] shm <segment name>\n"
+              << "       cv_video_cli [options] mcast <group:port> [deadline ms]\n"
+              << "       cv_video_cli [options] log <file>\n"
+              << "codec  : raw | jpeg | png | qoi | delta (raw default)\n"
+              << "policy : latest | drop | block (server default)\n"
+              << "shm reads raw frames from a server started with -s\n"
+              << "mcast joins the group of a server started with -m, frames missing\n"
+              << "fragments after the deadline (100 default) are dropped\n"
+              << "log replays a recording made with -w at the pace it was recorded\n"
+              << "-H             : headless, no window: print fps, MB/s, dropped frames\n"
+              << "                 and latency percentiles every interval instead\n"
+              << "-i seconds     : headless report interval (1 default)\n"
+              << "-d seconds     : headless run time, then exit (until the stream ends default)\n"
+              << "-S stream      : which of the server's processing streams, 0 is the end of\n"
+              << "                 its chain, 1 and up its taps (0 default)\n"
+              << "-C cameras     : the server's cameras to show, comma separated (e.g. 0,2),\n"
+              << "                 each in a window of its own (0 default)\n"
+              << "-w file        : also record every frame received, as it arrived, to file\n"
+              << "                 (indexed by seq and capture time, see frame_log.h)\n"
+              << "-W MB          : memory for recording writes not on disk yet; a disk\n"
+              << "                 stalled for longer holds up receiving (64 default)"
+              << std::endl;
+}
 
 int main(int argc, char** argv)
 {
@@ -18,30 +106,108 @@ int main(int argc, char** argv)
     //--------------------------------------------------------
     //networking stuff: socket , connect
     //--------------------------------------------------------
-    int         sokt;
-    char*       serverIP;
-    int         serverPort;
+    int         codec  = CODEC_RAW;
+    int         policy = kPolicyServerDefault;
+    int         stream = 0;
+    unsigned    cameras = 0;
+    const char *recordPath = NULL;
+    double      recordMB = 64;
 
-    if (argc < 3) {
-           std::cerr << "Usage: cv_video_cli <serverIP> <serverPort> " << std::endl;
+    int opt;
+    while ((opt = getopt(argc, argv, "Hi:d:S:C:w:W:")) != -1) {
+        switch (opt) {
+        case 'H':
+            headless = true;
+            break;
+        case 'i':
+            if ((reportSecs = atof(optarg)) <= 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'd':
+            durationSecs = atof(optarg);
+            break;
+        case 'C':
+            for (char *p = optarg; *p != '\0'; ) {
+                char *end;
+                long id = strtol(p, &end, 10);
+                if (end == p || id < 0 || id >= kMaxCameras || (*end != ',' && *end != '\0')) {
+                    usage();
+                    return 1;
+                }
+                cameras |= 1u << id;
+                p = *end == ',' ? end + 1 : end;
+            }
+            break;
+        case 'w':
+            recordPath = optarg;
+            break;
+        case 'W':
+            if ((recordMB = atof(optarg)) <= 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'S':
+            stream = atoi(optarg);
+            if (stream < 0 || stream > 255) {
+                usage();
+                return 1;
+            }
+            break;
+        default:
+            usage();
+            return 1;
+        }
     }
 
-    serverIP   = argv[1];
-    serverPort = atoi(argv[2]);
-
-    struct  sockaddr_in serverAddr;
-    socklen_t           addrLen = sizeof(struct sockaddr_in);
+    //positional arguments from here on, argv[0] being the first of them
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
 
-    if ((sokt = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        std::cerr << "socket() failed" << std::endl;
+    //shared memory and multicast only ever carry camera 0
+    if (cameras == 0 || strcmp(argv[1], "shm") == 0 || strcmp(argv[1], "mcast") == 0)
+        cameras = 1;
+    for (int i = 0; i < kMaxCameras; i++) {
+        if (!(cameras & (1u << i)))
+            continue;
+        views[i] = new CameraView;
+        views[i]->window = cameras == 1 ? "CV Video Client"
+                                        : "CV Video Client camera " + std::to_string(i);
     }
 
-    serverAddr.sin_family = PF_INET;
-    serverAddr.sin_addr.s_addr = inet_addr(serverIP);
-    serverAddr.sin_port = htons(serverPort);
+    if (strcmp(argv[1], "shm") == 0) {
+        reader = new ShmReader(argv[2]);
+    } else if (strcmp(argv[1], "mcast") == 0) {
+        reader = McastReader::join(argv[2], argc > 3 ? atoi(argv[3]) : 100);
+        if (reader == NULL)
+            return 1;
+    } else if (strcmp(argv[1], "log") == 0) {
+        reader = LogReader::open(argv[2], cameras);
+        if (reader == NULL)
+            return 1;
+    } else {
+        if (argc > 3 && (codec = parseCodec(argv[3])) < 0) {
+            std::cerr << "unknown codec " << argv[3] << std::endl;
+            return 1;
+        }
+        if (argc > 4) {
+            static const char *policies[] = { "latest", "drop", "block" };
+            for (policy = 2; policy >= 0 && strcmp(argv[4], policies[policy]) != 0; policy--) {}
+            if (policy < 0) {
+                std::cerr << "unknown policy " << argv[4] << std::endl;
+                return 1;
+            }
+        }
 
-    if (connect(sokt, (sockaddr*)&serverAddr, addrLen) < 0) {
-        std::cerr << "connect() failed!" << std::endl;
+        reader = TcpReader::connect(argv[1], atoi(argv[2]), codec, policy, stream, cameras);
+        if (reader == NULL)
+            return 1;
     }
 
 
@@ -50,35 +216,160 @@ int main(int argc, char** argv)
     //OpenCV Code
     //----------------------------------------------------------
 
-    Mat img;
-    img = Mat::zeros(480 , 640, CV_8UC1);    
-    int imgSize = img.total() * img.elemSize();
-    uchar *iptr = img.data;
-    int bytes = 0;
-    int key;
+    if (recordPath != NULL) {
+        recorder = FrameLogWriter::create(recordPath, (size_t)(recordMB * (1 << 20)));
+        if (recorder == NULL)
+            return 1;
+    }
 
-    //make img continuos
-    if ( ! img.isContinuous() ) { 
-          img = img.clone();
+    //the network is read on its own thread so that drawing never holds
+    //up recv() and lets the server's socket buffers fill
+    pthread_t receive_id;
+    if (pthread_create(&receive_id, NULL, receive, NULL) != 0) {
+        perror("Can't start receive thread");
+        return 1;
     }
-        
-    std::cout << "Image Size:" << imgSize << std::endl;
 
+    if (headless) {
+        uint64_t start = monotonicNs();
+        uint64_t nextReport = start + (uint64_t)(reportSecs * 1e9);
+        uint64_t end = durationSecs > 0 ? start + (uint64_t)(durationSecs * 1e9) : 0;
+
+        while (!__atomic_load_n(&streamEnded, __ATOMIC_ACQUIRE)) {
+            uint64_t now = monotonicNs();
+            if (end != 0 && now >= end)
+                break;
+            if (now >= nextReport) {
+                stats.report(std::cout);
+                nextReport += (uint64_t)(reportSecs * 1e9);
+            }
+            usleep(10000);
+        }
+
+        reader->cancel();
+        pthread_join(receive_id, NULL);
+        delete reader;
+        finishRecording();
+        stats.summary(std::cout);
+        return 0;
+    }
 
-    namedWindow("CV Video Client",1);
+    int key = 0;
+
+    for (int i = 0; i < kMaxCameras; i++) {
+        if (views[i] != NULL)
+            namedWindow(views[i]->window, 1);
+    }
 
     while (key != 'q') {
 
-        if ((bytes = recv(sokt, iptr, imgSize , MSG_WAITALL)) == -1) {
-            std::cerr << "recv failed, received bytes = " << bytes << std::endl;
+        //newest frame of each camera only, anything older it replaced counts
+        //as skipped; read the flag first so the stream's last frame isn't missed
+        bool ended = __atomic_load_n(&streamEnded, __ATOMIC_ACQUIRE);
+        bool shown = false;
+        for (int i = 0; i < kMaxCameras; i++) {
+            CameraView *v = views[i];
+            uint64_t superseded;
+            QueuedFrame *f = v != NULL ? v->queue.popNewest(superseded) : NULL;
+            if (f == NULL)
+                continue;
+            v->skipped += superseded;
+
+            const FrameHeader &hdr = f->hdr;
+            double latencyMs = ((int64_t)(frameClockNs() - hdr.stampNs)) / 1e6;
+            std::cout << "Frame " << hdr.seq;
+            if (cameras != 1)
+                std::cout << " camera " << i;
+            std::cout << " " << hdr.width << "x" << hdr.height
+                      << " " << codecName(hdr.codec)
+                      << " size " << hdr.payloadLen << " latency " << latencyMs << " ms";
+            if (isStereoPair(hdr.pair))
+                std::cout << " stereo skew " << pairSkewUs(hdr.pair) << " us";
+            std::cout << " dropped " << f->dropped << " skipped " << v->skipped << "\n";
+            cv::imshow(v->window, f->img);
+            v->queue.release();
+            shown = true;
         }
-        std::cout << "Image received, will show. Size: " << bytes << "\n";
-        cv::imshow("CV Video Client", img); 
-      
-        if (key = cv::waitKey(10) >= 0) break;
-    }   
+        if (!shown && ended)
+            break;
 
-    close(sokt);
+        if ((key = cv::waitKey(shown ? 1 : 5)) >= 0) break;
+    }
+
+    reader->cancel();
+    pthread_join(receive_id, NULL);
+    delete reader;
+    finishRecording();
 
     return 0;
-}
\ No newline at end of file
+}
+
+void *receive(void *){
+    Mat         scratch;
+    FrameHeader hdr;
+    const uint8_t *payload;
+    bool        recordFailed = false;
+
+    while (reader->next(hdr, payload)) {
+
+        CameraView *v = hdr.camera < kMaxCameras ? views[hdr.camera] : NULL;
+        if (v == NULL) {
+            std::cerr << "frame " << hdr.seq << " from camera " << (int)hdr.camera
+                      << ", which we didn't ask for" << std::endl;
+            continue;
+        }
+        uint64_t &lastSeq = v->lastSeq;
+        uint64_t &dropped = v->dropped;
+
+        //sequence gaps count as dropped whether or not this one decodes
+        if (lastSeq != 0 && hdr.seq > lastSeq + 1) {
+            dropped += hdr.seq - lastSeq - 1;
+            stats.drop(hdr.seq - lastSeq - 1);
+        }
+        lastSeq = hdr.seq;
+
+        //recorded as it came, before anything else can go wrong with it
+        if (recorder != NULL && !recorder->append(hdr, payload) && !recordFailed) {
+            std::cerr << "recording stopped, see above" << std::endl;
+            recordFailed = true;
+        }
+
+        //with the display a whole ring behind, decode anyway (a delta
+        //chain needs every frame) but into scratch, and drop it; headless
+        //there is no display and every frame goes to scratch
+        QueuedFrame *f = headless ? NULL : v->queue.writeSlot();
+        Mat &img = f != NULL ? f->img : scratch;
+
+        //raw frames are copied out too, for shared memory the slot in the
+        //segment is reused as soon as the server comes round again
+        if (!v->decoder.decode(hdr, payload, hdr.payloadLen, img)) {
+            std::cerr << "can't decode frame " << hdr.seq << ", codec "
+                      << codecName(hdr.codec) << std::endl;
+            stats.drop(1);
+            continue;
+        }
+
+        //the writer lapped us while we were copying, what we have may be torn
+        if (!reader->stillValid()) {
+            if (recorder != NULL)
+                recorder->dropLast();
+            dropped++;
+            stats.drop(1);
+            continue;
+        }
+        stats.frame(hdr, frameClockNs());
+
+        if (f == NULL) {
+            if (!headless)
+                dropped++;
+            continue;
+        }
+
+        f->hdr     = hdr;
+        f->dropped = dropped;
+        v->queue.push();
+    }
+
+    __atomic_store_n(&streamEnded, true, __ATOMIC_RELEASE);
+    return NULL;
+}
@@ -0,0 +1,436 @@
+#include "frame_log.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+static const uint32_t kLogMagic       = 0x4c4d4c53; // "SLML" on disk
+static const uint32_t kChunkMagic     = 0x434d4c53; // "SLMC"
+static const uint32_t kIndexMagic     = 0x584d4c53; // "SLMX"
+static const uint16_t kLogVersion     = 1;
+static const size_t   kLogHeaderSize  = 16;
+static const size_t   kChunkHeaderSize = 16;
+static const size_t   kIndexEntrySize = 32;
+static const size_t   kFooterSize     = 24;
+
+//unit of batching: what one write() hands the disk
+static const size_t   kChunkBytes     = 4 << 20;
+//index entries reserved up front: an hour at 30 fps, about 4 MB
+static const size_t   kIndexReserve   = 3600 * 30;
+
+static inline size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+//index order: by camera, recording order within one
+static bool byCamera(const FrameLogEntry &a, const FrameLogEntry &b)
+{
+    return a.camera < b.camera;
+}
+
+//--------------------------------------------------------
+//writer
+//--------------------------------------------------------
+
+FrameLogWriter *FrameLogWriter::create(const char *path, size_t bufferBytes)
+{
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    FrameLogWriter *w = new FrameLogWriter(fd, path, std::max((size_t)2, bufferBytes / kChunkBytes));
+
+    uint8_t hdr[kLogHeaderSize];
+    memset(hdr, 0, sizeof(hdr));
+    putLE(hdr + 0, kLogMagic, 4);
+    putLE(hdr + 4, kLogVersion, 2);
+    putLE(hdr + 6, kLogHeaderSize, 2);
+    if (!w->writeAt(hdr, sizeof(hdr), 0)) {
+        perror(path);
+        w->closed_ = true;
+        delete w;
+        ::close(fd);
+        return NULL;
+    }
+
+    if (pthread_create(&w->thread_, NULL, writerThread, w) != 0) {
+        perror("Can't start log writer thread");
+        w->closed_ = true;
+        delete w;
+        ::close(fd);
+        return NULL;
+    }
+    return w;
+}
+
+FrameLogWriter::FrameLogWriter(int fd, const char *path, size_t chunks)
+    : fd_(fd),
+      path_(path),
+      cur_(NULL),
+      fileOff_(kLogHeaderSize),
+      lastRecord_(0),
+      stalls_(0),
+      closing_(false),
+      failed_(false),
+      closed_(false)
+{
+    //the memory up front, and the chunks touched, so the receive thread
+    //doesn't allocate or page fault for them. Only a recording longer than
+    //kIndexReserve frames grows the index, and a frame larger than a chunk
+    //its chunk
+    index_.reserve(kIndexReserve);
+    for (size_t i = 0; i < chunks; i++) {
+        Chunk *c = new Chunk;
+        c->buf.resize(kChunkBytes);
+        c->used = c->records = 0;
+        c->offset = 0;
+        chunks_.push_back(c);
+        free_.push_back(c);
+    }
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&changed_, NULL);
+}
+
+FrameLogWriter::~FrameLogWriter()
+{
+    close();
+    for (size_t i = 0; i < chunks_.size(); i++)
+        delete chunks_[i];
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&changed_);
+}
+
+bool FrameLogWriter::writeAt(const uint8_t *p, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd_, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p      += n;
+        len    -= n;
+        offset += n;
+    }
+    return true;
+}
+
+FrameLogWriter::Chunk *FrameLogWriter::takeFree()
+{
+    pthread_mutex_lock(&lock_);
+    if (free_.empty())
+        stalls_++;
+    while (free_.empty())
+        pthread_cond_wait(&changed_, &lock_);
+    Chunk *c = free_.front();
+    free_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    return c;
+}
+
+void FrameLogWriter::submit()
+{
+    putLE(&cur_->buf[0], kChunkMagic, 4);
+    putLE(&cur_->buf[4], cur_->records, 4);
+    putLE(&cur_->buf[8], cur_->used, 8);
+    fileOff_ += cur_->used;
+
+    pthread_mutex_lock(&lock_);
+    full_.push_back(cur_);
+    pthread_cond_broadcast(&changed_);
+    pthread_mutex_unlock(&lock_);
+    cur_        = NULL;
+    lastRecord_ = 0;
+}
+
+bool FrameLogWriter::append(const FrameHeader &h, const uint8_t *data)
+{
+    size_t rec = align8(kFrameHeaderSize + h.payloadLen);
+
+    if (cur_ != NULL && cur_->used + rec > cur_->buf.size())
+        submit();
+    if (cur_ == NULL) {
+        cur_ = takeFree();
+        cur_->used    = kChunkHeaderSize;
+        cur_->records = 0;
+        cur_->offset  = fileOff_;
+        //a frame larger than a chunk gets a chunk of its own
+        if (cur_->buf.size() < kChunkHeaderSize + rec)
+            cur_->buf.resize(kChunkHeaderSize + rec);
+    }
+
+    uint8_t *p = &cur_->buf[cur_->used];
+    packFrameHeader(h, p);
+    if (h.payloadLen > 0)
+        memcpy(p + kFrameHeaderSize, data, h.payloadLen);
+    memset(p + kFrameHeaderSize + h.payloadLen, 0, rec - kFrameHeaderSize - h.payloadLen);
+
+    FrameLogEntry e;
+    e.seq     = h.seq;
+    e.stampNs = h.stampNs;
+    e.offset  = cur_->offset + cur_->used;
+    e.camera  = h.camera;
+    index_.push_back(e);
+
+    lastRecord_ = cur_->used;
+    cur_->used += rec;
+    cur_->records++;
+    return !__atomic_load_n(&failed_, __ATOMIC_RELAXED);
+}
+
+void FrameLogWriter::dropLast()
+{
+    //append() never submits the chunk holding the record it just added
+    if (lastRecord_ == 0)
+        return;
+    cur_->used = lastRecord_;
+    cur_->records--;
+    index_.pop_back();
+    lastRecord_ = 0;
+}
+
+void *FrameLogWriter::writerThread(void *arg)
+{
+    static_cast<FrameLogWriter *>(arg)->run();
+    return NULL;
+}
+
+void FrameLogWriter::run()
+{
+    uint64_t prevOff = 0, prevLen = 0;
+
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        while (full_.empty() && !closing_)
+            pthread_cond_wait(&changed_, &lock_);
+        if (full_.empty())
+            break;
+        Chunk *c = full_.front();
+        pthread_mutex_unlock(&lock_);
+
+        //after a failed write the rest is thrown away, the log is unusable
+        bool ok = !__atomic_load_n(&failed_, __ATOMIC_RELAXED) && writeAt(&c->buf[0], c->used, c->offset);
+        if (!ok && !__atomic_load_n(&failed_, __ATOMIC_RELAXED)) {
+            perror(path_.c_str());
+            __atomic_store_n(&failed_, true, __ATOMIC_RELAXED);
+        }
+#ifdef __linux__
+        //start writing this chunk back now instead of whenever the kernel
+        //decides to flush everything dirty, then wait for the previous one
+        //and drop it from the page cache, nobody reads it back
+        if (ok) {
+            sync_file_range(fd_, c->offset, c->used, SYNC_FILE_RANGE_WRITE);
+            if (prevLen > 0) {
+                sync_file_range(fd_, prevOff, prevLen, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fd_, prevOff, prevLen, POSIX_FADV_DONTNEED);
+            }
+            prevOff = c->offset;
+            prevLen = c->used;
+        }
+#endif
+
+        pthread_mutex_lock(&lock_);
+        full_.pop_front();
+        free_.push_back(c);
+        pthread_cond_broadcast(&changed_);
+    }
+    pthread_mutex_unlock(&lock_);
+    (void)prevOff;
+    (void)prevLen;
+}
+
+bool FrameLogWriter::close()
+{
+    if (closed_)
+        return !failed_;
+    closed_ = true;
+
+    if (cur_ != NULL && cur_->records > 0)
+        submit();
+    pthread_mutex_lock(&lock_);
+    if (cur_ != NULL)
+        free_.push_back(cur_);
+    cur_     = NULL;
+    closing_ = true;
+    pthread_cond_broadcast(&changed_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+
+    if (!failed_) {
+        std::stable_sort(index_.begin(), index_.end(), byCamera);
+
+        std::vector<uint8_t> tail(index_.size() * kIndexEntrySize + kFooterSize, 0);
+        uint8_t *p = &tail[0];
+        for (size_t i = 0; i < index_.size(); i++, p += kIndexEntrySize) {
+            putLE(p +  0, index_[i].seq, 8);
+            putLE(p +  8, index_[i].stampNs, 8);
+            putLE(p + 16, index_[i].offset, 8);
+            p[24] = index_[i].camera;
+        }
+        putLE(p +  0, kIndexMagic, 4);
+        putLE(p +  4, kLogVersion, 2);
+        putLE(p +  8, index_.size(), 8);
+        putLE(p + 16, fileOff_, 8);
+
+        if (!writeAt(&tail[0], tail.size(), fileOff_) || fsync(fd_) < 0) {
+            perror(path_.c_str());
+            failed_ = true;
+        }
+    }
+    ::close(fd_);
+    return !failed_;
+}
+
+//--------------------------------------------------------
+//reader
+//--------------------------------------------------------
+
+FrameLogReader *FrameLogReader::open(const char *path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < kLogHeaderSize) {
+        std::cerr << path << " is not a frame log" << std::endl;
+        ::close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    FrameLogReader *r = new FrameLogReader((const uint8_t *)map, st.st_size);
+    if (getLE(r->map_, 4) != kLogMagic || getLE(r->map_ + 4, 2) != kLogVersion) {
+        std::cerr << path << " is not a frame log this build understands" << std::endl;
+        delete r;
+        return NULL;
+    }
+    if (!r->readIndex()) {
+        r->rebuildIndex();
+        std::cerr << path << " has no index, was its recording cut short? Rebuilt it from "
+                  << r->count() << " frames" << std::endl;
+    }
+    return r;
+}
+
+FrameLogReader::FrameLogReader(const uint8_t *map, size_t size)
+    : map_(map),
+      size_(size)
+{
+}
+
+FrameLogReader::~FrameLogReader()
+{
+    munmap((void *)map_, size_);
+}
+
+bool FrameLogReader::readIndex()
+{
+    if (size_ < kLogHeaderSize + kFooterSize)
+        return false;
+    const uint8_t *f = map_ + size_ - kFooterSize;
+    if (getLE(f, 4) != kIndexMagic || getLE(f + 4, 2) != kLogVersion)
+        return false;
+    uint64_t count = getLE(f + 8, 8);
+    uint64_t at    = getLE(f + 16, 8);
+    if (at < kLogHeaderSize || at > size_ - kFooterSize
+        || (size_ - kFooterSize - at) % kIndexEntrySize != 0
+        || count != (size_ - kFooterSize - at) / kIndexEntrySize)
+        return false;
+
+    index_.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *p = map_ + at + i * kIndexEntrySize;
+        index_[i].seq     = getLE(p, 8);
+        index_[i].stampNs = getLE(p + 8, 8);
+        index_[i].offset  = getLE(p + 16, 8);
+        index_[i].camera  = p[24];
+        if (index_[i].offset + kFrameHeaderSize > at) {
+            index_.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void FrameLogReader::rebuildIndex()
+{
+    index_.clear();
+    size_t off = kLogHeaderSize;
+    while (off + kChunkHeaderSize <= size_ && getLE(map_ + off, 4) == kChunkMagic) {
+        uint32_t records = (uint32_t)getLE(map_ + off + 4, 4);
+        uint64_t bytes   = getLE(map_ + off + 8, 8);
+        //a chunk the writer never finished ends the usable part
+        if (bytes < kChunkHeaderSize || bytes > size_ - off)
+            break;
+
+        size_t p = off + kChunkHeaderSize;
+        for (uint32_t i = 0; i < records; i++) {
+            FrameHeader h;
+            if (p + kFrameHeaderSize > off + bytes || !unpackFrameHeader(map_ + p, h)
+                || h.payloadLen > off + bytes - p - h.headerLen)
+                break;
+            FrameLogEntry e;
+            e.seq     = h.seq;
+            e.stampNs = h.stampNs;
+            e.offset  = p;
+            e.camera  = h.camera;
+            index_.push_back(e);
+            p += align8(h.headerLen + h.payloadLen);
+        }
+        off += bytes;
+    }
+    std::stable_sort(index_.begin(), index_.end(), byCamera);
+}
+
+bool FrameLogReader::frame(size_t i, FrameHeader &h, const uint8_t *&data) const
+{
+    uint64_t off = index_[i].offset;
+    if (!unpackFrameHeader(map_ + off, h) || h.headerLen + h.payloadLen > size_ - off)
+        return false;
+    data = map_ + off + h.headerLen;
+    return true;
+}
+
+size_t FrameLogReader::findSeq(int camera, uint64_t seq) const
+{
+    size_t lo = 0, hi = index_.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const FrameLogEntry &e = index_[mid];
+        if (e.camera < camera || (e.camera == camera && e.seq < seq))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < index_.size() && index_[lo].camera == camera ? lo : index_.size();
+}
+
+size_t FrameLogReader::findStamp(int camera, uint64_t stampNs) const
+{
+    size_t lo = 0, hi = index_.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const FrameLogEntry &e = index_[mid];
+        if (e.camera < camera || (e.camera == camera && e.stampNs < stampNs))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < index_.size() && index_[lo].camera == camera ? lo : index_.size();
+}
@@ -0,0 +1,137 @@
+/**
+ * Recording of received frames to a log file that can be mmap()ed and
+ * seeked into later.
+ *
+ * Frames are stored as they arrived, packed FrameHeader and payload, so
+ * nothing is decoded or re-encoded on the way to disk. Little-endian, every
+ * record 8 byte aligned:
+ *
+ *   file header, 16 bytes: 'SLML', version (2), headerLen (2), zero (8)
+ *   chunks, each:          'SLMC', records (4), bytes (8) including this
+ *                          16 byte header, then its records
+ *   record:                packed FrameHeader, payload, zero padding to 8
+ *   index, 32 bytes each:  seq (8), stampNs (8), offset of the record (8),
+ *                          camera (1), zero (7); sorted by camera, then in
+ *                          recording order, so within a camera by seq and
+ *                          (capture stamps being monotonic) by stamp
+ *   footer, 24 bytes:      'SLMX', version (2), zero (2), entries (8),
+ *                          offset of the index (8)
+ *
+ * The writer is fed by the receive thread, which only copies each frame
+ * into the current chunk; full chunks go to a writer thread. The chunks
+ * are a fixed pool, so a disk that stalls for a moment is soaked up by the
+ * pool rather than by the network, and append() only blocks once the pool
+ * is full. Written chunks are pushed out and dropped from the page cache as
+ * we go, so hours of recording don't end in the kernel writing back
+ * gigabytes of dirty pages at once.
+ *
+ * A log whose recording was killed has no index or footer; the reader then
+ * rebuilds the index by walking the chunks, up to the last complete one.
+ */
+
+#ifndef FRAME_LOG_H
+#define FRAME_LOG_H
+
+#include "frame_protocol.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct FrameLogEntry {
+    uint64_t seq;
+    uint64_t stampNs;
+    uint64_t offset;    // of the record's packed header in the file
+    uint8_t  camera;
+};
+
+class FrameLogWriter {
+public:
+    //create (truncate) path with about bufferBytes of chunks; NULL after
+    //saying why
+    static FrameLogWriter *create(const char *path, size_t bufferBytes);
+    //close()s if that hasn't been done
+    ~FrameLogWriter();
+
+    //receive thread: copy a frame in; false once a write has failed
+    bool append(const FrameHeader &h, const uint8_t *data);
+    //forget the frame append() just added, e.g. it turned out torn
+    void dropLast();
+
+    //write what is buffered, then the index and footer; false if any of
+    //the recording could not be written
+    bool close();
+
+    uint64_t frames() const { return index_.size(); }
+    uint64_t bytes() const  { return fileOff_ + (cur_ != NULL ? cur_->used : 0); }
+    //appends that had to wait for the disk
+    uint64_t stalls() const { return stalls_; }
+
+private:
+    struct Chunk {
+        std::vector<uint8_t> buf;
+        size_t               used;
+        uint32_t             records;
+        uint64_t             offset;  // where it goes in the file
+    };
+
+    FrameLogWriter(int fd, const char *path, size_t chunks);
+    FrameLogWriter(const FrameLogWriter &);
+    FrameLogWriter &operator=(const FrameLogWriter &);
+
+    static void *writerThread(void *arg);
+    void run();
+    bool writeAt(const uint8_t *p, size_t len, uint64_t offset);
+    Chunk *takeFree();
+    void   submit();
+
+    int                   fd_;
+    std::string           path_;
+    std::vector<Chunk *>  chunks_;
+    std::deque<Chunk *>   free_;
+    std::deque<Chunk *>   full_;      // oldest first
+    Chunk                *cur_;       // the receive thread's, NULL until needed
+    uint64_t              fileOff_;   // where cur_ will go
+    size_t                lastRecord_; // in cur_, of the last append(); 0 if none
+    std::vector<FrameLogEntry> index_;
+    uint64_t              stalls_;
+    bool                  closing_;
+    bool                  failed_;
+    bool                  closed_;
+    pthread_t             thread_;
+    pthread_mutex_t       lock_;
+    pthread_cond_t        changed_;   // a chunk was queued, freed, or closing
+};
+
+class FrameLogReader {
+public:
+    //mmap path; NULL after saying why
+    static FrameLogReader *open(const char *path);
+    ~FrameLogReader();
+
+    size_t               count() const { return index_.size(); }
+    const FrameLogEntry &entry(size_t i) const { return index_[i]; }
+
+    //frame i's header and payload, which point into the mapping
+    bool frame(size_t i, FrameHeader &h, const uint8_t *&data) const;
+
+    //first entry of camera at or after seq / stampNs, count() if none
+    size_t findSeq(int camera, uint64_t seq) const;
+    size_t findStamp(int camera, uint64_t stampNs) const;
+
+private:
+    FrameLogReader(const uint8_t *map, size_t size);
+    FrameLogReader(const FrameLogReader &);
+    FrameLogReader &operator=(const FrameLogReader &);
+
+    bool readIndex();
+    void rebuildIndex();
+
+    const uint8_t             *map_;
+    size_t                     size_;
+    std::vector<FrameLogEntry> index_;
+};
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * Lock-free single producer, single consumer ring of preallocated frames
+ * between the client's receive thread and its display thread.
+ *
+ * The receiver decodes straight into writeSlot() and push()es it; the
+ * display takes the newest frame with popNewest(), which hands every older
+ * one back to the receiver at once, and gives it back with release() when
+ * drawn. The Mats are reused, so once they have their size nothing is
+ * allocated per frame. A full ring means the display is a whole ring
+ * behind; the receiver then keeps reading but drops what it gets.
+ */
+
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include "opencv2/opencv.hpp"
+#include "frame_protocol.h"
+#include <vector>
+#include <stdint.h>
+
+struct QueuedFrame {
+    FrameHeader hdr;
+    cv::Mat     img;
+    uint64_t    dropped;  // receiver's dropped count when this was pushed
+};
+
+class FrameQueue {
+public:
+    explicit FrameQueue(size_t slots)
+        : slots_(slots < 2 ? 2 : slots),
+          head_(0),
+          tail_(0)
+    {
+    }
+
+    //producer: slot to fill, NULL while the ring is full
+    QueuedFrame *writeSlot()
+    {
+        if (head_ - __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) >= slots_.size())
+            return NULL;
+        return &slots_[head_ % slots_.size()];
+    }
+
+    //producer: publish the slot from writeSlot()
+    void push()
+    {
+        __atomic_store_n(&head_, head_ + 1, __ATOMIC_RELEASE);
+    }
+
+    //consumer: newest pushed frame, NULL if none since the last one; frames
+    //it supersedes are freed and counted in skipped
+    QueuedFrame *popNewest(uint64_t &skipped)
+    {
+        uint64_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+        skipped = 0;
+        if (head == tail_)
+            return NULL;
+        skipped = head - tail_ - 1;
+        //everything but the newest goes back to the producer right away
+        __atomic_store_n(&tail_, head - 1, __ATOMIC_RELEASE);
+        return &slots_[(head - 1) % slots_.size()];
+    }
+
+    //consumer: done with the frame from popNewest()
+    void release()
+    {
+        __atomic_store_n(&tail_, tail_ + 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    FrameQueue(const FrameQueue &);
+    FrameQueue &operator=(const FrameQueue &);
+
+    std::vector<QueuedFrame> slots_;
+    //each index is written by one side only; keep them on separate cache
+    //lines so the two threads don't bounce one line between them
+    char                     pad0_[64];
+    uint64_t                 head_;
+    char                     pad1_[64];
+    uint64_t                 tail_;
+};
+
+#endif
@@ -0,0 +1,280 @@
+#include "stream_reader.h"
+#include "shm_ring.h"
+#include "udp_multicast.h"
+#include "frame_log.h"
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//--------------------------------------------------------
+//TCP
+//--------------------------------------------------------
+
+TcpReader *TcpReader::connect(const char *ip, int port, int codec, int policy, int stream,
+                              unsigned cameras)
+{
+    int sokt;
+    struct  sockaddr_in serverAddr;
+    socklen_t           addrLen = sizeof(struct sockaddr_in);
+
+    if ((sokt = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        std::cerr << "socket() failed" << std::endl;
+        return NULL;
+    }
+
+    serverAddr.sin_family = PF_INET;
+    serverAddr.sin_addr.s_addr = inet_addr(ip);
+    serverAddr.sin_port = htons(port);
+
+    if (::connect(sokt, (sockaddr*)&serverAddr, addrLen) < 0) {
+        std::cerr << "connect() failed!" << std::endl;
+        close(sokt);
+        return NULL;
+    }
+
+    //tell the server how we want our frames
+    Hello hello;
+    uint8_t helloBuf[kHelloSize];
+    hello.codec  = codec;
+    hello.policy = policy;
+    hello.stream = stream;
+    hello.cameras = cameras;
+    packHello(hello, helloBuf);
+    if (send(sokt, helloBuf, kHelloSize, 0) != (ssize_t)kHelloSize) {
+        std::cerr << "send(hello) failed!" << std::endl;
+        close(sokt);
+        return NULL;
+    }
+
+    return new TcpReader(sokt);
+}
+
+TcpReader::TcpReader(int sokt)
+    : sokt_(sokt),
+      cancelled_(false)
+{
+}
+
+TcpReader::~TcpReader()
+{
+    close(sokt_);
+}
+
+void TcpReader::cancel()
+{
+    //wakes up a recv() in progress, which then sees end of stream
+    __atomic_store_n(&cancelled_, true, __ATOMIC_RELAXED);
+    shutdown(sokt_, SHUT_RDWR);
+}
+
+//recv exactly len bytes, false on error or orderly shutdown
+bool TcpReader::recvAll(void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t bytes = recv(sokt_, p, len, MSG_WAITALL);
+        if (bytes <= 0) {
+            if (!__atomic_load_n(&cancelled_, __ATOMIC_RELAXED))
+                std::cerr << "recv failed, received bytes = " << bytes << std::endl;
+            return false;
+        }
+        p   += bytes;
+        len -= bytes;
+    }
+    return true;
+}
+
+bool TcpReader::next(FrameHeader &h, const uint8_t *&data)
+{
+    uint8_t hdrBuf[kFrameHeaderSize];
+
+    if (!recvAll(hdrBuf, kFrameHeaderSize))
+        return false;
+    if (!unpackFrameHeader(hdrBuf, h)) {
+        std::cerr << "bad frame header, stream out of sync" << std::endl;
+        return false;
+    }
+    //skip fields appended by a newer server
+    if (h.headerLen > kFrameHeaderSize) {
+        std::vector<uint8_t> extra(h.headerLen - kFrameHeaderSize);
+        if (!recvAll(&extra[0], extra.size()))
+            return false;
+    }
+
+    //from the wire too: a corrupt length must not become an allocation
+    if (h.payloadLen > kMaxPayloadLen) {
+        std::cerr << "frame payload of " << h.payloadLen << " bytes, stream out of sync" << std::endl;
+        return false;
+    }
+    payload_.resize(h.payloadLen);
+    if (h.payloadLen > 0 && !recvAll(&payload_[0], h.payloadLen))
+        return false;
+
+    data = payload_.empty() ? NULL : &payload_[0];
+    return true;
+}
+
+//--------------------------------------------------------
+//shared memory
+//--------------------------------------------------------
+
+ShmReader::ShmReader(const char *name)
+    : name_(name),
+      ring_(NULL),
+      lastSeq_(0),
+      cancelled_(false)
+{
+}
+
+ShmReader::~ShmReader()
+{
+    delete ring_;
+}
+
+bool ShmReader::next(FrameHeader &h, const uint8_t *&data)
+{
+    while (!__atomic_load_n(&cancelled_, __ATOMIC_RELAXED)) {
+        if (ring_ == NULL) {
+            //the server creates the segment once its first frame is captured
+            ring_ = ShmRing::open(name_);
+            if (ring_ == NULL) {
+                usleep(100000);
+                continue;
+            }
+            lastSeq_ = 0;
+        }
+
+        data = ring_->wait(lastSeq_, 1000, h);
+        if (data != NULL) {
+            lastSeq_ = h.seq;
+            return true;
+        }
+
+        //a second without frames: the server may have restarted with a new
+        //segment under the same name, remap it
+        delete ring_;
+        ring_ = NULL;
+    }
+    return false;
+}
+
+bool ShmReader::stillValid()
+{
+    return ring_ != NULL && ring_->stillValid();
+}
+
+//--------------------------------------------------------
+//UDP multicast
+//--------------------------------------------------------
+
+McastReader *McastReader::join(const char *group, int deadlineMs)
+{
+    struct sockaddr_in addr;
+    if (!parseGroup(group, addr)) {
+        std::cerr << "bad multicast group " << group << std::endl;
+        return NULL;
+    }
+    McastReceiver *rx = McastReceiver::create(addr, deadlineMs);
+    return rx == NULL ? NULL : new McastReader(rx);
+}
+
+McastReader::McastReader(McastReceiver *rx)
+    : rx_(rx)
+{
+}
+
+McastReader::~McastReader()
+{
+    std::cout << "multicast frames lost to missing fragments: " << rx_->incomplete() << std::endl;
+    delete rx_;
+}
+
+bool McastReader::next(FrameHeader &h, const uint8_t *&data)
+{
+    return rx_->next(h, data);
+}
+
+void McastReader::cancel()
+{
+    rx_->cancel();
+}
+
+//--------------------------------------------------------
+//recording
+//--------------------------------------------------------
+
+struct ByOffset {
+    const FrameLogReader *log;
+    bool operator()(size_t a, size_t b) const { return log->entry(a).offset < log->entry(b).offset; }
+};
+
+LogReader *LogReader::open(const char *path, unsigned cameras)
+{
+    FrameLogReader *log = FrameLogReader::open(path);
+    if (log == NULL)
+        return NULL;
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < log->count(); i++) {
+        if (log->entry(i).camera < kMaxCameras && (cameras & (1u << log->entry(i).camera)))
+            order.push_back(i);
+    }
+    if (order.empty()) {
+        std::cerr << path << " has no frames from the cameras asked for" << std::endl;
+        delete log;
+        return NULL;
+    }
+    ByOffset byOffset = { log };
+    std::sort(order.begin(), order.end(), byOffset);
+    return new LogReader(log, order);
+}
+
+LogReader::LogReader(FrameLogReader *log, const std::vector<size_t> &order)
+    : log_(log),
+      order_(order),
+      next_(0),
+      startNs_(0),
+      cancelled_(false)
+{
+}
+
+LogReader::~LogReader()
+{
+    delete log_;
+}
+
+bool LogReader::next(FrameHeader &h, const uint8_t *&data)
+{
+    while (next_ < order_.size() && !__atomic_load_n(&cancelled_, __ATOMIC_RELAXED)) {
+        const FrameLogEntry &e = log_->entry(order_[next_]);
+
+        //as far into the replay as the frame was into the recording, a
+        //nap at a time so cancel() gets through
+        uint64_t first = log_->entry(order_[0]).stampNs;
+        uint64_t now   = monotonicNs();
+        if (startNs_ == 0)
+            startNs_ = now;
+        uint64_t due = startNs_ + (e.stampNs > first ? e.stampNs - first : 0);
+        if (due > now) {
+            usleep((useconds_t)std::min((uint64_t)100000, (due - now) / 1000));
+            continue;
+        }
+
+        if (!log_->frame(order_[next_++], h, data)) {
+            std::cerr << "bad record for frame " << e.seq << " in the recording" << std::endl;
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,107 @@
+/**
+ * Where the client gets its frames from: a TCP connection to the server,
+ * a shared memory segment the server publishes to on the same host, the
+ * server's UDP multicast group, or a recording (frame_log.h).
+ */
+
+#ifndef STREAM_READER_H
+#define STREAM_READER_H
+
+#include "frame_protocol.h"
+#include <vector>
+#include <stddef.h>
+
+class ShmRing;
+class McastReceiver;
+class FrameLogReader;
+
+class StreamReader {
+public:
+    virtual ~StreamReader() {}
+
+    //next frame header and payload; data stays valid until the next call
+    //(but see stillValid()). false once the stream has ended
+    virtual bool next(FrameHeader &h, const uint8_t *&data) = 0;
+
+    //false if the payload returned by next() was overwritten under us,
+    //only possible for readers that hand out memory they don't own
+    virtual bool stillValid() { return true; }
+
+    //called from another thread: make a blocked next() return false soon
+    virtual void cancel() = 0;
+};
+
+class TcpReader : public StreamReader {
+public:
+    //connect and send the hello asking for one of the server's processing
+    //streams, 0 = the end of its chain, from the cameras whose bits are set;
+    //NULL on failure
+    static TcpReader *connect(const char *ip, int port, int codec, int policy, int stream = 0,
+                              unsigned cameras = 1);
+    ~TcpReader();
+
+    bool next(FrameHeader &h, const uint8_t *&data);
+    void cancel();
+
+private:
+    explicit TcpReader(int sokt);
+    bool recvAll(void *buf, size_t len);
+
+    int                  sokt_;
+    bool                 cancelled_;
+    std::vector<uint8_t> payload_;
+};
+
+class ShmReader : public StreamReader {
+public:
+    explicit ShmReader(const char *name);
+    ~ShmReader();
+
+    bool next(FrameHeader &h, const uint8_t *&data);
+    bool stillValid();
+    void cancel() { __atomic_store_n(&cancelled_, true, __ATOMIC_RELAXED); }
+
+private:
+    const char   *name_;
+    ShmRing      *ring_;
+    uint64_t      lastSeq_;
+    bool          cancelled_;
+};
+
+class McastReader : public StreamReader {
+public:
+    //join group ("239.255.0.1:5000"); NULL on failure. Frames still missing
+    //fragments deadlineMs after the first one arrived are dropped
+    static McastReader *join(const char *group, int deadlineMs);
+    ~McastReader();
+
+    bool next(FrameHeader &h, const uint8_t *&data);
+    void cancel();
+
+private:
+    explicit McastReader(McastReceiver *rx);
+
+    McastReceiver *rx_;
+};
+
+class LogReader : public StreamReader {
+public:
+    //replay the frames of the cameras whose bits are set from a recording,
+    //in the order and at the pace they were recorded; NULL on failure
+    static LogReader *open(const char *path, unsigned cameras);
+    ~LogReader();
+
+    bool next(FrameHeader &h, const uint8_t *&data);
+    void cancel() { __atomic_store_n(&cancelled_, true, __ATOMIC_RELAXED); }
+
+private:
+    LogReader(FrameLogReader *log, const std::vector<size_t> &order);
+
+    FrameLogReader     *log_;
+    std::vector<size_t> order_;     // index entries to play, by file offset
+    size_t              next_;
+    uint64_t            startNs_;   // monotonic time the first frame went out
+    bool                cancelled_;
+};
+
+#endif
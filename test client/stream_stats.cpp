@@ -0,0 +1,127 @@
+#include "stream_stats.h"
+#include <algorithm>
+#include <iomanip>
+#include <time.h>
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//nearest rank percentile of sorted samples, in ms
+static double percentileMs(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.999999);
+    rank = std::min(sorted.size(), std::max((size_t)1, rank));
+    return sorted[rank - 1] / 1000.0;
+}
+
+static void printLine(std::ostream &out, const char *label, uint64_t ns, uint64_t frames,
+                      uint64_t bytes, uint64_t dropped, std::vector<uint32_t> &latencyUs)
+{
+    double secs = ns / 1e9;
+    if (secs <= 0)
+        secs = 1e-9;
+    std::sort(latencyUs.begin(), latencyUs.end());
+
+    out << std::fixed << std::setprecision(1)
+        << label << " " << secs << " s"
+        << "  fps " << frames / secs
+        << "  MB/s " << std::setprecision(2) << bytes / secs / 1e6
+        << "  frames " << frames
+        << "  dropped " << dropped
+        << "  latency ms p50 " << percentileMs(latencyUs, 50)
+        << " p95 " << percentileMs(latencyUs, 95)
+        << " p99 " << percentileMs(latencyUs, 99)
+        << " max " << (latencyUs.empty() ? 0 : latencyUs.back() / 1000.0)
+        << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+}
+
+StreamStats::StreamStats()
+    : startNs_(monotonicNs()),
+      intervalNs_(startNs_),
+      frames_(0), bytes_(0), dropped_(0),
+      totalFrames_(0), totalBytes_(0), totalDropped_(0)
+{
+    pthread_mutex_init(&lock_, NULL);
+}
+
+StreamStats::~StreamStats()
+{
+    pthread_mutex_destroy(&lock_);
+}
+
+void StreamStats::frame(const FrameHeader &h, uint64_t nowNs)
+{
+    //a sender clock ahead of ours shows up as zero, not as a huge number
+    uint64_t us = nowNs > h.stampNs ? (nowNs - h.stampNs) / 1000 : 0;
+    if (us > UINT32_MAX)
+        us = UINT32_MAX;
+
+    pthread_mutex_lock(&lock_);
+    frames_++;
+    bytes_ += h.headerLen + h.payloadLen;
+    latencyUs_.push_back((uint32_t)us);
+    pthread_mutex_unlock(&lock_);
+}
+
+void StreamStats::drop(uint64_t n)
+{
+    pthread_mutex_lock(&lock_);
+    dropped_ += n;
+    pthread_mutex_unlock(&lock_);
+}
+
+void StreamStats::report(std::ostream &out)
+{
+    std::vector<uint32_t> latencyUs;
+    uint64_t frames, bytes, dropped;
+    uint64_t now = monotonicNs();
+
+    //swap the interval out so the receiver isn't held up while we sort
+    pthread_mutex_lock(&lock_);
+    latencyUs.swap(latencyUs_);
+    latencyUs_.reserve(latencyUs.size());
+    frames  = frames_;
+    bytes   = bytes_;
+    dropped = dropped_;
+    frames_ = bytes_ = dropped_ = 0;
+    uint64_t elapsed = now - intervalNs_;
+    intervalNs_ = now;
+    pthread_mutex_unlock(&lock_);
+
+    totalFrames_  += frames;
+    totalBytes_   += bytes;
+    totalDropped_ += dropped;
+    totalLatencyUs_.insert(totalLatencyUs_.end(), latencyUs.begin(), latencyUs.end());
+
+    printLine(out, "interval", elapsed, frames, bytes, dropped, latencyUs);
+}
+
+void StreamStats::summary(std::ostream &out)
+{
+    std::vector<uint32_t> latencyUs;
+    uint64_t frames, bytes, dropped;
+
+    //fold in whatever arrived since the last report
+    pthread_mutex_lock(&lock_);
+    totalFrames_  += frames_;
+    totalBytes_   += bytes_;
+    totalDropped_ += dropped_;
+    totalLatencyUs_.insert(totalLatencyUs_.end(), latencyUs_.begin(), latencyUs_.end());
+    frames_ = bytes_ = dropped_ = 0;
+    latencyUs_.clear();
+    intervalNs_ = monotonicNs();
+    frames  = totalFrames_;
+    bytes   = totalBytes_;
+    dropped = totalDropped_;
+    latencyUs = totalLatencyUs_;
+    pthread_mutex_unlock(&lock_);
+
+    printLine(out, "total", monotonicNs() - startNs_, frames, bytes, dropped, latencyUs);
+}
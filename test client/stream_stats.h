@@ -0,0 +1,49 @@
+/**
+ * Throughput and latency figures for a received stream, for load testing
+ * the server without a display.
+ *
+ * The receive thread calls frame() and drop(); another thread calls
+ * report() every so often, which prints what happened since the previous
+ * report, and summary() once at the end. Latency is end to end: the
+ * server's capture stamp to the frame being decoded here, so both hosts'
+ * clocks must agree (same host, or NTP/PTP synchronised).
+ */
+
+#ifndef STREAM_STATS_H
+#define STREAM_STATS_H
+
+#include "frame_protocol.h"
+#include <ostream>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+class StreamStats {
+public:
+    StreamStats();
+    ~StreamStats();
+
+    //a frame arrived and decoded at nowNs (frameClockNs())
+    void frame(const FrameHeader &h, uint64_t nowNs);
+    //n frames never made it: sequence gaps, torn or undecodable frames
+    void drop(uint64_t n);
+
+    //one line for the interval since the last report, then start a new one
+    void report(std::ostream &out);
+    //totals since construction
+    void summary(std::ostream &out);
+
+private:
+    StreamStats(const StreamStats &);
+    StreamStats &operator=(const StreamStats &);
+
+    pthread_mutex_t       lock_;
+    uint64_t              startNs_;      // monotonic
+    uint64_t              intervalNs_;   // monotonic start of this interval
+    uint64_t              frames_, bytes_, dropped_;
+    uint64_t              totalFrames_, totalBytes_, totalDropped_;
+    std::vector<uint32_t> latencyUs_;      // this interval
+    std::vector<uint32_t> totalLatencyUs_;
+};
+
+#endif
@@ -0,0 +1,403 @@
+#include "frame_codec.h"
+#include <string.h>
+
+using namespace cv;
+
+static const char *kCodecNames[CODEC_COUNT] = { "raw", "jpeg", "png", "qoi", "delta" };
+
+int parseCodec(const char *name)
+{
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        if (strcmp(name, kCodecNames[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *codecName(int codec)
+{
+    return (codec >= 0 && codec < CODEC_COUNT) ? kCodecNames[codec] : "unknown";
+}
+
+//--------------------------------------------------------
+//QOI-style codec
+//--------------------------------------------------------
+//QOI (qoiformat.org) ops over pixels of cn bytes, cn is 1 or 3. Three byte
+//images get the full op set; everything else is coded as a stream of one
+//byte pixels, where DIFF carries a -32..31 delta and LUMA is unused.
+
+enum {
+    QOI_OP_INDEX = 0x00,    // 00iiiiii
+    QOI_OP_DIFF  = 0x40,    // 01xxxxxx
+    QOI_OP_LUMA  = 0x80,    // 10gggggg rrrrbbbb
+    QOI_OP_RUN   = 0xc0,    // 11rrrrrr, run 1..62
+    QOI_OP_LIT   = 0xfe,    // followed by cn bytes
+    QOI_MASK     = 0xc0
+};
+
+static inline int qoiHash(const uchar *px, int cn)
+{
+    return cn == 3 ? (px[0] * 3 + px[1] * 5 + px[2] * 7) & 63 : (px[0] * 7) & 63;
+}
+
+void qoiEncode(const uchar *src, size_t bytes, int cn, std::vector<uchar> &out)
+{
+    uchar  index[64][3];
+    uchar  prev[3] = { 0, 0, 0 };
+    size_t pixels  = bytes / cn;
+    int    run     = 0;
+
+    memset(index, 0, sizeof(index));
+    out.clear();
+    out.reserve(bytes / 2);
+
+    for (size_t i = 0; i < pixels; i++) {
+        const uchar *px = src + i * cn;
+
+        if (memcmp(px, prev, cn) == 0) {
+            if (++run == 62) {
+                out.push_back(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        int h = qoiHash(px, cn);
+        if (memcmp(index[h], px, cn) == 0) {
+            out.push_back(QOI_OP_INDEX | h);
+        } else {
+            memcpy(index[h], px, cn);
+
+            if (cn == 1) {
+                int d = (signed char)(px[0] - prev[0]);
+                if (d >= -32 && d <= 31) {
+                    out.push_back(QOI_OP_DIFF | (d + 32));
+                } else {
+                    out.push_back(QOI_OP_LIT);
+                    out.push_back(px[0]);
+                }
+            } else {
+                int dr = (signed char)(px[0] - prev[0]);
+                int dg = (signed char)(px[1] - prev[1]);
+                int db = (signed char)(px[2] - prev[2]);
+                int dr_dg = dr - dg;
+                int db_dg = db - dg;
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out.push_back(QOI_OP_LUMA | (dg + 32));
+                    out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+                } else {
+                    out.push_back(QOI_OP_LIT);
+                    out.insert(out.end(), px, px + 3);
+                }
+            }
+        }
+        memcpy(prev, px, cn);
+    }
+    if (run > 0)
+        out.push_back(QOI_OP_RUN | (run - 1));
+
+    //odd trailing bytes of a 3 byte stream go out verbatim
+    out.insert(out.end(), src + pixels * cn, src + bytes);
+}
+
+bool qoiDecode(const uchar *src, size_t len, int cn, uchar *dst, size_t bytes)
+{
+    uchar  index[64][3];
+    uchar  px[3]  = { 0, 0, 0 };
+    size_t pixels = bytes / cn;
+    size_t p      = 0;
+    size_t i      = 0;
+
+    memset(index, 0, sizeof(index));
+
+    while (i < pixels) {
+        if (p >= len)
+            return false;
+        uchar op = src[p++];
+
+        if (op == 0xff) {
+            return false;
+        } else if (op == QOI_OP_LIT) {
+            if (p + cn > len)
+                return false;
+            memcpy(px, src + p, cn);
+            p += cn;
+        } else if ((op & QOI_MASK) == QOI_OP_RUN) {
+            int run = (op & 0x3f) + 1;
+            if (i + run > pixels)
+                return false;
+            for (int r = 0; r < run; r++, i++)
+                memcpy(dst + i * cn, px, cn);
+            continue;
+        } else if ((op & QOI_MASK) == QOI_OP_INDEX) {
+            memcpy(px, index[op & 0x3f], cn);
+        } else if ((op & QOI_MASK) == QOI_OP_DIFF) {
+            if (cn == 1) {
+                px[0] += (op & 0x3f) - 32;
+            } else {
+                px[0] += ((op >> 4) & 3) - 2;
+                px[1] += ((op >> 2) & 3) - 2;
+                px[2] += (op & 3) - 2;
+            }
+        } else {
+            if (cn == 1 || p >= len)
+                return false;
+            int dg = (op & 0x3f) - 32;
+            uchar b = src[p++];
+            px[0] += dg + (b >> 4) - 8;
+            px[1] += dg;
+            px[2] += dg + (b & 15) - 8;
+        }
+
+        memcpy(index[qoiHash(px, cn)], px, cn);
+        memcpy(dst + i * cn, px, cn);
+        i++;
+    }
+
+    size_t tail = bytes - pixels * cn;
+    if (p + tail != len)
+        return false;
+    memcpy(dst + pixels * cn, src + p, tail);
+    return true;
+}
+
+//--------------------------------------------------------
+//XOR delta, zero-run coded
+//--------------------------------------------------------
+
+static inline void putVarint(std::vector<uchar> &out, size_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((uchar)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uchar)v);
+}
+
+static inline bool getVarint(const uchar *src, size_t len, size_t &p, size_t &v)
+{
+    v = 0;
+    for (int shift = 0; p < len && shift < 64; shift += 7) {
+        uchar b = src[p++];
+        v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+//a zero run shorter than this is cheaper to leave inside the literal run
+static const size_t kMinZeroRun = 4;
+
+void zeroRunXorEncode(const uchar *cur, const uchar *ref, size_t bytes, std::vector<uchar> &out)
+{
+    size_t i = 0;
+    while (i < bytes) {
+        //zero run: unchanged bytes, compared a word at a time where possible
+        size_t z = i;
+        if (ref != NULL) {
+            while (z + 8 <= bytes) {
+                uint64_t a, b;
+                memcpy(&a, cur + z, 8);
+                memcpy(&b, ref + z, 8);
+                if (a != b)
+                    break;
+                z += 8;
+            }
+            while (z < bytes && cur[z] == ref[z])
+                z++;
+        } else {
+            while (z < bytes && cur[z] == 0)
+                z++;
+        }
+
+        //literal run: stops at the next zero run worth coding
+        size_t l = z, same = 0;
+        while (l < bytes) {
+            bool zero = ref != NULL ? cur[l] == ref[l] : cur[l] == 0;
+            same = zero ? same + 1 : 0;
+            l++;
+            if (same == kMinZeroRun) {
+                l -= same;
+                break;
+            }
+        }
+
+        putVarint(out, z - i);
+        putVarint(out, l - z);
+        for (size_t k = z; k < l; k++)
+            out.push_back(ref != NULL ? cur[k] ^ ref[k] : cur[k]);
+        i = l;
+    }
+}
+
+bool zeroRunXorDecode(const uchar *src, size_t len, uchar *dst, size_t bytes)
+{
+    size_t p = 0, i = 0;
+    while (i < bytes) {
+        size_t z, l;
+        if (!getVarint(src, len, p, z) || !getVarint(src, len, p, l))
+            return false;
+        if (z > bytes - i || l > bytes - i - z || l > len - p)
+            return false;
+        i += z;
+        for (size_t k = 0; k < l; k++)
+            dst[i + k] ^= src[p + k];
+        i += l;
+        p += l;
+    }
+    return p == len;
+}
+
+//--------------------------------------------------------
+//FrameEncoder / FrameDecoder
+//--------------------------------------------------------
+
+static int byteChannels(const Mat &img)
+{
+    return img.elemSize() == 3 ? 3 : 1;
+}
+
+//what the JPEG and PNG writers take without converting it behind our back;
+//processing stages can produce anything, a feature list for one
+static bool imencodable(const Mat &img)
+{
+    return !img.empty() && img.depth() == CV_8U && (img.channels() == 1 || img.channels() == 3);
+}
+
+FrameEncoder::FrameEncoder(int codec, const CodecParams &params)
+    : codec_(codec),
+      params_(params),
+      refSeq_(0),
+      sinceKey_(-1)
+{
+}
+
+bool FrameEncoder::encode(const Mat &img, uint64_t seq, std::vector<uchar> &out)
+{
+    out.clear();
+    size_t bytes = img.total() * img.elemSize();
+
+    switch (codec_) {
+    case CODEC_RAW:
+        out.assign(img.data, img.data + bytes);
+        return true;
+
+    case CODEC_JPEG: {
+        if (!imencodable(img))
+            return false;
+        std::vector<int> p(2);
+        p[0] = CV_IMWRITE_JPEG_QUALITY;
+        p[1] = params_.jpegQuality;
+        return imencode(".jpg", img, out, p);
+    }
+
+    case CODEC_PNG: {
+        if (!imencodable(img))
+            return false;
+        std::vector<int> p(2);
+        p[0] = CV_IMWRITE_PNG_COMPRESSION;
+        p[1] = params_.pngLevel;
+        return imencode(".png", img, out, p);
+    }
+
+    case CODEC_QOI:
+        qoiEncode(img.data, bytes, byteChannels(img), out);
+        return true;
+
+    case CODEC_DELTA: {
+        //keyframe on schedule, on request, after a gap in what we encoded
+        //or when the image geometry changed under us
+        bool key = sinceKey_ < 0 || sinceKey_ + 1 >= params_.keyInterval
+                || seq != refSeq_ + 1
+                || ref_.size() != img.size() || ref_.type() != img.type();
+
+        out.resize(8);
+        putLE(&out[0], key ? 0 : refSeq_, 8);
+        zeroRunXorEncode(img.data, key ? NULL : ref_.data, bytes, out);
+
+        img.copyTo(ref_);
+        refSeq_   = seq;
+        sinceKey_ = key ? 0 : sinceKey_ + 1;
+        return true;
+    }
+    }
+    return false;
+}
+
+FrameDecoder::FrameDecoder()
+    : refSeq_(0)
+{
+}
+
+//bytes per pixel of a header's type, 0 if it is not a Mat type of at most
+//64 channels
+static size_t pixelBytes(int32_t type)
+{
+    static const size_t depthBytes[] = { 1, 1, 2, 2, 4, 4, 8 };
+    if (type < 0 || CV_MAT_DEPTH(type) > CV_64F || type >= 1 << 9)
+        return 0;
+    return depthBytes[CV_MAT_DEPTH(type)] * CV_MAT_CN(type);
+}
+
+bool FrameDecoder::decode(const FrameHeader &h, const uchar *data, size_t len, Mat &out)
+{
+    //the header came off the wire: it has to describe a frame of sensible
+    //size before one is allocated for it, and a raw payload has to hold it
+    size_t px = pixelBytes(h.type);
+    if (px == 0 || h.width == 0 || h.height == 0
+        || (uint64_t)h.width * h.height * px > kMaxPayloadLen)
+        return false;
+    if (h.codec == CODEC_RAW && ((uint64_t)h.stride < (uint64_t)h.width * px
+                                 || len < (uint64_t)h.stride * h.height))
+        return false;
+
+    out.create(h.height, h.width, h.type);
+    size_t bytes = out.total() * out.elemSize();
+
+    switch (h.codec) {
+    case CODEC_RAW:
+        for (uint32_t y = 0; y < h.height; y++)
+            memcpy(out.ptr(y), data + (size_t)y * h.stride, out.cols * out.elemSize());
+        return true;
+
+    case CODEC_JPEG:
+    case CODEC_PNG: {
+        Mat buf(1, (int)len, CV_8UC1, (void *)data);
+        Mat img = imdecode(buf, CV_LOAD_IMAGE_UNCHANGED);
+        if (img.empty() || img.size() != out.size() || img.type() != out.type())
+            return false;
+        img.copyTo(out);
+        return true;
+    }
+
+    case CODEC_QOI:
+        return qoiDecode(data, len, byteChannels(out), out.data, bytes);
+
+    case CODEC_DELTA: {
+        if (len < 8)
+            return false;
+        uint64_t ref = getLE(data, 8);
+        if (ref == 0) {
+            memset(out.data, 0, bytes);
+        } else {
+            if (ref != refSeq_ || ref_.size() != out.size() || ref_.type() != out.type())
+                return false;
+            ref_.copyTo(out);
+        }
+        if (!zeroRunXorDecode(data + 8, len - 8, out.data, bytes))
+            return false;
+        out.copyTo(ref_);
+        refSeq_ = h.seq;
+        return true;
+    }
+    }
+    return false;
+}
@@ -0,0 +1,73 @@
+/**
+ * Payload codecs for the frame stream, shared by server and client.
+ *
+ * The server runs one FrameEncoder per codec some client asked for, once per
+ * captured frame, and every client on that codec is sent the same bytes.
+ * Clients decode with a FrameDecoder, which keeps the reference frame that
+ * CODEC_DELTA payloads are relative to.
+ *
+ * CODEC_DELTA payloads start with the 8 byte little-endian seq of their
+ * reference frame, 0 for a keyframe (delta against an all-zero image). A
+ * client that missed the reference waits for the next keyframe.
+ */
+
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include "opencv2/opencv.hpp"
+#include "frame_protocol.h"
+#include <vector>
+
+struct CodecParams {
+    int jpegQuality;    // 0-100, imencode IMWRITE_JPEG_QUALITY
+    int pngLevel;       // 0-9, imencode IMWRITE_PNG_COMPRESSION
+    int keyInterval;    // CODEC_DELTA frames between keyframes
+
+    CodecParams() : jpegQuality(80), pngLevel(1), keyInterval(30) {}
+};
+
+//"raw", "jpeg", "png", "qoi", "delta"; -1 if unknown
+int         parseCodec(const char *name);
+const char *codecName(int codec);
+
+class FrameEncoder {
+public:
+    FrameEncoder(int codec, const CodecParams &params);
+
+    //encode img captured as frame seq; false if the codec can't take this
+    //image type (JPEG/PNG only do 8 bit 1 and 3 channel images)
+    bool encode(const cv::Mat &img, uint64_t seq, std::vector<uchar> &out);
+
+    //make the next CODEC_DELTA frame a keyframe
+    void requestKeyframe() { sinceKey_ = -1; }
+
+private:
+    int         codec_;
+    CodecParams params_;
+    cv::Mat     ref_;       // previous frame for CODEC_DELTA
+    uint64_t    refSeq_;
+    int         sinceKey_;
+};
+
+class FrameDecoder {
+public:
+    FrameDecoder();
+
+    //decode into out, sized from the header; false if the payload is corrupt
+    //or is a delta against a frame we don't have
+    bool decode(const FrameHeader &h, const uchar *data, size_t len, cv::Mat &out);
+
+private:
+    cv::Mat  ref_;
+    uint64_t refSeq_;
+};
+
+//the byte level codecs, exposed for benchmarking; img must be continuous
+void qoiEncode(const uchar *src, size_t bytes, int cn, std::vector<uchar> &out);
+bool qoiDecode(const uchar *src, size_t len, int cn, uchar *dst, size_t bytes);
+//XOR of cur against ref (NULL = zeros) as varint (zero run, literal run,
+//literal bytes) triples; decoding XORs the literals back into dst in place
+void zeroRunXorEncode(const uchar *cur, const uchar *ref, size_t bytes, std::vector<uchar> &out);
+bool zeroRunXorDecode(const uchar *src, size_t len, uchar *dst, size_t bytes);
+
+#endif
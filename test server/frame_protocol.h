@@ -0,0 +1,194 @@
+/**
+ * Wire format shared by the video server and its clients.
+ *
+ * Every frame on the stream is a fixed 48 byte header followed by
+ * payloadLen bytes of payload. All header fields are little-endian:
+ *
+ *   off size field
+ *     0    4 magic       'SLMF'
+ *     4    2 version     kFrameProtocolVersion
+ *     6    2 headerLen   size of this header, lets newer versions append fields
+ *     8    8 seq         capture sequence number, gaps mean dropped frames
+ *    16    8 stampNs     capture time, CLOCK_REALTIME nanoseconds
+ *    24    4 width
+ *    28    4 height
+ *    32    4 type        OpenCV type of the decoded image (CV_8UC1, ...)
+ *    36    4 stride      bytes per row of the decoded image
+ *    40    4 payloadLen  bytes following the header
+ *    44    1 codec       FrameCodec used for the payload
+ *    45    1 camera      which of the server's cameras this frame is from
+ *    46    2 pair        0 for a single image; for a stereo pair (left and right
+ *                        side by side, see frame_source.h) bit 15 set and bits
+ *                        0-14 the two capture times' skew in microseconds,
+ *                        saturating at 32767
+ *
+ * Right after connecting the client sends one hello, also little-endian:
+ *
+ *   off size field
+ *     0    4 magic       'SLMH'
+ *     4    2 version     kFrameProtocolVersion
+ *     6    2 helloLen    size of this hello, lets newer versions append fields
+ *     8    1 codec       FrameCodec the client wants its payloads in
+ *     9    1 policy      delivery policy, kPolicyServerDefault for the server's
+ *    10    1 stream      which of the server's processing streams, 0 = the
+ *                        end of its chain, 1.. its taps (see processing.h)
+ *    11    1 cameras     bit i asks for camera i, 0 for just camera 0
+ *
+ * The server sends nothing until the hello has arrived. A client asking for
+ * several cameras gets all their frames on the one connection, each with
+ * its camera in the header; seq counts per camera.
+ */
+
+#ifndef FRAME_PROTOCOL_H
+#define FRAME_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static const uint32_t kFrameMagic           = 0x464d4c53; // "SLMF" on the wire
+static const uint16_t kFrameProtocolVersion = 1;
+static const size_t   kFrameHeaderSize      = 48;
+static const uint32_t kHelloMagic           = 0x484d4c53; // "SLMH" on the wire
+static const size_t   kHelloSize            = 12;
+static const uint8_t  kPolicyServerDefault  = 0xff;
+//largest payload, and decoded frame, a reader accepts; a 4K frame of four
+//float channels is 133 MB
+static const uint32_t kMaxPayloadLen        = 256u << 20;
+
+enum FrameCodec {
+    CODEC_RAW   = 0,    // rows of stride bytes, height rows
+    CODEC_JPEG  = 1,    // imencode(".jpg"), lossy
+    CODEC_PNG   = 2,    // imencode(".png"), lossless
+    CODEC_QOI   = 3,    // QOI-style byte codec, lossless and fast
+    CODEC_DELTA = 4,    // XOR against a reference frame, zero-run coded
+    CODEC_COUNT
+};
+
+struct FrameHeader {
+    uint16_t version;
+    uint16_t headerLen;
+    uint64_t seq;
+    uint64_t stampNs;
+    uint32_t width;
+    uint32_t height;
+    int32_t  type;
+    uint32_t stride;
+    uint32_t payloadLen;
+    uint8_t  codec;
+    uint8_t  camera;
+    uint16_t pair;      // see stereoPair()
+};
+
+struct Hello {
+    uint16_t version;
+    uint16_t helloLen;
+    uint8_t  codec;
+    uint8_t  policy;
+    uint8_t  stream;
+    uint8_t  cameras;
+};
+
+//cameras one server can serve, one hello bit each
+static const int kMaxCameras = 8;
+
+//nanoseconds on the clock used for stampNs; hosts must be time-synced
+//(NTP/PTP) for cross-machine latency figures to mean anything
+inline uint64_t frameClockNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//FrameHeader::pair of a stereo pair captured skewNs apart
+inline uint16_t stereoPair(uint64_t skewNs)
+{
+    uint64_t us = skewNs / 1000;
+    return (uint16_t)(0x8000 | (us < 0x7fff ? us : 0x7fff));
+}
+
+inline bool     isStereoPair(uint16_t pair) { return (pair & 0x8000) != 0; }
+inline unsigned pairSkewUs(uint16_t pair)   { return pair & 0x7fff; }
+
+inline void putLE(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+inline uint64_t getLE(const uint8_t *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+inline void packFrameHeader(const FrameHeader &h, uint8_t *out)
+{
+    memset(out, 0, kFrameHeaderSize);
+    putLE(out +  0, kFrameMagic, 4);
+    putLE(out +  4, kFrameProtocolVersion, 2);
+    putLE(out +  6, kFrameHeaderSize, 2);
+    putLE(out +  8, h.seq, 8);
+    putLE(out + 16, h.stampNs, 8);
+    putLE(out + 24, h.width, 4);
+    putLE(out + 28, h.height, 4);
+    putLE(out + 32, (uint32_t)h.type, 4);
+    putLE(out + 36, h.stride, 4);
+    putLE(out + 40, h.payloadLen, 4);
+    out[44] = h.codec;
+    out[45] = h.camera;
+    putLE(out + 46, h.pair, 2);
+}
+
+//false if the bytes are not a frame header this build understands
+inline bool unpackFrameHeader(const uint8_t *in, FrameHeader &h)
+{
+    if (getLE(in, 4) != kFrameMagic)
+        return false;
+    h.version    = (uint16_t)getLE(in + 4, 2);
+    h.headerLen  = (uint16_t)getLE(in + 6, 2);
+    h.seq        = getLE(in + 8, 8);
+    h.stampNs    = getLE(in + 16, 8);
+    h.width      = (uint32_t)getLE(in + 24, 4);
+    h.height     = (uint32_t)getLE(in + 28, 4);
+    h.type       = (int32_t)getLE(in + 32, 4);
+    h.stride     = (uint32_t)getLE(in + 36, 4);
+    h.payloadLen = (uint32_t)getLE(in + 40, 4);
+    h.codec      = in[44];
+    h.camera     = in[45];
+    h.pair       = (uint16_t)getLE(in + 46, 2);
+    return h.version == kFrameProtocolVersion && h.headerLen >= kFrameHeaderSize;
+}
+
+inline void packHello(const Hello &h, uint8_t *out)
+{
+    memset(out, 0, kHelloSize);
+    putLE(out + 0, kHelloMagic, 4);
+    putLE(out + 4, kFrameProtocolVersion, 2);
+    putLE(out + 6, kHelloSize, 2);
+    out[8] = h.codec;
+    out[9] = h.policy;
+    out[10] = h.stream;
+    out[11] = h.cameras;
+}
+
+//in holds kHelloSize bytes, anything past that up to helloLen is for newer
+//versions; false if not a hello we understand
+inline bool unpackHello(const uint8_t *in, Hello &h)
+{
+    if (getLE(in, 4) != kHelloMagic)
+        return false;
+    h.version  = (uint16_t)getLE(in + 4, 2);
+    h.helloLen = (uint16_t)getLE(in + 6, 2);
+    h.codec    = in[8];
+    h.policy   = in[9];
+    h.stream   = in[10];
+    h.cameras  = in[11] != 0 ? in[11] : 1;
+    return h.version == kFrameProtocolVersion && h.helloLen >= kHelloSize
+        && h.codec < CODEC_COUNT;
+}
+
+#endif
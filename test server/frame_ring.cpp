@@ -0,0 +1,261 @@
+#include "frame_ring.h"
+#include <unistd.h>
+#include <algorithm>
+#include <stdint.h>
+
+static FrameSlot *newSlot()
+{
+    FrameSlot *s = new FrameSlot;
+    s->seq     = 0;
+    s->stampNs = 0;
+    s->pair    = 0;
+    s->refs    = 0;
+    return s;
+}
+
+FrameRing::FrameRing(int slots)
+    : spare_(slots < 2 ? 2 : slots),
+      pinned_(0),
+      latest_(NULL),
+      seq_(0),
+      closed_(false),
+      nextGate_(0)
+{
+    for (int i = 0; i < spare_; i++)
+        slots_.push_back(newSlot());
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        codecUsers_[i] = 0;
+        keyRequest_[i] = false;
+    }
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&published_, NULL);
+    pthread_cond_init(&released_, NULL);
+}
+
+FrameRing::~FrameRing()
+{
+    pthread_cond_destroy(&released_);
+    pthread_cond_destroy(&published_);
+    pthread_mutex_destroy(&lock_);
+    for (size_t i = 0; i < slots_.size(); i++)
+        delete slots_[i];
+}
+
+FrameSlot *FrameRing::beginWrite()
+{
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        //frames newer than the slowest gate are still owed to a gated reader
+        uint64_t limit = UINT64_MAX;
+        for (std::map<int, uint64_t>::iterator it = gates_.begin(); it != gates_.end(); ++it)
+            limit = std::min(limit, it->second);
+
+        //overwrite the oldest frame nobody holds or is owed
+        FrameSlot *best = NULL;
+        for (size_t i = 0; i < slots_.size(); i++) {
+            FrameSlot *s = slots_[i];
+            if (s == latest_ || s->refs != 0 || s->seq > limit)
+                continue;
+            if (best == NULL || s->seq < best->seq)
+                best = s;
+        }
+        if (best != NULL) {
+            //seq 0 hides the slot from readers until commit()
+            best->seq = 0;
+            pthread_mutex_unlock(&lock_);
+            return best;
+        }
+        if (closed_) {
+            pthread_mutex_unlock(&lock_);
+            return NULL;
+        }
+        //every slot is pinned by a reader, wait for one to let go
+        pthread_cond_wait(&released_, &lock_);
+    }
+}
+
+void FrameRing::commit(FrameSlot *slot)
+{
+    pthread_mutex_lock(&lock_);
+    slot->seq = ++seq_;
+    latest_ = slot;
+    pthread_cond_broadcast(&published_);
+
+    //eventfd counters just accumulate, a full counter still reads as ready
+    uint64_t one = 1;
+    for (size_t i = 0; i < notify_.size(); i++) {
+        if (write(notify_[i], &one, sizeof(one)) < 0) {
+            //EAGAIN means the reader has a wakeup pending already
+        }
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+FrameSlot *FrameRing::acquire(uint64_t lastSeq)
+{
+    pthread_mutex_lock(&lock_);
+    while (!closed_ && (latest_ == NULL || latest_->seq <= lastSeq))
+        pthread_cond_wait(&published_, &lock_);
+
+    FrameSlot *slot = NULL;
+    if (!closed_) {
+        slot = latest_;
+        slot->refs++;
+    }
+    pthread_mutex_unlock(&lock_);
+    return slot;
+}
+
+FrameSlot *FrameRing::tryAcquire(uint64_t lastSeq)
+{
+    FrameSlot *slot = NULL;
+    pthread_mutex_lock(&lock_);
+    if (!closed_ && latest_ != NULL && latest_->seq > lastSeq) {
+        slot = latest_;
+        slot->refs++;
+    }
+    pthread_mutex_unlock(&lock_);
+    return slot;
+}
+
+FrameSlot *FrameRing::tryAcquireNext(uint64_t lastSeq)
+{
+    FrameSlot *slot = NULL;
+    pthread_mutex_lock(&lock_);
+    if (!closed_) {
+        for (size_t i = 0; i < slots_.size(); i++) {
+            if (slots_[i]->seq > lastSeq && (slot == NULL || slots_[i]->seq < slot->seq))
+                slot = slots_[i];
+        }
+        if (slot != NULL)
+            slot->refs++;
+    }
+    pthread_mutex_unlock(&lock_);
+    return slot;
+}
+
+int FrameRing::addGate()
+{
+    pthread_mutex_lock(&lock_);
+    int gate = nextGate_++;
+    //owed everything from the next frame on
+    gates_[gate] = seq_;
+    pthread_mutex_unlock(&lock_);
+    return gate;
+}
+
+void FrameRing::moveGate(int gate, uint64_t seq)
+{
+    pthread_mutex_lock(&lock_);
+    gates_[gate] = seq;
+    pthread_cond_signal(&released_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::removeGate(int gate)
+{
+    pthread_mutex_lock(&lock_);
+    gates_.erase(gate);
+    pthread_cond_signal(&released_);
+    pthread_mutex_unlock(&lock_);
+}
+
+uint64_t FrameRing::nextSeq()
+{
+    pthread_mutex_lock(&lock_);
+    uint64_t seq = seq_ + 1;
+    pthread_mutex_unlock(&lock_);
+    return seq;
+}
+
+void FrameRing::addCodecUser(int codec)
+{
+    pthread_mutex_lock(&lock_);
+    codecUsers_[codec]++;
+    keyRequest_[codec] = true;
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::removeCodecUser(int codec)
+{
+    pthread_mutex_lock(&lock_);
+    codecUsers_[codec]--;
+    pthread_mutex_unlock(&lock_);
+}
+
+unsigned FrameRing::codecsInUse()
+{
+    unsigned mask = 0;
+    pthread_mutex_lock(&lock_);
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        if (codecUsers_[i] > 0)
+            mask |= 1u << i;
+    }
+    pthread_mutex_unlock(&lock_);
+    return mask;
+}
+
+bool FrameRing::takeKeyframeRequest(int codec)
+{
+    pthread_mutex_lock(&lock_);
+    bool req = keyRequest_[codec];
+    keyRequest_[codec] = false;
+    pthread_mutex_unlock(&lock_);
+    return req;
+}
+
+void FrameRing::addReader(int pins)
+{
+    pthread_mutex_lock(&lock_);
+    pinned_ += pins;
+    while ((int)slots_.size() < pinned_ + spare_)
+        slots_.push_back(newSlot());
+    //a writer waiting for a slot can have one of the new ones
+    pthread_cond_signal(&released_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::removeReader(int pins)
+{
+    pthread_mutex_lock(&lock_);
+    pinned_ -= pins;
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::requestKeyframe(int codec)
+{
+    pthread_mutex_lock(&lock_);
+    keyRequest_[codec] = true;
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::addNotifyFd(int fd)
+{
+    pthread_mutex_lock(&lock_);
+    notify_.push_back(fd);
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::removeNotifyFd(int fd)
+{
+    pthread_mutex_lock(&lock_);
+    notify_.erase(std::remove(notify_.begin(), notify_.end(), fd), notify_.end());
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::release(FrameSlot *slot)
+{
+    pthread_mutex_lock(&lock_);
+    if (--slot->refs == 0)
+        pthread_cond_signal(&released_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void FrameRing::close()
+{
+    pthread_mutex_lock(&lock_);
+    closed_ = true;
+    pthread_cond_broadcast(&published_);
+    pthread_cond_broadcast(&released_);
+    pthread_mutex_unlock(&lock_);
+}
@@ -0,0 +1,107 @@
+/**
+ * Broadcast ring of reference-counted frame slots.
+ *
+ * One capture thread writes each processed frame into the ring exactly once;
+ * any number of sender threads read the newest frame from it. A slot is only
+ * reused by the writer when no reader holds a reference to it.
+ *
+ * Readers that must not lose frames register a gate: the writer then never
+ * overwrites a frame newer than the gate, and stalls instead once the ring
+ * is full of frames the slowest gated reader has not pulled yet.
+ *
+ * Readers that hold frames for a while say how many with addReader(), and
+ * the ring grows to keep that many slots spare beyond what all of them
+ * can pin, so slow readers can't take every slot and stall the writer for
+ * everyone. Slots are never freed before the ring is, it stays the size of
+ * the most readers it ever had.
+ */
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include "opencv2/opencv.hpp"
+#include "frame_protocol.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include <map>
+
+struct FrameSlot {
+    cv::Mat  frame;     // processed frame, buffer reused across writes
+    uint64_t seq;       // 1-based frame counter, 0 = never written
+    uint64_t stampNs;   // capture time, see frameClockNs()
+    uint16_t pair;      // stereo pair and its skew, see stereoPair()
+    int      refs;      // readers currently holding this slot
+    //frame encoded once per codec in demand, empty if nobody asked for it
+    //or the codec can't take this frame; CODEC_RAW uses frame directly
+    std::vector<uchar> encoded[CODEC_COUNT];
+};
+
+class FrameRing {
+public:
+    explicit FrameRing(int slots = 8);
+    ~FrameRing();
+
+    //writer side: grab a free slot, fill slot->frame, then publish it
+    FrameSlot *beginWrite();
+    void       commit(FrameSlot *slot);
+
+    //reader side: block until a frame newer than lastSeq exists and hold it
+    //returns NULL once the ring is closed
+    FrameSlot *acquire(uint64_t lastSeq);
+    void       release(FrameSlot *slot);
+
+    //non-blocking acquire for event loops, NULL if nothing newer than lastSeq
+    FrameSlot *tryAcquire(uint64_t lastSeq);
+    //same, but the oldest frame after lastSeq rather than the newest
+    FrameSlot *tryAcquireNext(uint64_t lastSeq);
+
+    //gated readers, see above; moveGate() marks frames up to seq as consumed
+    int  addGate();
+    void moveGate(int gate, uint64_t seq);
+    void removeGate(int gate);
+
+    //a reader that may hold up to pins slots at once, and its leaving
+    void addReader(int pins);
+    void removeReader(int pins);
+
+    //eventfd written on every commit(), lets an epoll loop wait for frames
+    void addNotifyFd(int fd);
+    void removeNotifyFd(int fd);
+
+    //seq the next commit() will assign; only meaningful to the single writer
+    uint64_t nextSeq();
+
+    //which codecs the writer must fill in FrameSlot::encoded; a new user of
+    //a codec also raises a keyframe request the writer takes once
+    void     addCodecUser(int codec);
+    void     removeCodecUser(int codec);
+    unsigned codecsInUse();
+    bool     takeKeyframeRequest(int codec);
+    //a reader lost a frame a codec's next ones depend on
+    void     requestKeyframe(int codec);
+
+    //wake every waiter and make acquire() return NULL
+    void close();
+
+private:
+    FrameRing(const FrameRing &);
+    FrameRing &operator=(const FrameRing &);
+
+    std::vector<FrameSlot *> slots_;  // each allocated alone, so growing keeps pointers
+    int             spare_;     // slots beyond what readers can pin
+    int             pinned_;    // sum of addReader() pins
+    FrameSlot      *latest_;    // newest published slot, NULL if none
+    uint64_t        seq_;
+    bool            closed_;
+    std::vector<int> notify_;
+    std::map<int, uint64_t> gates_;
+    int             codecUsers_[CODEC_COUNT];
+    bool            keyRequest_[CODEC_COUNT];
+    int             nextGate_;
+    pthread_mutex_t lock_;
+    pthread_cond_t  published_; // signalled on commit()
+    pthread_cond_t  released_;  // signalled when a slot's refs drop to 0
+};
+
+#endif
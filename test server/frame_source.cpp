@@ -0,0 +1,405 @@
+#include "frame_source.h"
+#include "frame_protocol.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+using namespace cv;
+
+//retrying a device that delivered nothing: first after kMinBackoffUs, then
+//twice as long each time up to kMaxBackoffUs
+static const unsigned kMinBackoffUs = 1000;
+static const unsigned kMaxBackoffUs = 100000;
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool isImageFile(const std::string &name)
+{
+    static const char *exts[] = { ".jpg", ".jpeg", ".png", ".bmp", ".pgm", ".ppm", ".tif", ".tiff" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (strcasecmp(name.c_str() + dot, exts[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+FrameSource *FrameSource::open(const std::string &spec)
+{
+    size_t colon = spec.find(':');
+    std::string kind = colon == std::string::npos ? "" : spec.substr(0, colon);
+    std::string arg  = colon == std::string::npos ? spec : spec.substr(colon + 1);
+
+    if (kind.empty() || kind == "cam") {
+        char *end;
+        long dev = strtol(arg.c_str(), &end, 10);
+        if (arg.empty() || *end != '\0') {
+            std::cerr << "bad source " << spec << std::endl;
+            return NULL;
+        }
+        DeviceSource *s = new DeviceSource((int)dev);
+        if (!s->isOpened()) {
+            std::cerr << "Can't open capture device " << dev << std::endl;
+            delete s;
+            return NULL;
+        }
+        return s;
+    }
+
+    if (kind == "stereo") {
+        int left, right;
+        char tail;
+        if (sscanf(arg.c_str(), "%d,%d%c", &left, &right, &tail) != 2 || left == right) {
+            std::cerr << "bad stereo source " << spec << ", want stereo:L,R" << std::endl;
+            return NULL;
+        }
+        StereoSource *s = new StereoSource(left, right);
+        if (!s->isOpened()) {
+            std::cerr << "Can't open capture devices " << left << " and " << right << std::endl;
+            delete s;
+            return NULL;
+        }
+        return s;
+    }
+
+    if (kind == "file") {
+        FileSource *s = new FileSource(arg);
+        if (!s->isOpened()) {
+            std::cerr << "Can't open video file " << arg << std::endl;
+            delete s;
+            return NULL;
+        }
+        return s;
+    }
+
+    if (kind == "dir") {
+        ImageDirSource *s = new ImageDirSource(arg);
+        if (!s->isOpened()) {
+            std::cerr << "No images in " << arg << std::endl;
+            delete s;
+            return NULL;
+        }
+        return s;
+    }
+
+    if (kind == "synth") {
+        int w = 640, h = 480;
+        double fps = 30;
+        if (sscanf(arg.c_str(), "%dx%d@%lf", &w, &h, &fps) < 2 || w <= 0 || h <= 0 || fps <= 0) {
+            std::cerr << "bad synthetic source " << spec << ", want synth:WxH[@fps]" << std::endl;
+            return NULL;
+        }
+        return new SyntheticSource(w, h, fps);
+    }
+
+    std::cerr << "unknown source kind " << kind << std::endl;
+    return NULL;
+}
+
+FrameSource::FrameSource()
+    : loop_(false),
+      stallNs_(5000000000ull),
+      stampNs_(0),
+      pair_(0),
+      pacing_(PACE_NATIVE),
+      fps_(0),
+      startNs_(0),
+      count_(0)
+{
+}
+
+void FrameSource::setPacing(Pacing pacing, double fps)
+{
+    pacing_  = pacing;
+    fps_     = fps;
+    startNs_ = 0;
+}
+
+bool FrameSource::waitForDevice(uint64_t sinceNs, unsigned &backoffUs)
+{
+    if (stallNs_ != 0 && monotonicNs() - sinceNs >= stallNs_) {
+        std::cerr << describe() << ": no frame for " << (monotonicNs() - sinceNs) / 1000000
+                  << " ms, giving up" << std::endl;
+        return false;
+    }
+    usleep(backoffUs);
+    backoffUs = std::min(2 * backoffUs, kMaxBackoffUs);
+    return true;
+}
+
+bool FrameSource::read(Mat &img)
+{
+    double fps = pacing_ == PACE_FIXED ? fps_ : pacing_ == PACE_NATIVE ? nativeFps() : 0;
+
+    //sleep until this frame is due; deadlines are counted from the first
+    //frame so that the rate doesn't drift with per-frame jitter
+    if (fps > 0) {
+        uint64_t now = monotonicNs();
+        if (startNs_ == 0) {
+            startNs_ = now;
+            count_   = 0;
+        }
+        uint64_t due = startNs_ + (uint64_t)(count_ * 1e9 / fps);
+        if (due > now) {
+            uint64_t wait = due - now;
+            struct timespec ts;
+            ts.tv_sec  = wait / 1000000000ull;
+            ts.tv_nsec = wait % 1000000000ull;
+            nanosleep(&ts, NULL);
+        } else if (now - due > 1000000000ull) {
+            //more than a second behind, e.g. the consumer stalled; start
+            //over instead of bursting to catch up
+            startNs_ = now;
+            count_   = 0;
+        }
+        count_++;
+    }
+
+    stampNs_ = 0;
+    pair_    = 0;
+    if (!grab(img) && !(loop_ && rewind() && grab(img)))
+        return false;
+    if (stampNs_ == 0)
+        stampNs_ = frameClockNs();
+    return true;
+}
+
+//--------------------------------------------------------
+//live device
+//--------------------------------------------------------
+
+DeviceSource::DeviceSource(int dev)
+    : dev_(dev),
+      cap_(dev)
+{
+}
+
+std::string DeviceSource::describe() const
+{
+    std::ostringstream s;
+    s << "device " << dev_ << " (" << cap_.get(CV_CAP_PROP_FPS) << " fps)";
+    return s.str();
+}
+
+bool DeviceSource::grab(Mat &img)
+{
+    //a camera may hand out empty frames while settling, or for a while
+    //after a hiccup on its bus
+    uint64_t since = monotonicNs();
+    unsigned backoff = kMinBackoffUs;
+    for (;;) {
+        cap_ >> img;
+        if (!img.empty())
+            return true;
+        if (!waitForDevice(since, backoff))
+            return false;
+    }
+}
+
+//--------------------------------------------------------
+//stereo pair of devices
+//--------------------------------------------------------
+
+StereoSource::StereoSource(int left, int right)
+    : leftDev_(left),
+      rightDev_(right),
+      left_(left),
+      right_(right)
+{
+}
+
+std::string StereoSource::describe() const
+{
+    std::ostringstream s;
+    s << "stereo devices " << leftDev_ << "," << rightDev_ << " ("
+      << left_.get(CV_CAP_PROP_FPS) << " fps)";
+    return s.str();
+}
+
+//when the frame cap_ just grabbed was captured, CLOCK_MONOTONIC; V4L2
+//reports the buffer's driver timestamp as POS_MSEC, other backends report
+//nothing or a stream position, which is told apart by not being recent
+static uint64_t grabbedNs(const VideoCapture &cap, uint64_t grabReturned)
+{
+    double ms = cap.get(CV_CAP_PROP_POS_MSEC);
+    uint64_t ns = ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+    if (ns == 0 || ns > grabReturned || grabReturned - ns > 1000000000ull)
+        return grabReturned;
+    return ns;
+}
+
+bool StereoSource::grab(Mat &img)
+{
+    uint64_t since = monotonicNs();
+    unsigned backoff = kMinBackoffUs;
+    for (;;) {
+        //grab() only takes the next buffer from each device, back to back;
+        //decoding them can wait
+        bool ok = left_.grab();
+        uint64_t l = grabbedNs(left_, monotonicNs());
+        ok = right_.grab() && ok;
+        uint64_t r = grabbedNs(right_, monotonicNs());
+
+        if (ok && left_.retrieve(leftImg_) && right_.retrieve(rightImg_)
+            && !leftImg_.empty() && !rightImg_.empty()) {
+            if (leftImg_.rows != rightImg_.rows || leftImg_.type() != rightImg_.type()) {
+                std::cerr << "stereo devices " << leftDev_ << "," << rightDev_
+                          << " deliver different frame formats" << std::endl;
+                return false;
+            }
+            hconcat(leftImg_, rightImg_, img);
+
+            //a monotonic capture time is as old on the realtime clock
+            stampNs_ = frameClockNs() - (monotonicNs() - l);
+            pair_    = stereoPair(l > r ? l - r : r - l);
+            return true;
+        }
+        //one side still settling, like a single device
+        if (!waitForDevice(since, backoff))
+            return false;
+    }
+}
+
+//--------------------------------------------------------
+//video file
+//--------------------------------------------------------
+
+FileSource::FileSource(const std::string &path)
+    : path_(path),
+      cap_(path)
+{
+}
+
+double FileSource::nativeFps() const
+{
+    double fps = cap_.get(CV_CAP_PROP_FPS);
+    return fps > 0 ? fps : 30;
+}
+
+std::string FileSource::describe() const
+{
+    std::ostringstream s;
+    s << "file " << path_ << " (" << nativeFps() << " fps)";
+    return s.str();
+}
+
+bool FileSource::grab(Mat &img)
+{
+    cap_ >> img;
+    return !img.empty();
+}
+
+bool FileSource::rewind()
+{
+    cap_.release();
+    return cap_.open(path_);
+}
+
+//--------------------------------------------------------
+//image directory
+//--------------------------------------------------------
+
+ImageDirSource::ImageDirSource(const std::string &path)
+    : path_(path),
+      next_(0)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+        return;
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (isImageFile(path))
+            files_.push_back(path);
+        return;
+    }
+
+    DIR *d = opendir(path.c_str());
+    if (d == NULL)
+        return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (isImageFile(e->d_name))
+            files_.push_back(path + "/" + e->d_name);
+    }
+    closedir(d);
+    std::sort(files_.begin(), files_.end());
+}
+
+std::string ImageDirSource::describe() const
+{
+    std::ostringstream s;
+    s << "images " << path_ << " (" << files_.size() << " files)";
+    return s.str();
+}
+
+bool ImageDirSource::grab(Mat &img)
+{
+    while (next_ < files_.size()) {
+        img = imread(files_[next_++], CV_LOAD_IMAGE_COLOR);
+        if (!img.empty())
+            return true;
+        std::cerr << "can't read " << files_[next_ - 1] << std::endl;
+    }
+    return false;
+}
+
+//--------------------------------------------------------
+//synthetic
+//--------------------------------------------------------
+
+SyntheticSource::SyntheticSource(int width, int height, double fps)
+    : width_(width),
+      height_(height),
+      fps_(fps),
+      frame_(0)
+{
+}
+
+std::string SyntheticSource::describe() const
+{
+    std::ostringstream s;
+    s << "synthetic " << width_ << "x" << height_ << " (" << fps_ << " fps)";
+    return s.str();
+}
+
+bool SyntheticSource::grab(Mat &img)
+{
+    //diagonal colour ramps scrolling at different speeds per channel, plus
+    //a bright square bouncing across: every frame differs, textures and
+    //edges are there for feature detectors, and frame n is always the same
+    img.create(height_, width_, CV_8UC3);
+    int t = (int)frame_;
+    //at least 8 pixels, unless the frame itself is smaller
+    int side = std::min(std::max(8, std::min(width_, height_) / 8), std::min(width_, height_));
+    int span = std::max(1, width_ - side);
+    int bx = span - abs((t * 4) % (2 * span) - span);
+    int by = (height_ - side) / 2;
+
+    for (int y = 0; y < height_; y++) {
+        uchar *p = img.ptr<uchar>(y);
+        for (int x = 0; x < width_; x++) {
+            p[3 * x + 0] = (uchar)(x + y + t);
+            p[3 * x + 1] = (uchar)(x - y + 2 * t);
+            p[3 * x + 2] = (uchar)((x >> 2) ^ (y >> 2));
+        }
+        if (y >= by && y < by + side)
+            memset(p + 3 * bx, 255, 3 * side);
+    }
+    frame_++;
+    return true;
+}
@@ -0,0 +1,171 @@
+/**
+ * Where the capture thread gets its frames from.
+ *
+ * A source is named by a spec string:
+ *
+ *   0, 1, ...            live capture device (cam:N works too)
+ *   file:clip.avi        video file through VideoCapture
+ *   dir:frames/          every image in a directory, in name order; a single
+ *                        image (dir:fruits.jpg) is a one-frame sequence
+ *   synth:640x480@30     procedural BGR test pattern, deterministic per frame
+ *   stereo:0,1           two capture devices as one stereo camera, left
+ *                        first; each frame is the pair side by side
+ *
+ * and paced in one of three ways: PACE_NATIVE delivers at the source's own
+ * rate (the device clock, the file's fps, the synthetic fps, 30 for image
+ * directories), PACE_FAST as fast as frames can be produced, PACE_FIXED at a
+ * given rate. Files and directories can loop so benchmarks run as long as
+ * needed; without looping read() returns false at the end. Live devices
+ * that deliver nothing are retried, backing off, until setStallTimeout()
+ * has passed without a frame.
+ *
+ * A stereo source grab()s both devices back to back before retrieve()ing
+ * either, so the slow part, decoding, is not between the two exposures.
+ * Each side is timestamped with the driver's capture time where the
+ * backend reports one (V4L2 does), else with when its grab() returned; the
+ * frame's stamp is the left one and pair() carries the skew between them.
+ */
+
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include "opencv2/opencv.hpp"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+enum Pacing {
+    PACE_NATIVE,
+    PACE_FAST,
+    PACE_FIXED
+};
+
+class FrameSource {
+public:
+    //NULL with a message on stderr if the spec is malformed or won't open
+    static FrameSource *open(const std::string &spec);
+    virtual ~FrameSource() {}
+
+    void setPacing(Pacing pacing, double fps = 0);
+    void setLoop(bool loop) { loop_ = loop; }
+    //how long a live device may deliver nothing before read() gives up, 0
+    //to wait for it forever (5 s default)
+    void setStallTimeout(double secs) { stallNs_ = (uint64_t)(secs * 1e9); }
+
+    //next frame, paced; false at the end of a non-looping source
+    bool read(cv::Mat &img);
+
+    //capture time of the frame read() last returned, see frameClockNs(),
+    //and its FrameSlot::pair, 0 unless it is a stereo pair
+    uint64_t stampNs() const { return stampNs_; }
+    uint16_t pair() const { return pair_; }
+
+    //rate PACE_NATIVE delivers at, 0 if the source paces itself
+    virtual double nativeFps() const = 0;
+    virtual std::string describe() const = 0;
+
+protected:
+    FrameSource();
+
+    //produce the next frame as fast as possible; false at the end
+    virtual bool grab(cv::Mat &img) = 0;
+    //back to the first frame for looping, false if not possible
+    virtual bool rewind() { return false; }
+    //for a device's grab() to call when it got nothing since sinceNs: sleeps
+    //backoffUs and doubles it for next time, false if the stall timeout is up
+    bool waitForDevice(uint64_t sinceNs, unsigned &backoffUs);
+
+    bool     loop_;
+    uint64_t stallNs_;
+    //grab() may set these for the frame it produces; left at 0 the frame
+    //is stamped when grab() returns and is not a pair
+    uint64_t stampNs_;
+    uint16_t pair_;
+
+private:
+    Pacing   pacing_;
+    double   fps_;
+    uint64_t startNs_;  // pacing epoch, 0 until the first read
+    uint64_t count_;    // frames delivered since startNs_
+};
+
+class DeviceSource : public FrameSource {
+public:
+    explicit DeviceSource(int dev);
+    bool isOpened() const { return cap_.isOpened(); }
+    double nativeFps() const { return 0; }
+    std::string describe() const;
+
+protected:
+    bool grab(cv::Mat &img);
+
+private:
+    int              dev_;
+    cv::VideoCapture cap_;
+};
+
+class StereoSource : public FrameSource {
+public:
+    StereoSource(int left, int right);
+    bool isOpened() const { return left_.isOpened() && right_.isOpened(); }
+    double nativeFps() const { return 0; }
+    std::string describe() const;
+
+protected:
+    bool grab(cv::Mat &img);
+
+private:
+    int              leftDev_, rightDev_;
+    cv::VideoCapture left_, right_;
+    cv::Mat          leftImg_, rightImg_;
+};
+
+class FileSource : public FrameSource {
+public:
+    explicit FileSource(const std::string &path);
+    bool isOpened() const { return cap_.isOpened(); }
+    double nativeFps() const;
+    std::string describe() const;
+
+protected:
+    bool grab(cv::Mat &img);
+    bool rewind();
+
+private:
+    std::string      path_;
+    cv::VideoCapture cap_;
+};
+
+class ImageDirSource : public FrameSource {
+public:
+    explicit ImageDirSource(const std::string &path);
+    bool isOpened() const { return !files_.empty(); }
+    double nativeFps() const { return 30; }
+    std::string describe() const;
+
+protected:
+    bool grab(cv::Mat &img);
+    bool rewind() { next_ = 0; return true; }
+
+private:
+    std::string              path_;
+    std::vector<std::string> files_;
+    size_t                   next_;
+};
+
+class SyntheticSource : public FrameSource {
+public:
+    SyntheticSource(int width, int height, double fps);
+    double nativeFps() const { return fps_; }
+    std::string describe() const;
+
+protected:
+    bool grab(cv::Mat &img);
+
+private:
+    int      width_, height_;
+    double   fps_;
+    uint64_t frame_;
+};
+
+#endif
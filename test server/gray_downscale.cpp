@@ -0,0 +1,130 @@
+#include "gray_downscale.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GRAY_NEON 1
+#endif
+
+using namespace cv;
+
+//cvtColor's BGR to gray weights, Q14
+static const int kWeightB = 1868, kWeightG = 9617, kWeightR = 4899;
+
+//one output row from the F source rows it covers; F x F block sums are
+//weighted, giving Q14 x F^2, and rounded once
+template<int F>
+static void grayDownscaleRow(const uchar *const *rows, uchar *out, int outCols)
+{
+    const int shift = F == 2 ? 16 : 18;
+    int x = 0;
+#if defined(__SSSE3__)
+    //16 BGR pixels at a time: three shuffles each pick one channel out of
+    //the 48 bytes, then adjacent pixels are summed in pairs
+    const __m128i bA = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i bB = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i bC = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i gA = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i gB = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i gC = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i rA = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i rB = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i rC = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i wBG  = _mm_set1_epi32((kWeightG << 16) | kWeightB);
+    const __m128i wR   = _mm_set1_epi32(kWeightR);
+    const __m128i half = _mm_set1_epi32(1 << (shift - 1));
+    for (; x + 16 / F <= outCols; x += 16 / F) {
+        __m128i sb = _mm_setzero_si128(), sg = sb, sr = sb;
+        for (int k = 0; k < F; k++) {
+            const uchar *p = rows[k] + x * F * 3;
+            __m128i a = _mm_loadu_si128((const __m128i *)p);
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+            __m128i B = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, bA), _mm_shuffle_epi8(b, bB)), _mm_shuffle_epi8(c, bC));
+            __m128i G = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, gA), _mm_shuffle_epi8(b, gB)), _mm_shuffle_epi8(c, gC));
+            __m128i R = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, rA), _mm_shuffle_epi8(b, rB)), _mm_shuffle_epi8(c, rC));
+            sb = _mm_add_epi16(sb, _mm_maddubs_epi16(B, ones));
+            sg = _mm_add_epi16(sg, _mm_maddubs_epi16(G, ones));
+            sr = _mm_add_epi16(sr, _mm_maddubs_epi16(R, ones));
+        }
+        //weighted sums of the 8 pixel pairs, as 32 bits
+        __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(sb, sg), wBG),
+                                   _mm_madd_epi16(_mm_unpacklo_epi16(sr, zero), wR));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(sb, sg), wBG),
+                                   _mm_madd_epi16(_mm_unpackhi_epi16(sr, zero), wR));
+        if (F == 2) {
+            lo = _mm_srai_epi32(_mm_add_epi32(lo, half), shift);
+            hi = _mm_srai_epi32(_mm_add_epi32(hi, half), shift);
+            __m128i px = _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero);
+            _mm_storel_epi64((__m128i *)(out + x), px);
+        } else {
+            //pairs of pairs are the 4 pixel wide blocks
+            __m128i q = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(lo, hi), half), shift);
+            int px = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(q, zero), zero));
+            memcpy(out + x, &px, 4);
+        }
+    }
+#elif defined(GRAY_NEON)
+    for (; x + 16 / F <= outCols; x += 16 / F) {
+        uint8x16x3_t px = vld3q_u8(rows[0] + x * F * 3);
+        uint16x8_t sb = vpaddlq_u8(px.val[0]), sg = vpaddlq_u8(px.val[1]), sr = vpaddlq_u8(px.val[2]);
+        for (int k = 1; k < F; k++) {
+            px = vld3q_u8(rows[k] + x * F * 3);
+            sb = vpadalq_u8(sb, px.val[0]);
+            sg = vpadalq_u8(sg, px.val[1]);
+            sr = vpadalq_u8(sr, px.val[2]);
+        }
+        uint32x4_t lo = vmull_n_u16(vget_low_u16(sb), kWeightB);
+        lo = vmlal_n_u16(lo, vget_low_u16(sg), kWeightG);
+        lo = vmlal_n_u16(lo, vget_low_u16(sr), kWeightR);
+        uint32x4_t hi = vmull_n_u16(vget_high_u16(sb), kWeightB);
+        hi = vmlal_n_u16(hi, vget_high_u16(sg), kWeightG);
+        hi = vmlal_n_u16(hi, vget_high_u16(sr), kWeightR);
+        if (F == 2) {
+            uint16x8_t g = vcombine_u16(vmovn_u32(vrshrq_n_u32(lo, shift)), vmovn_u32(vrshrq_n_u32(hi, shift)));
+            vst1_u8(out + x, vqmovn_u16(g));
+        } else {
+            uint32x4_t q = vcombine_u32(vpadd_u32(vget_low_u32(lo), vget_high_u32(lo)),
+                                        vpadd_u32(vget_low_u32(hi), vget_high_u32(hi)));
+            uint16x4_t g = vmovn_u32(vrshrq_n_u32(q, shift));
+            uint8_t tmp[8];
+            vst1_u8(tmp, vqmovn_u16(vcombine_u16(g, g)));
+            memcpy(out + x, tmp, 4);
+        }
+    }
+#endif
+    for (; x < outCols; x++) {
+        int sb = 0, sg = 0, sr = 0;
+        for (int k = 0; k < F; k++) {
+            const uchar *p = rows[k] + x * F * 3;
+            for (int j = 0; j < F; j++) {
+                sb += p[3 * j];
+                sg += p[3 * j + 1];
+                sr += p[3 * j + 2];
+            }
+        }
+        out[x] = (uchar)((sb * kWeightB + sg * kWeightG + sr * kWeightR + (1 << (shift - 1))) >> shift);
+    }
+}
+
+bool grayDownscale(const Mat &src, Mat &dst, int factor)
+{
+    if (src.type() != CV_8UC3 || (factor != 2 && factor != 4))
+        return false;
+
+    dst.create(src.rows / factor, src.cols / factor, CV_8UC1);
+    const uchar *rows[4];
+    for (int y = 0; y < dst.rows; y++) {
+        for (int k = 0; k < factor; k++)
+            rows[k] = src.ptr<uchar>(y * factor + k);
+        if (factor == 2)
+            grayDownscaleRow<2>(rows, dst.ptr<uchar>(y), dst.cols);
+        else
+            grayDownscaleRow<4>(rows, dst.ptr<uchar>(y), dst.cols);
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+/**
+ * BGR to gray and a 2x or 4x area downscale in one pass over the source.
+ *
+ * cvtColor followed by resize(INTER_AREA) reads the full colour frame,
+ * writes a full gray one and reads that again. Here each block of factor x
+ * factor BGR pixels is summed per channel straight from the source rows and
+ * the three sums are weighted once, so the source is read once and only the
+ * small gray image is written.
+ *
+ * The weights are cvtColor's (0.114, 0.587, 0.299 in Q14), applied to the
+ * block sums and rounded once at the end: each output is the exactly
+ * rounded mean of the unrounded gray values, within 1 of cvtColor then
+ * resize. SSSE3 or NEON is used when the compiler targets it, plain C++
+ * otherwise; all give identical output.
+ */
+
+#ifndef GRAY_DOWNSCALE_H
+#define GRAY_DOWNSCALE_H
+
+#include "opencv2/opencv.hpp"
+
+//src CV_8UC3 in BGR order, factor 2 or 4; dst becomes CV_8UC1 of
+//src.cols / factor x src.rows / factor, leftover edge pixels are ignored.
+//false for anything else
+bool grayDownscale(const cv::Mat &src, cv::Mat &dst, int factor);
+
+#endif
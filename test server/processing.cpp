@@ -0,0 +1,633 @@
+#include "processing.h"
+#include "gray_downscale.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <sstream>
+
+using namespace cv;
+
+//--------------------------------------------------------
+//stages
+//--------------------------------------------------------
+
+//gray, optionally shrunk by factor 2 or 4 in the same pass over BGR frames
+class GrayStage : public ProcessingStage {
+public:
+    GrayStage(const std::string &spec, int factor) : ProcessingStage(spec), factor_(factor) {}
+
+    bool process(const Mat &in, Mat &out)
+    {
+        if (factor_ > 1 && in.type() == CV_8UC3)
+            return grayDownscale(in, out, factor_);
+
+        //anything else the long way round
+        Mat &gray = factor_ > 1 ? gray_ : out;
+        switch (in.channels()) {
+        case 1:
+            in.copyTo(gray);
+            break;
+        case 3:
+            cvtColor(in, gray, CV_BGR2GRAY);
+            break;
+        case 4:
+            cvtColor(in, gray, CV_BGRA2GRAY);
+            break;
+        default:
+            return false;
+        }
+        if (factor_ > 1)
+            resize(gray, out, Size(in.cols / factor_, in.rows / factor_), 0, 0, INTER_AREA);
+        return true;
+    }
+
+private:
+    int factor_;
+    Mat gray_;
+};
+
+class ResizeStage : public ProcessingStage {
+public:
+    //a fixed size if size has a width, otherwise scale
+    ResizeStage(const std::string &spec, Size size, double scale)
+        : ProcessingStage(spec), size_(size), scale_(scale) {}
+
+    bool process(const Mat &in, Mat &out)
+    {
+        Size to = size_;
+        if (to.width == 0) {
+            to.width  = std::max(1, (int)(in.cols * scale_ + 0.5));
+            to.height = std::max(1, (int)(in.rows * scale_ + 0.5));
+        }
+        //area averaging is the one that doesn't alias when shrinking
+        int interp = to.area() < in.cols * in.rows ? INTER_AREA : INTER_LINEAR;
+        resize(in, out, to, 0, 0, interp);
+        return true;
+    }
+
+private:
+    Size   size_;
+    double scale_;
+};
+
+class BlurStage : public ProcessingStage {
+public:
+    BlurStage(const std::string &spec, int ksize) : ProcessingStage(spec), ksize_(ksize) {}
+
+    bool process(const Mat &in, Mat &out)
+    {
+        GaussianBlur(in, out, Size(ksize_, ksize_), 0);
+        return true;
+    }
+
+private:
+    int ksize_;
+};
+
+//the calibration is scaled to the frame size, so it can come after a resize;
+//the remap tables are built on the first frame and again if the size changes
+class UndistortStage : public ProcessingStage {
+public:
+    UndistortStage(const std::string &spec, const Mat &camera, const Mat &dist, Size calibSize)
+        : ProcessingStage(spec), camera_(camera), dist_(dist), calibSize_(calibSize) {}
+
+    bool process(const Mat &in, Mat &out)
+    {
+        if (in.size() != mapSize_) {
+            Mat k = camera_.clone();
+            if (calibSize_.width > 0) {
+                double sx = (double)in.cols / calibSize_.width;
+                double sy = (double)in.rows / calibSize_.height;
+                k.at<double>(0, 0) *= sx;
+                k.at<double>(0, 2) *= sx;
+                k.at<double>(1, 1) *= sy;
+                k.at<double>(1, 2) *= sy;
+            }
+            initUndistortRectifyMap(k, dist_, Mat(), k, in.size(), CV_16SC2, map1_, map2_);
+            mapSize_ = in.size();
+        }
+        remap(in, out, map1_, map2_, INTER_LINEAR);
+        return true;
+    }
+
+private:
+    Mat  camera_, dist_;
+    Size calibSize_;    // resolution the calibration was done at, 0 = any
+    Size mapSize_;
+    Mat  map1_, map2_;
+};
+
+class CropStage : public ProcessingStage {
+public:
+    CropStage(const std::string &spec, Rect roi) : ProcessingStage(spec), roi_(roi) {}
+
+    bool process(const Mat &in, Mat &out)
+    {
+        if (roi_.x + roi_.width > in.cols || roi_.y + roi_.height > in.rows)
+            return false;
+        in(roi_).copyTo(out);
+        return true;
+    }
+
+private:
+    Rect roi_;
+};
+
+class FeaturesStage : public ProcessingStage {
+public:
+    FeaturesStage(const std::string &spec, int count, int threshold)
+        : ProcessingStage(spec), count_(count), threshold_(threshold) {}
+
+    bool process(const Mat &in, Mat &out)
+    {
+        const Mat *gray = &in;
+        if (in.channels() != 1) {
+            cvtColor(in, gray_, in.channels() == 4 ? CV_BGRA2GRAY : CV_BGR2GRAY);
+            gray = &gray_;
+        }
+        FAST(*gray, keypoints_, threshold_, true);
+        KeyPointsFilter::retainBest(keypoints_, count_);
+
+        out.create((int)keypoints_.size(), 1, CV_32FC4);
+        for (size_t i = 0; i < keypoints_.size(); i++) {
+            float *p = out.ptr<float>((int)i);
+            p[0] = keypoints_[i].pt.x;
+            p[1] = keypoints_[i].pt.y;
+            p[2] = keypoints_[i].size;
+            p[3] = keypoints_[i].response;
+        }
+        return true;
+    }
+
+private:
+    int                   count_, threshold_;
+    Mat                   gray_;
+    std::vector<KeyPoint> keypoints_;
+};
+
+static bool parseInt(const std::string &s, int *v)
+{
+    char *end;
+    long n = strtol(s.c_str(), &end, 10);
+    *v = (int)n;
+    return !s.empty() && *end == '\0';
+}
+
+static ProcessingStage *loadUndistort(const std::string &spec, const std::string &file)
+{
+    FileStorage fs(file, FileStorage::READ);
+    if (!fs.isOpened()) {
+        std::cerr << "Can't open calibration file " << file << std::endl;
+        return NULL;
+    }
+    Mat camera, dist;
+    fs["camera_matrix"] >> camera;
+    fs["distortion_coefficients"] >> dist;
+    if (camera.rows != 3 || camera.cols != 3 || dist.empty()) {
+        std::cerr << file << " has no camera_matrix and distortion_coefficients" << std::endl;
+        return NULL;
+    }
+    camera.convertTo(camera, CV_64F);
+
+    Size calib;
+    if (!fs["image_width"].empty() && !fs["image_height"].empty())
+        calib = Size((int)fs["image_width"], (int)fs["image_height"]);
+    if (calib.width <= 0 || calib.height <= 0)
+        calib = Size();
+    return new UndistortStage(spec, camera, dist, calib);
+}
+
+ProcessingStage *ProcessingStage::create(const std::string &spec)
+{
+    size_t colon = spec.find(':');
+    std::string kind = spec.substr(0, colon);
+    std::string arg  = colon == std::string::npos ? "" : spec.substr(colon + 1);
+    char        tail;
+
+    if (kind == "gray") {
+        if (colon == std::string::npos)
+            return new GrayStage(spec, 1);
+        if (arg == "2" || arg == "4")
+            return new GrayStage(spec, atoi(arg.c_str()));
+        std::cerr << "bad stage " << spec << ", want gray, gray:2 or gray:4" << std::endl;
+        return NULL;
+    }
+
+    if (kind == "resize") {
+        int w, h;
+        double scale;
+        if (sscanf(arg.c_str(), "%dx%d%c", &w, &h, &tail) == 2 && w > 0 && h > 0)
+            return new ResizeStage(spec, Size(w, h), 0);
+        if (sscanf(arg.c_str(), "%lf%c", &scale, &tail) == 1 && scale > 0 && scale <= 16)
+            return new ResizeStage(spec, Size(), scale);
+        std::cerr << "bad stage " << spec << ", want resize:WxH or resize:scale" << std::endl;
+        return NULL;
+    }
+
+    if (kind == "blur") {
+        int k;
+        if (parseInt(arg, &k) && k > 0 && (k & 1))
+            return new BlurStage(spec, k);
+        std::cerr << "bad stage " << spec << ", want blur:K with K odd" << std::endl;
+        return NULL;
+    }
+
+    if (kind == "undistort") {
+        if (!arg.empty())
+            return loadUndistort(spec, arg);
+        std::cerr << "bad stage " << spec << ", want undistort:calibration.yml" << std::endl;
+        return NULL;
+    }
+
+    if (kind == "crop") {
+        int w, h, x, y;
+        if (sscanf(arg.c_str(), "%dx%d+%d+%d%c", &w, &h, &x, &y, &tail) == 4
+            && w > 0 && h > 0 && x >= 0 && y >= 0)
+            return new CropStage(spec, Rect(x, y, w, h));
+        std::cerr << "bad stage " << spec << ", want crop:WxH+X+Y" << std::endl;
+        return NULL;
+    }
+
+    if (kind == "features") {
+        int n, t = 20;
+        int got = sscanf(arg.c_str(), "%d:%d%c", &n, &t, &tail);
+        if ((got == 1 || got == 2) && n > 0 && t > 0 && t < 256
+            && arg.find_first_not_of("0123456789:") == std::string::npos)
+            return new FeaturesStage(spec, n, t);
+        std::cerr << "bad stage " << spec << ", want features:N or features:N:threshold" << std::endl;
+        return NULL;
+    }
+
+    std::cerr << "unknown stage " << spec << std::endl;
+    return NULL;
+}
+
+//--------------------------------------------------------
+//hand-over between stages
+//--------------------------------------------------------
+
+//a fixed pool of frames passed from one thread to the next in order: the
+//writer fills a free one and commits it, the reader acquires and releases
+//it. Three frames let both sides work while one more waits
+class StageLink {
+public:
+    explicit StageLink(bool dropOldest)
+        : pool_(3),
+          dropOldest_(dropOldest),
+          closed_(false),
+          dropped_(0)
+    {
+        for (size_t i = 0; i < pool_.size(); i++)
+            free_.push_back(&pool_[i]);
+        pthread_mutex_init(&lock_, NULL);
+        pthread_cond_init(&changed_, NULL);
+    }
+
+    ~StageLink()
+    {
+        pthread_cond_destroy(&changed_);
+        pthread_mutex_destroy(&lock_);
+    }
+
+    //a frame to fill, NULL once closed. Without a free one, either takes
+    //back the oldest the reader has not got to or waits for the reader
+    StageFrame *beginWrite()
+    {
+        pthread_mutex_lock(&lock_);
+        while (!closed_ && free_.empty() && !(dropOldest_ && !full_.empty()))
+            pthread_cond_wait(&changed_, &lock_);
+        StageFrame *f = NULL;
+        if (!closed_) {
+            if (!free_.empty()) {
+                f = free_.back();
+                free_.pop_back();
+            } else {
+                f = full_.front();
+                full_.pop_front();
+                dropped_++;
+            }
+        }
+        pthread_mutex_unlock(&lock_);
+        return f;
+    }
+
+    void commit(StageFrame *f)
+    {
+        pthread_mutex_lock(&lock_);
+        full_.push_back(f);
+        pthread_cond_broadcast(&changed_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+    //the oldest committed frame, NULL once closed and drained
+    StageFrame *acquire()
+    {
+        pthread_mutex_lock(&lock_);
+        while (!closed_ && full_.empty())
+            pthread_cond_wait(&changed_, &lock_);
+        StageFrame *f = NULL;
+        if (!full_.empty()) {
+            f = full_.front();
+            full_.pop_front();
+        }
+        pthread_mutex_unlock(&lock_);
+        return f;
+    }
+
+    //back to the pool, from either side
+    void release(StageFrame *f)
+    {
+        pthread_mutex_lock(&lock_);
+        free_.push_back(f);
+        pthread_cond_broadcast(&changed_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+    void close()
+    {
+        pthread_mutex_lock(&lock_);
+        closed_ = true;
+        pthread_cond_broadcast(&changed_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+    uint64_t dropped()
+    {
+        pthread_mutex_lock(&lock_);
+        uint64_t n = dropped_;
+        pthread_mutex_unlock(&lock_);
+        return n;
+    }
+
+private:
+    StageLink(const StageLink &);
+    StageLink &operator=(const StageLink &);
+
+    std::vector<StageFrame>   pool_;
+    std::vector<StageFrame *> free_;
+    std::deque<StageFrame *>  full_;   // committed, oldest first
+    bool                      dropOldest_;
+    bool                      closed_;
+    uint64_t                  dropped_;
+    pthread_mutex_t           lock_;
+    pthread_cond_t            changed_;
+};
+
+//--------------------------------------------------------
+//publishing
+//--------------------------------------------------------
+
+StreamOut::StreamOut(FrameRing *ring, const CodecParams &params)
+    : ring_(ring)
+{
+    //one encoder per codec, run only while some client uses that codec
+    for (int c = 0; c < CODEC_COUNT; c++)
+        encoders_.push_back(FrameEncoder(c, params));
+}
+
+void StreamOut::commit(FrameSlot *slot, uint64_t stampNs, uint16_t pair)
+{
+    //make it continuous so senders can push it in one go
+    if (!slot->frame.isContinuous())
+        slot->frame = slot->frame.clone();
+
+    //encode once here for every client on the same codec
+    unsigned inUse = ring_->codecsInUse();
+    uint64_t seq = ring_->nextSeq();
+    for (int c = CODEC_RAW + 1; c < CODEC_COUNT; c++) {
+        slot->encoded[c].clear();
+        if (!(inUse & (1u << c)))
+            continue;
+        if (ring_->takeKeyframeRequest(c))
+            encoders_[c].requestKeyframe();
+        if (!encoders_[c].encode(slot->frame, seq, slot->encoded[c]))
+            slot->encoded[c].clear();
+    }
+
+    slot->stampNs = stampNs;
+    slot->pair    = pair;
+    ring_->commit(slot);
+}
+
+bool StreamOut::publish(const Mat &img, uint64_t stampNs, uint16_t pair)
+{
+    FrameSlot *slot = begin();
+    if (slot == NULL)
+        return false;
+    img.copyTo(slot->frame);
+    commit(slot, stampNs, pair);
+    return true;
+}
+
+//--------------------------------------------------------
+//the chain
+//--------------------------------------------------------
+
+ProcessingChain::ProcessingChain()
+    : pushing_(NULL),
+      pushSlot_(NULL),
+      started_(false)
+{
+}
+
+ProcessingChain::~ProcessingChain()
+{
+    finish();
+    for (size_t i = 0; i < stages_.size(); i++)
+        delete stages_[i];
+    for (size_t i = 0; i < links_.size(); i++)
+        delete links_[i];
+    for (size_t i = 0; i < outs_.size(); i++)
+        delete outs_[i];
+}
+
+ProcessingChain *ProcessingChain::create(const std::string &spec)
+{
+    ProcessingChain *chain = new ProcessingChain;
+    if (spec == "none")
+        return chain;
+
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item == "tap") {
+            chain->tapAt_.push_back(chain->stages_.size());
+            continue;
+        }
+        ProcessingStage *stage = ProcessingStage::create(item);
+        if (stage == NULL) {
+            delete chain;
+            return NULL;
+        }
+        chain->stages_.push_back(stage);
+    }
+
+    if (!chain->tapAt_.empty() && chain->tapAt_.back() == chain->stages_.size()) {
+        std::cerr << "tap at the end of " << spec << ": that is stream 0 already" << std::endl;
+        delete chain;
+        return NULL;
+    }
+    return chain;
+}
+
+std::string ProcessingChain::describe() const
+{
+    if (stages_.empty())
+        return "none";
+    std::stringstream ss;
+    size_t tap = 0;
+    for (size_t i = 0; i < stages_.size(); i++) {
+        for (; tap < tapAt_.size() && tapAt_[tap] == i; tap++)
+            ss << "[stream " << tap + 1 << "] ";
+        ss << stages_[i]->spec() << " ";
+    }
+    ss << "[stream 0]";
+    return ss.str();
+}
+
+bool ProcessingChain::start(const std::vector<FrameRing *> &rings, const CodecParams &params,
+                            bool dropAtEntry)
+{
+    if (rings.size() != streamCount())
+        return false;
+    for (size_t i = 0; i < rings.size(); i++)
+        outs_.push_back(new StreamOut(rings[i], params));
+    for (size_t i = 0; i < stages_.size(); i++)
+        links_.push_back(new StageLink(i == 0 && dropAtEntry));
+
+    workers_.resize(stages_.size());
+    for (size_t i = 0; i < stages_.size(); i++) {
+        workers_[i].chain = this;
+        workers_[i].index = i;
+        pthread_t id;
+        if (pthread_create(&id, NULL, stageThread, &workers_[i]) != 0) {
+            perror("Can't start stage thread");
+            started_ = true;
+            finish();
+            return false;
+        }
+        threads_.push_back(id);
+    }
+    started_ = true;
+    return true;
+}
+
+Mat *ProcessingChain::beginPush()
+{
+    //no stages: the capture thread writes stream 0 itself
+    if (links_.empty()) {
+        pushSlot_ = outs_[0]->begin();
+        return pushSlot_ != NULL ? &pushSlot_->frame : NULL;
+    }
+    pushing_ = links_[0]->beginWrite();
+    return pushing_ != NULL ? &pushing_->img : NULL;
+}
+
+void ProcessingChain::push(uint64_t stampNs, uint16_t pair)
+{
+    if (links_.empty()) {
+        outs_[0]->commit(pushSlot_, stampNs, pair);
+        pushSlot_ = NULL;
+        return;
+    }
+    pushing_->stampNs = stampNs;
+    pushing_->pair    = pair;
+    links_[0]->commit(pushing_);
+    pushing_ = NULL;
+}
+
+void ProcessingChain::finish()
+{
+    if (!started_)
+        return;
+    started_ = false;
+
+    //a frame begun but not pushed goes back unseen; an uncommitted ring
+    //slot still has seq 0 and is simply reused
+    if (pushing_ != NULL) {
+        links_[0]->release(pushing_);
+        pushing_ = NULL;
+    }
+    pushSlot_ = NULL;
+
+    //each stage drains what it has and closes the link after it
+    if (!links_.empty())
+        links_[0]->close();
+    for (size_t i = 0; i < threads_.size(); i++)
+        pthread_join(threads_[i], NULL);
+    threads_.clear();
+}
+
+uint64_t ProcessingChain::droppedAtEntry() const
+{
+    return links_.empty() ? 0 : links_[0]->dropped();
+}
+
+void *ProcessingChain::stageThread(void *arg)
+{
+    Worker *w = static_cast<Worker *>(arg);
+    w->chain->runStage(w->index);
+    return NULL;
+}
+
+void ProcessingChain::runStage(size_t i)
+{
+    ProcessingStage *stage = stages_[i];
+    StageLink       *in    = links_[i];
+    StageLink       *next  = i + 1 < links_.size() ? links_[i + 1] : NULL;
+    bool             reported = false;
+
+    StageFrame *f;
+    while ((f = in->acquire()) != NULL) {
+        publishTaps(i, *f);
+
+        bool ok, stop = false;
+        if (next == NULL) {
+            //the last stage writes straight into the ring
+            FrameSlot *slot = outs_[0]->begin();
+            if (slot == NULL) {
+                stop = true;
+                ok = true;
+            } else if ((ok = stage->process(f->img, slot->frame))) {
+                outs_[0]->commit(slot, f->stampNs, f->pair);
+            }
+        } else {
+            StageFrame *out = next->beginWrite();
+            if (out == NULL) {
+                stop = true;
+                ok = true;
+            } else if ((ok = stage->process(f->img, out->img))) {
+                out->stampNs = f->stampNs;
+                out->pair    = f->pair;
+                next->commit(out);
+            } else {
+                next->release(out);
+            }
+        }
+
+        if (!ok && !reported) {
+            std::cerr << "stage " << stage->spec() << " can't process a " << f->img.cols << "x"
+                      << f->img.rows << " frame, dropping such frames" << std::endl;
+            reported = true;
+        }
+        in->release(f);
+        if (stop)
+            break;
+    }
+
+    //whoever feeds us stops too if we stopped early; whoever we feed drains
+    //what it has and stops
+    in->close();
+    if (next != NULL)
+        next->close();
+}
+
+void ProcessingChain::publishTaps(size_t position, const StageFrame &f)
+{
+    for (size_t t = 0; t < tapAt_.size(); t++) {
+        if (tapAt_[t] == position)
+            outs_[t + 1]->publish(f.img, f.stampNs, f.pair);
+    }
+}
@@ -0,0 +1,147 @@
+/**
+ * The server's per-frame processing chain, configured once at startup.
+ *
+ * A chain is a comma separated list of stages applied in order:
+ *
+ *   gray                  BGR to one channel
+ *   gray:F                same and shrunk by F = 2 or 4 (area average), in
+ *                         one pass over the source, see gray_downscale.h
+ *   resize:WxH            to W x H pixels
+ *   resize:S              by a scale factor S, e.g. 0.5
+ *   blur:K                Gaussian blur, odd kernel size K
+ *   undistort:calib.yml   remap with camera_matrix and distortion_coefficients
+ *                         from an OpenCV calibration file for this frame size
+ *   crop:WxH+X+Y          W x H region at X, Y, which must lie inside the frame
+ *   features:N[:T]        the N strongest FAST corners, threshold T (20
+ *                         default), as an N x 1 CV_32FC4 of x, y, size, response
+ *   tap                   not a stage: publish the frame at this point as a
+ *                         stream of its own
+ *
+ * What comes out of the last stage is stream 0; each tap is one more stream,
+ * numbered from 1 in the order they appear. "none" is the empty chain, which
+ * publishes source frames as they are.
+ *
+ * Every stage runs on a thread of its own, so a frame can be in the blur
+ * while the next one is converted to gray. Stages hand frames over through
+ * small pools of buffers that are allocated with the first frame and reused
+ * from then on; the last stage writes straight into a FrameRing slot.
+ * Between stages frames are never dropped, a stage that falls behind holds
+ * up the ones before it. Only at the entry, and only for live sources, does
+ * a new frame replace one the first stage has not started on yet.
+ */
+
+#ifndef PROCESSING_H
+#define PROCESSING_H
+
+#include "opencv2/opencv.hpp"
+#include "frame_ring.h"
+#include "frame_codec.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class ProcessingStage {
+public:
+    //one stage from its spec, e.g. "resize:0.5"; NULL after saying why if
+    //the spec is unknown or malformed
+    static ProcessingStage *create(const std::string &spec);
+    virtual ~ProcessingStage() {}
+
+    //in to out, reusing out's buffer when the size is unchanged; false if
+    //this frame can't be processed (a crop outside it, say)
+    virtual bool process(const cv::Mat &in, cv::Mat &out) = 0;
+
+    const std::string &spec() const { return spec_; }
+
+protected:
+    explicit ProcessingStage(const std::string &spec) : spec_(spec) {}
+
+private:
+    ProcessingStage(const ProcessingStage &);
+    ProcessingStage &operator=(const ProcessingStage &);
+
+    std::string spec_;
+};
+
+//a frame between two stages
+struct StageFrame {
+    cv::Mat  img;
+    uint64_t stampNs;
+    uint16_t pair;
+};
+
+class StageLink;
+
+//publishes frames to one FrameRing, encoding them once per codec in use;
+//only ever called from one thread
+class StreamOut {
+public:
+    StreamOut(FrameRing *ring, const CodecParams &params);
+
+    //a slot to fill, NULL once the ring is closed
+    FrameSlot *begin() { return ring_->beginWrite(); }
+    void       commit(FrameSlot *slot, uint64_t stampNs, uint16_t pair);
+
+    //begin(), a copy of img and commit()
+    bool publish(const cv::Mat &img, uint64_t stampNs, uint16_t pair);
+
+    FrameRing *ring() const { return ring_; }
+
+private:
+    FrameRing                *ring_;
+    std::vector<FrameEncoder> encoders_;
+};
+
+class ProcessingChain {
+public:
+    //NULL after saying why if a stage spec is bad
+    static ProcessingChain *create(const std::string &spec);
+    ~ProcessingChain();
+
+    //stream 0 plus one per tap
+    size_t      streamCount() const { return tapAt_.size() + 1; }
+    std::string describe() const;
+
+    //start the stage threads, publishing stream i to rings[i]; dropAtEntry
+    //lets a new frame replace one the first stage has not started on
+    bool start(const std::vector<FrameRing *> &rings, const CodecParams &params,
+               bool dropAtEntry);
+
+    //capture side: a buffer to read the next frame into, NULL once the
+    //chain is shutting down; then push() it with its capture time and
+    //stereo pairing (FrameSlot::pair), which every stream carries along
+    cv::Mat *beginPush();
+    void     push(uint64_t stampNs, uint16_t pair);
+
+    //no more frames: let the stages finish what they have and join them
+    void finish();
+
+    //frames replaced at the entry before the first stage got to them
+    uint64_t droppedAtEntry() const;
+
+private:
+    ProcessingChain();
+    ProcessingChain(const ProcessingChain &);
+    ProcessingChain &operator=(const ProcessingChain &);
+
+    struct Worker {
+        ProcessingChain *chain;
+        size_t           index;
+    };
+    static void *stageThread(void *arg);
+    void runStage(size_t i);
+    void publishTaps(size_t position, const StageFrame &f);
+
+    std::vector<ProcessingStage *> stages_;
+    std::vector<size_t>            tapAt_;   // position of each tap, by stream - 1
+    std::vector<StreamOut *>       outs_;    // by stream
+    std::vector<StageLink *>       links_;   // links_[i] feeds stage i
+    std::vector<pthread_t>         threads_;
+    std::vector<Worker>            workers_;
+    StageFrame                    *pushing_; // taken by beginPush()
+    FrameSlot                     *pushSlot_; // same, for the empty chain
+    bool                           started_;
+};
+
+#endif
@@ -0,0 +1,491 @@
+#include "reactor.h"
+#include "frame_codec.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+using cv::Mat;
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+static const int kMaxEvents = 64;
+
+//kernel send buffer for clients that may drop frames; a deep socket buffer
+//would just queue stale frames behind the policy's back
+static const int kLowLatencySndBuf = 256 * 1024;
+
+DeliveryPolicy parseDeliveryPolicy(const char *name, bool *ok)
+{
+    *ok = true;
+    if (strcmp(name, "latest") == 0) return DELIVER_LATEST;
+    if (strcmp(name, "drop") == 0)   return DELIVER_DROP_OLDEST;
+    if (strcmp(name, "block") == 0)  return DELIVER_BLOCK;
+    *ok = false;
+    return DELIVER_LATEST;
+}
+
+Reactor::Reactor(int listenFd, const std::vector<std::vector<FrameRing *> > &cameras,
+                 DeliveryPolicy policy, size_t depth)
+    : epfd_(epoll_create1(EPOLL_CLOEXEC)),
+      listenFd_(listenFd),
+      frameFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      cameras_(cameras),
+      policy_(policy),
+      depth_(depth < 1 ? 1 : depth),
+      running_(true)
+{
+    if (epfd_ < 0 || frameFd_ < 0) {
+        perror("epoll/eventfd");
+        return;
+    }
+
+    struct epoll_event ev;
+
+    //several reactors share the listening socket, only wake one per connection
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listenFd_;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, listenFd_, &ev) < 0)
+        perror("epoll_ctl(listen)");
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &frameFd_;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, frameFd_, &ev) < 0)
+        perror("epoll_ctl(eventfd)");
+
+    //one eventfd for every stream, each client only pulls from its own
+    for (size_t i = 0; i < cameras_.size(); i++)
+        for (size_t j = 0; j < cameras_[i].size(); j++)
+            cameras_[i][j]->addNotifyFd(frameFd_);
+}
+
+Reactor::~Reactor()
+{
+    while (!clients_.empty())
+        drop(clients_.begin()->second);
+    reap();
+
+    for (size_t i = 0; i < cameras_.size(); i++)
+        for (size_t j = 0; j < cameras_[i].size(); j++)
+            cameras_[i][j]->removeNotifyFd(frameFd_);
+    if (frameFd_ >= 0) close(frameFd_);
+    if (epfd_ >= 0) close(epfd_);
+}
+
+void *Reactor::thread(void *arg)
+{
+    static_cast<Reactor *>(arg)->run();
+    return NULL;
+}
+
+void Reactor::stop()
+{
+    running_ = false;
+    uint64_t one = 1;
+    if (write(frameFd_, &one, sizeof(one)) < 0) {
+        //already signalled
+    }
+}
+
+void Reactor::run()
+{
+    struct epoll_event events[kMaxEvents];
+
+    //running_ starts out true so a stop() that lands before run() sticks
+    while (running_) {
+        int n = epoll_wait(epfd_, events, kMaxEvents, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        //a client dropped while handling one event may have more in this
+        //batch: it stays allocated, and its fd open, until they are done
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listenFd_)
+                acceptAll();
+            else if (tag == &frameFd_)
+                onFrame();
+            else if (!static_cast<Client *>(tag)->dead)
+                onClient(static_cast<Client *>(tag), events[i].events);
+        }
+        reap();
+    }
+}
+
+void Reactor::acceptAll()
+{
+    //edge triggered: drain the backlog or we will not be woken again
+    for (;;) {
+        int fd = accept4(listenFd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept failed!");
+            return;
+        }
+
+        Client *c = new Client();
+        c->fd      = fd;
+        c->hello   = false;
+        c->codec   = CODEC_RAW;
+        c->policy  = policy_;
+        c->depth   = depth_;
+        c->next    = 0;
+        c->slot    = NULL;
+        c->slotRing = NULL;
+        c->data    = NULL;
+        c->off     = 0;
+        c->len     = 0;
+        c->blocked = false;
+        c->sent    = 0;
+        c->dropped = 0;
+        c->dead    = false;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl(client)");
+            close(fd);
+            delete c;
+            continue;
+        }
+        clients_[fd] = c;
+        std::cout << "Connection accepted" << std::endl;
+    }
+}
+
+bool Reactor::onHello(Client *c)
+{
+    Hello h;
+    if (!unpackHello(&c->in[0], h))
+        return false;
+    if (h.policy != kPolicyServerDefault && h.policy > DELIVER_BLOCK)
+        return false;
+    for (size_t i = 0; i < kMaxCameras; i++) {
+        if (!(h.cameras & (1u << i)))
+            continue;
+        if (i >= cameras_.size() || h.stream >= cameras_[i].size()) {
+            std::cerr << "Client " << c->fd << " asked for camera " << i << " stream "
+                      << (int)h.stream << ", there are " << cameras_.size() << " cameras with "
+                      << cameras_[0].size() << " streams" << std::endl;
+            return false;
+        }
+    }
+
+    c->hello = true;
+    c->codec = h.codec;
+    if (h.policy != kPolicyServerDefault)
+        c->policy = (DeliveryPolicy)h.policy;
+    if (c->policy == DELIVER_LATEST)
+        c->depth = 1;
+    if (c->policy != DELIVER_BLOCK)
+        setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &kLowLatencySndBuf, sizeof(kLowLatencySndBuf));
+
+    std::cout << "Client " << c->fd << " cameras";
+    for (size_t i = 0; i < kMaxCameras; i++) {
+        if (!(h.cameras & (1u << i)))
+            continue;
+        Subscription s;
+        s.ring    = cameras_[i][h.stream];
+        s.camera  = (uint8_t)i;
+        s.gate    = c->policy == DELIVER_BLOCK ? s.ring->addGate() : -1;
+        s.lastSeq  = 0;
+        s.chainSeq = 0;
+        s.ring->addCodecUser(c->codec);
+        //its queue and the frame being sent
+        s.ring->addReader((int)c->depth + 1);
+        c->subs.push_back(s);
+        std::cout << " " << i;
+    }
+    std::cout << " stream " << (int)h.stream << " codec " << codecName(c->codec)
+              << " policy " << c->policy << std::endl;
+
+    //start streaming right away if a frame is already there
+    enqueue(c);
+    return pump(c);
+}
+
+void Reactor::onFrame()
+{
+    uint64_t count;
+    while (read(frameFd_, &count, sizeof(count)) > 0) {}
+
+    //collect first, pump() may drop clients from the map
+    std::vector<Client *> all;
+    for (std::map<int, Client*>::iterator it = clients_.begin(); it != clients_.end(); ++it)
+        all.push_back(it->second);
+
+    for (size_t i = 0; i < all.size(); i++) {
+        if (all[i]->dead || !all[i]->hello)
+            continue;
+        //queue even for blocked clients, that is where the policy applies
+        enqueue(all[i]);
+        if (!pump(all[i]))
+            drop(all[i]);
+    }
+}
+
+void Reactor::enqueue(Client *c)
+{
+    for (size_t i = 0; i < c->subs.size(); i++)
+        enqueue(c, c->subs[i]);
+}
+
+void Reactor::enqueue(Client *c, Subscription &sub)
+{
+    for (;;) {
+        //a blocking client stops pulling when full and holds the ring back
+        if (c->policy == DELIVER_BLOCK && sub.queue.size() >= c->depth)
+            return;
+
+        //latest-only and fresh clients jump to the newest frame, the others
+        //walk the ring in order
+        FrameSlot *s;
+        if (c->policy == DELIVER_LATEST || sub.lastSeq == 0)
+            s = sub.ring->tryAcquire(sub.lastSeq);
+        else
+            s = sub.ring->tryAcquireNext(sub.lastSeq);
+        if (s == NULL)
+            return;
+
+        //frames the capture thread overwrote before we got here
+        if (sub.lastSeq != 0 && s->seq > sub.lastSeq + 1)
+            c->dropped += s->seq - sub.lastSeq - 1;
+        sub.lastSeq = s->seq;
+        if (c->codec == CODEC_DELTA && !keepDelta(c, sub, s))
+            continue;
+
+        if (sub.queue.size() >= c->depth) {
+            sub.ring->release(sub.queue.front());
+            sub.queue.pop_front();
+            c->dropped++;
+        }
+        sub.queue.push_back(s);
+
+        //the queue holds a ref now, the gate only guards frames not pulled yet
+        if (sub.gate >= 0)
+            sub.ring->moveGate(sub.gate, sub.lastSeq);
+    }
+}
+
+//whether a CODEC_DELTA frame pulled from the ring goes in the queue; one
+//that doesn't is released. Deltas only decode right after the frame they
+//were made against, so one that lost it, or that would push it out of a
+//full queue, is skipped along with the rest until the next keyframe
+bool Reactor::keepDelta(Client *c, Subscription &sub, FrameSlot *s)
+{
+    const std::vector<uchar> &enc = s->encoded[CODEC_DELTA];
+    uint64_t ref = enc.size() >= 8 ? getLE(&enc[0], 8) : UINT64_MAX;
+    if (ref == 0) {
+        //a keyframe needs nothing before it: make room by dropping the
+        //queue whole, the frames after its front would be useless alone
+        if (sub.queue.size() >= c->depth) {
+            for (size_t j = 0; j < sub.queue.size(); j++)
+                sub.ring->release(sub.queue[j]);
+            c->dropped += sub.queue.size();
+            sub.queue.clear();
+        }
+        sub.chainSeq = s->seq;
+        return true;
+    }
+    if (ref != UINT64_MAX && ref == sub.chainSeq && sub.queue.size() < c->depth) {
+        sub.chainSeq = s->seq;
+        return true;
+    }
+
+    sub.ring->release(s);
+    c->dropped++;
+    if (sub.chainSeq != 0) {
+        sub.ring->requestKeyframe(CODEC_DELTA);
+        sub.chainSeq = 0;
+    }
+    return false;
+}
+
+void Reactor::onClient(Client *c, unsigned events)
+{
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        drop(c);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        //the hello is all a client ever says, after that just watch for the
+        //orderly shutdown
+        uint8_t buf[256];
+        for (;;) {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                if (c->hello)
+                    continue;
+                c->in.insert(c->in.end(), buf, buf + n);
+                size_t need = kHelloSize;
+                if (c->in.size() >= 8)
+                    need = std::max(need, (size_t)getLE(&c->in[6], 2));
+                if (c->in.size() >= need && !onHello(c)) {
+                    drop(c);
+                    return;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            drop(c);
+            return;
+        }
+    }
+
+    if ((events & EPOLLOUT) && c->hello) {
+        c->blocked = false;
+        if (!pump(c))
+            drop(c);
+    }
+}
+
+bool Reactor::pump(Client *c)
+{
+    if (c->blocked)
+        return true;
+
+    for (;;) {
+        if (c->slot == NULL) {
+            //room in the queue again, let a blocking client catch up
+            enqueue(c);
+
+            //cameras take turns, so a fast one can't starve the others
+            Subscription *sub = NULL;
+            for (size_t k = 0; k < c->subs.size() && sub == NULL; k++) {
+                Subscription &s = c->subs[(c->next + k) % c->subs.size()];
+                if (!s.queue.empty())
+                    sub = &s;
+            }
+            if (sub == NULL)
+                return true;
+            c->next = (sub - &c->subs[0] + 1) % c->subs.size();
+            c->slot     = sub->queue.front();
+            c->slotRing = sub->ring;
+            sub->queue.pop_front();
+            c->off = 0;
+
+            const Mat &f = c->slot->frame;
+            if (c->codec == CODEC_RAW) {
+                c->data = f.data;
+                c->len  = f.total() * f.elemSize();
+            } else {
+                std::vector<uchar> &enc = c->slot->encoded[c->codec];
+                //not encoded for us, e.g. the codec was requested after this
+                //frame was captured or can't take its image type
+                if (enc.empty()) {
+                    c->slotRing->release(c->slot);
+                    c->slot = NULL;
+                    c->dropped++;
+                    continue;
+                }
+                c->data = &enc[0];
+                c->len  = enc.size();
+            }
+
+            FrameHeader h;
+            h.seq        = c->slot->seq;
+            h.stampNs    = c->slot->stampNs;
+            h.width      = f.cols;
+            h.height     = f.rows;
+            h.type       = f.type();
+            h.stride     = f.cols * f.elemSize();
+            h.payloadLen = c->len;
+            h.codec      = c->codec;
+            h.camera     = sub->camera;
+            h.pair       = c->slot->pair;
+            packFrameHeader(h, c->hdr);
+        }
+
+        //header and payload go out in one syscall while both still fit
+        uchar *data = c->data;
+        size_t total = kFrameHeaderSize + c->len;
+        while (c->off < total) {
+            struct iovec iov[2];
+            int cnt = 0;
+            if (c->off < kFrameHeaderSize) {
+                iov[cnt].iov_base = c->hdr + c->off;
+                iov[cnt].iov_len  = kFrameHeaderSize - c->off;
+                cnt++;
+                iov[cnt].iov_base = data;
+                iov[cnt].iov_len  = c->len;
+                cnt++;
+            } else {
+                iov[cnt].iov_base = data + (c->off - kFrameHeaderSize);
+                iov[cnt].iov_len  = total - c->off;
+                cnt++;
+            }
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = cnt;
+
+            ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    c->blocked = true;
+                    return true;
+                }
+                return false;
+            }
+            c->off += n;
+        }
+
+        c->slotRing->release(c->slot);
+        c->slot = NULL;
+        c->sent++;
+    }
+}
+
+void Reactor::drop(Client *c)
+{
+    if (c->slot != NULL)
+        c->slotRing->release(c->slot);
+    for (size_t i = 0; i < c->subs.size(); i++) {
+        Subscription &s = c->subs[i];
+        for (size_t j = 0; j < s.queue.size(); j++)
+            s.ring->release(s.queue[j]);
+        if (s.gate >= 0)
+            s.ring->removeGate(s.gate);
+        s.ring->removeCodecUser(c->codec);
+        s.ring->removeReader((int)c->depth + 1);
+    }
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd, NULL);
+    clients_.erase(c->fd);
+    std::cout << "Connection closed, sent " << c->sent
+              << " dropped " << c->dropped << std::endl;
+    c->dead = true;
+    zombies_.push_back(c);
+}
+
+void Reactor::reap()
+{
+    //the fd is closed only now, so accept() can't hand its number to a new
+    //client while events for the old one are still being handled
+    for (size_t i = 0; i < zombies_.size(); i++) {
+        close(zombies_[i]->fd);
+        delete zombies_[i];
+    }
+    zombies_.clear();
+}
@@ -0,0 +1,109 @@
+/**
+ * Edge-triggered epoll loop serving frames to many clients from one thread.
+ *
+ * Each Reactor owns an epoll set containing the shared listening socket
+ * (EPOLLEXCLUSIVE, so only one reactor wakes per connection), an eventfd the
+ * FrameRings signal on every published frame, and its own client sockets.
+ * Each client reads the one stream it picked in its hello, from each camera
+ * it asked for; several cameras share its socket in turn.
+ *
+ * Client sockets are non-blocking; a frame that does not fit in the socket
+ * buffer is resumed on the next EPOLLOUT instead of blocking the loop.
+ *
+ * Frames waiting for a slow client sit in its own bounded queue, and the
+ * client's DeliveryPolicy decides what happens when that queue is full.
+ * CODEC_DELTA clients never get a frame whose reference they didn't get:
+ * whatever the policy, once one is lost the following deltas are skipped
+ * and a keyframe is asked for.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "frame_ring.h"
+#include "frame_protocol.h"
+#include <map>
+#include <deque>
+#include <vector>
+#include <stddef.h>
+
+enum DeliveryPolicy {
+    DELIVER_LATEST,       // only the newest pending frame, lowest latency
+    DELIVER_DROP_OLDEST,  // bounded queue, evicts the oldest pending frame
+    DELIVER_BLOCK         // never drops, stalls capture once the queue is full
+};
+
+//one camera's stream as a client reads it
+struct Subscription {
+    FrameRing *ring;
+    uint8_t    camera;
+    int        gate;      // FrameRing gate for DELIVER_BLOCK, -1 otherwise
+    uint64_t   lastSeq;   // newest frame pulled from the ring
+    uint64_t   chainSeq;  // CODEC_DELTA: last frame queued, 0 until a keyframe
+    std::deque<FrameSlot *> queue; // pending frames, each holding a ring ref
+};
+
+struct Client {
+    int        fd;
+    bool       hello;     // hello received, nothing is sent before that
+    std::vector<uint8_t> in; // partial hello
+    int        codec;     // FrameCodec the client asked for
+    DeliveryPolicy policy;
+    size_t     depth;     // queue bound per camera for DROP_OLDEST and BLOCK
+    std::vector<Subscription> subs; // one per camera asked for, set by the hello
+    size_t     next;      // subscription pump() tries first, round robin
+    FrameSlot *slot;      // frame being written, NULL when idle
+    FrameRing *slotRing;  // ring slot belongs to
+    uint8_t    hdr[kFrameHeaderSize]; // packed header of the current frame
+    size_t     off;       // bytes of header + payload already sent
+    uchar     *data;      // payload of the current frame
+    size_t     len;       // payload bytes of the current frame
+    bool       blocked;   // hit EAGAIN, waiting for EPOLLOUT
+    uint64_t   sent;      // frames fully written
+    uint64_t   dropped;   // frames this client never got, policy or overrun
+    bool       dead;      // dropped, freed once the current events are done
+};
+
+DeliveryPolicy parseDeliveryPolicy(const char *name, bool *ok);
+
+class Reactor {
+public:
+    //cameras[i] are camera i's processing streams, stream 0 first
+    Reactor(int listenFd, const std::vector<std::vector<FrameRing *> > &cameras,
+            DeliveryPolicy policy = DELIVER_LATEST, size_t depth = 1);
+    ~Reactor();
+
+    //run the event loop on the calling thread until stop()
+    void run();
+    void stop();
+
+    //pthread entry point, arg is a Reactor*
+    static void *thread(void *arg);
+
+private:
+    Reactor(const Reactor &);
+    Reactor &operator=(const Reactor &);
+
+    void acceptAll();
+    void onFrame();
+    void onClient(Client *c, unsigned events);
+    bool onHello(Client *c);        // false if the hello is malformed
+    void enqueue(Client *c);        // pull new ring frames per policy
+    void enqueue(Client *c, Subscription &s);
+    bool keepDelta(Client *c, Subscription &s, FrameSlot *slot); // false if a delta is skipped
+    bool pump(Client *c);           // false once the client is gone
+    void drop(Client *c);           // marks it dead, reap() frees it
+    void reap();                    // close and free the dead clients
+
+    int                    epfd_;
+    int                    listenFd_;
+    int                    frameFd_;  // eventfd signalled by the FrameRings
+    std::vector<std::vector<FrameRing *> > cameras_;
+    DeliveryPolicy         policy_;
+    size_t                 depth_;
+    std::map<int, Client*> clients_;
+    std::vector<Client *>  zombies_;  // dropped, events may still name them
+    volatile bool          running_;
+};
+
+#endif
@@ -7,15 +7,120 @@
 #include <net/if.h>
 #include <unistd.h> 
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "frame_ring.h"
+#include "reactor.h"
+#include "frame_protocol.h"
+#include "frame_codec.h"
+#include "shm_ring.h"
+#include "udp_multicast.h"
+#include "frame_source.h"
+#include "processing.h"
+#include <algorithm>
+#include <vector>
 
 using namespace cv;
 using namespace std;
 
-void *display(void *);
+void *capture(void *);
+void *shmPublish(void *);
+void *mcastPublish(void *);
 
-int capDev = 0;
+// one per source spec on the command line, camera i being the i-th; each
+// has its own capture thread, chain and rings
+struct Camera {
+    int                      id;
+    FrameSource             *source;  // where frames come from
+    ProcessingChain         *chain;   // what happens to them on the way
+    // every processed frame is written once to the ring of its stream and
+    // shared by all clients of that stream; streams[0] is the end of the
+    // chain, the others its taps. Each grows with the clients reading it
+    std::vector<FrameRing *> streams;
+    int                      core;    // CPU the capture thread is pinned to, -1 = any
+    pthread_t                thread;
+};
+std::vector<Camera *> cameras;
 
-VideoCapture cap(capDev); // open the default camera
+// capture threads still running, the last one out stops the reactors
+int capturing;
+
+// the capture threads stop these when every finite source has run out
+std::vector<Reactor *> reactors;
+
+// how frames are encoded for clients asking for a codec
+CodecParams codecParams;
+
+// shared memory segment for same-host consumers, NULL = TCP only
+const char *shmName = NULL;
+static const int kShmSlots = 4;
+
+// multicast group for fleet viewers, unused unless -m is given
+bool               mcastOn = false;
+struct sockaddr_in mcastGroup;
+int                mcastCodec = CODEC_JPEG;
+int                mcastTtl = 1;
+
+//keep a capture thread on one CPU, away from the scheduler moving it
+//between cores mid-frame; false where that isn't supported
+static bool pinThread(pthread_t thread, int core)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)core;
+    return false;
+#endif
+}
+
+static void usage()
+{
+    std::cerr << "usage: ./cv_video_srv [options] [port] [source...]\n" <<
+                 "port           : socket port (4097 default)\n" <<
+                 "source         : one per camera, numbered from 0 in order (up to 8):\n" <<
+                 "                 N or cam:N        capture device N (0 default)\n" <<
+                 "                 file:clip.avi     video file\n" <<
+                 "                 dir:frames        images in a directory, in name order\n" <<
+                 "                 synth:WxH[@fps]   generated test pattern (30 fps default)\n" <<
+                 "                 stereo:L,R        devices L and R grabbed together, sent as one\n" <<
+                 "                                   frame, left|right, with their capture skew;\n" <<
+                 "                                   stages see the pair as one image, so crop\n" <<
+                 "                                   and features lose the pairing\n" <<
+                 "-P pacing      : native | fast | fps, native plays files at their own rate,\n" <<
+                 "                 fast as quickly as frames come, a number at that rate\n" <<
+                 "                 (native default, a device always runs at its own rate)\n" <<
+                 "-l             : loop files and directories instead of exiting at the end\n" <<
+                 "-w secs        : how long a device may deliver nothing before its camera\n" <<
+                 "                 stops, 0 waits forever (5 default)\n" <<
+                 "-c cores       : CPUs to pin the capture threads to, comma separated, the\n" <<
+                 "                 i-th for camera i (e.g. 2,3); cameras past the list float\n" <<
+                 "-x chain       : processing stages, comma separated (gray default):\n" <<
+                 "                 gray, gray:2 or gray:4 (and shrink in the same pass),\n" <<
+                 "                 resize:WxH, resize:scale, blur:K, undistort:calib.yml,\n" <<
+                 "                 crop:WxH+X+Y, features:N[:threshold], or none; tap publishes\n" <<
+                 "                 the frame at that point as stream 1, 2, ... next to stream 0\n" <<
+                 "                 at the end, e.g. gray,tap,blur:5 (clients pick with -S)\n" <<
+                 "-t threads     : epoll loops serving clients (1 default)\n" <<
+                 "-p policy      : latest | drop | block, what a slow client gets (latest default)\n" <<
+                 "                 latest: newest frame only, drop: queue dropping the oldest,\n" <<
+                 "                 block: every frame, a full queue stalls capture for everyone\n" <<
+                 "-q depth       : client queue length for drop and block (4 default)\n" <<
+                 "-j quality     : JPEG quality for clients using the jpeg codec (80 default)\n" <<
+                 "-k interval    : frames between keyframes for the delta codec (30 default)\n" <<
+                 "-s name        : also publish camera 0's raw frames to shared memory segment\n" <<
+                 "                 name (e.g. /slamros_cam0), read with cv_video_cli shm name\n" <<
+                 "-m group:port  : also multicast camera 0 to group (e.g. 239.255.0.1:5000),\n" <<
+                 "                 read with cv_video_cli mcast group:port\n" <<
+                 "-M codec       : codec for the multicast stream (jpeg default)\n" <<
+                 "-T ttl         : multicast TTL, 1 stays on the local subnet (1 default)\n" <<
+                 "clients pick their cameras, stream and codec (raw, jpeg, png, qoi, delta)\n" <<
+                 "and may override the policy in their hello; a delta client that has to skip\n" <<
+                 "a frame gets no more until the keyframe the server then makes\n" << std::endl;
+}
     
 
 int main(int argc, char** argv)
@@ -25,34 +130,150 @@ int main(int argc, char** argv)
     //networking stuff: socket, bind, listen
     //--------------------------------------------------------
     int                 localSocket,
-                        remoteSocket,
-                        port;  
+                        port,
+                        ioThreads,
+                        depth;
+    DeliveryPolicy      policy;
+    const char         *policyName = "latest";
     int reuseaddr = 1; /* True */                             
+    std::vector<const char *> sourceSpecs;
+    std::vector<int>    cores;
+    Pacing              pacing = PACE_NATIVE;
+    double              pacingFps = 0;
+    bool                loop = false;
+    double              stallSecs = 5;
+    const char         *chainSpec = "gray";
 
-    struct  sockaddr_in localAddr,
-                        remoteAddr;
-    pthread_t thread_id;
+    struct  sockaddr_in localAddr;
     port = 4097;
-           
-    int addrLen = sizeof(struct sockaddr_in);
+    ioThreads = 1;
+    policy = DELIVER_LATEST;
+    depth = 4;
 
-       
-    if ( (argc > 1) && (strcmp(argv[1],"-h") == 0) ) {
-          std::cerr << "usage: ./cv_video_srv [port] [capture device]\n" <<
-                       "port           : socket port (4097 default)\n" <<
-                       "capture device : (0 default)\n" << std::endl;
+    int opt;
+    bool ok;
+    while ((opt = getopt(argc, argv, "ht:p:q:j:k:s:m:M:T:P:lw:x:c:")) != -1) {
+        switch (opt) {
+        case 't':
+            ioThreads = std::max(1, atoi(optarg));
+            break;
+        case 'p':
+            policy = parseDeliveryPolicy(optarg, &ok);
+            policyName = optarg;
+            if (!ok) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'q':
+            depth = std::max(1, atoi(optarg));
+            break;
+        case 'j':
+            codecParams.jpegQuality = std::min(100, std::max(0, atoi(optarg)));
+            break;
+        case 'k':
+            codecParams.keyInterval = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            shmName = optarg;
+            break;
+        case 'm':
+            if (!parseGroup(optarg, mcastGroup)) {
+                usage();
+                exit(1);
+            }
+            mcastOn = true;
+            break;
+        case 'M':
+            if ((mcastCodec = parseCodec(optarg)) < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'T':
+            mcastTtl = std::max(1, atoi(optarg));
+            break;
+        case 'P':
+            if (strcmp(optarg, "native") == 0) {
+                pacing = PACE_NATIVE;
+            } else if (strcmp(optarg, "fast") == 0) {
+                pacing = PACE_FAST;
+            } else if ((pacingFps = atof(optarg)) > 0) {
+                pacing = PACE_FIXED;
+            } else {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'l':
+            loop = true;
+            break;
+        case 'w':
+            stallSecs = std::max(0.0, atof(optarg));
+            break;
+        case 'x':
+            chainSpec = optarg;
+            break;
+        case 'c':
+            for (char *p = optarg; *p != '\0'; ) {
+                char *end;
+                long core = strtol(p, &end, 10);
+                if (end == p || core < 0 || (*end != ',' && *end != '\0')) {
+                    usage();
+                    exit(1);
+                }
+                cores.push_back((int)core);
+                p = *end == ',' ? end + 1 : end;
+            }
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
 
-          exit(1);
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+        std::cout << "port: " << port << "\n";
+    }
+    for (int i = optind + 1; i < argc; i++)
+        sourceSpecs.push_back(argv[i]);
+    if (sourceSpecs.empty())
+        sourceSpecs.push_back("0");
+    if (sourceSpecs.size() > (size_t)kMaxCameras) {
+        std::cerr << "at most " << kMaxCameras << " cameras" << std::endl;
+        exit(1);
     }
 
-    if (argc == 2) {
-        std::cout << "2 params, port: " << port << "\n";
-        port = atoi(argv[1]);
+    for (size_t i = 0; i < sourceSpecs.size(); i++) {
+        Camera *cam = new Camera;
+        cam->id   = (int)i;
+        cam->core = i < cores.size() ? cores[i] : -1;
+        if ((cam->chain = ProcessingChain::create(chainSpec)) == NULL) {
+            usage();
+            exit(1);
+        }
+
+        //the rings grow by what each client can pin as clients come, these
+        //are the slots kept free beyond that so capture never waits on them
+        for (size_t s = 0; s < cam->chain->streamCount(); s++)
+            cam->streams.push_back(new FrameRing(4));
+
+        if ((cam->source = FrameSource::open(sourceSpecs[i])) == NULL)
+            exit(1);
+        cam->source->setPacing(pacing, pacingFps);
+        cam->source->setLoop(loop);
+        cam->source->setStallTimeout(stallSecs);
+        cameras.push_back(cam);
     }
 
-    localSocket = socket(AF_INET , SOCK_STREAM , 0);
+    //a client hanging up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    localSocket = socket(AF_INET , SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC , 0);
     if (localSocket == -1){
          perror("socket() call failed!!");
+         exit(1);
     }    
 
     /* Enable the socket to reuse the address */
@@ -63,7 +284,6 @@ int main(int argc, char** argv)
     
     localAddr.sin_family = AF_INET;
     localAddr.sin_addr.s_addr = INADDR_ANY;
-    std::cout << "htons(port): " << htons( port ) << "\n";
     localAddr.sin_port = htons( port );
 
     if( bind(localSocket,(struct sockaddr *)&localAddr , sizeof(localAddr)) < 0) {
@@ -72,81 +292,222 @@ int main(int argc, char** argv)
     }
     
     //Listening
-    listen(localSocket , 3);
+    listen(localSocket , SOMAXCONN);
     
     std::cout <<  "Waiting for connections...\n"
-              <<  "Server Port:" << port << std::endl;
-
-    //accept connection from an incoming client
-    while(1){
-    //if (remoteSocket < 0) {
-    //    perror("accept failed!");
-    //    exit(1);
-    //}
-       
-     remoteSocket = accept(localSocket, (struct sockaddr *)&remoteAddr, (socklen_t*)&addrLen);  
-      //std::cout << remoteSocket<< "32"<< std::endl;
-    if (remoteSocket < 0) {
-        perror("accept failed!");
+              <<  "Server Port:" << port << "\n"
+              <<  "I/O threads:" << ioThreads << "\n"
+              <<  "Delivery policy:" << policyName << " depth " << depth << "\n"
+              <<  "Processing:" << cameras[0]->chain->describe() << "\n";
+    for (size_t i = 0; i < cameras.size(); i++) {
+        std::cout << "Camera " << i << ":" << cameras[i]->source->describe();
+        if (cameras[i]->core >= 0)
+            std::cout << " on CPU " << cameras[i]->core;
+        std::cout << "\n";
+    }
+    std::cout << std::flush;
+
+    //one epoll loop per I/O thread, all sharing the listening socket;
+    //create them before the capture threads so no frame notification is missed
+    std::vector<std::vector<FrameRing *> > rings;
+    for (size_t i = 0; i < cameras.size(); i++)
+        rings.push_back(cameras[i]->streams);
+    for (int i = 0; i < ioThreads; i++)
+        reactors.push_back(new Reactor(localSocket, rings, policy, depth));
+
+    //one producer per camera: grab every frame exactly once and feed the
+    //camera's chain
+    capturing = (int)cameras.size();
+    for (size_t i = 0; i < cameras.size(); i++) {
+        Camera *cam = cameras[i];
+
+        //a live device keeps running whatever we do, so a new frame replaces
+        //one the chain has not started on; files and the rest wait for it
+        if (!cam->chain->start(cam->streams, codecParams, cam->source->nativeFps() == 0))
+            exit(1);
+        if (pthread_create(&cam->thread, NULL, capture, cam) != 0) {
+            perror("Can't start capture thread");
+            exit(1);
+        }
+        if (cam->core >= 0 && !pinThread(cam->thread, cam->core))
+            std::cerr << "Can't pin camera " << i << " to CPU " << cam->core << std::endl;
+    }
+
+    //same-host consumers get frames without going through a socket
+    pthread_t shm_id;
+    if (shmName != NULL && pthread_create(&shm_id, NULL, shmPublish, NULL) != 0) {
+        perror("Can't start shared memory thread");
+        exit(1);
+    }
+
+    //one send per frame no matter how many viewers joined the group
+    pthread_t mcast_id;
+    if (mcastOn && pthread_create(&mcast_id, NULL, mcastPublish, NULL) != 0) {
+        perror("Can't start multicast thread");
         exit(1);
-    } 
-    std::cout << "Connection accepted" << std::endl;
-     pthread_create(&thread_id,NULL,display,&remoteSocket);
+    }
 
-     //pthread_join(thread_id,NULL);
+    std::vector<pthread_t> io_ids(ioThreads);
+    for (int i = 1; i < ioThreads; i++) {
+        if (pthread_create(&io_ids[i], NULL, Reactor::thread, reactors[i]) != 0) {
+            perror("Can't start I/O thread");
+            exit(1);
+        }
+    }
+
+    //the main thread serves as the first I/O thread
+    reactors[0]->run();
 
+    for (int i = 1; i < ioThreads; i++)
+        pthread_join(io_ids[i], NULL);
+    for (size_t i = 0; i < cameras.size(); i++)
+        pthread_join(cameras[i]->thread, NULL);
+    if (shmName != NULL)
+        pthread_join(shm_id, NULL);
+    if (mcastOn)
+        pthread_join(mcast_id, NULL);
+    for (int i = 0; i < ioThreads; i++)
+        delete reactors[i];
+    close(localSocket);
+    for (size_t i = 0; i < cameras.size(); i++) {
+        delete cameras[i]->chain;
+        for (size_t s = 0; s < cameras[i]->streams.size(); s++)
+            delete cameras[i]->streams[s];
+        delete cameras[i]->source;
+        delete cameras[i];
     }
-    //pthread_join(thread_id,NULL);
-    //close(remoteSocket);
 
     return 0;
 }
 
-void *display(void *ptr){
-    int socket = *(int *)ptr;
+void *capture(void *arg){
     //OpenCV Code
     //----------------------------------------------------------
 
-    Mat img, imgGray;
-    img = Mat::zeros(480 , 640, CV_8UC1);   
-     //make it continuous
-    if (!img.isContinuous()) {
-        img = img.clone();
+    Camera *cam = static_cast<Camera *>(arg);
+
+    while(1) {
+
+            /* get a frame from the source straight into the chain, paced as asked */
+                Mat *img = cam->chain->beginPush();
+                if (img == NULL)
+                    break;
+                if (!cam->source->read(*img)) {
+                    std::cout << "End of source, camera " << cam->id << std::endl;
+                    break;
+                }
+                cam->chain->push(cam->source->stampNs(), cam->source->pair());
     }
 
-    int imgSize = img.total() * img.elemSize();
-    int bytes = 0;
-    int key;
-    
+    //let the stages finish what they have, then wake everyone waiting on
+    //this camera's frames
+    cam->chain->finish();
+    if (cam->chain->droppedAtEntry() > 0)
+        std::cout << "Camera " << cam->id << " processing dropped " << cam->chain->droppedAtEntry()
+                  << " frames it could not keep up with" << std::endl;
+    for (size_t i = 0; i < cam->streams.size(); i++)
+        cam->streams[i]->close();
 
-    //make img continuos
-    if ( ! img.isContinuous() ) { 
-          img = img.clone();
-          imgGray = img.clone();
+    //the last camera out lets main() wind down
+    if (__atomic_sub_fetch(&capturing, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (size_t i = 0; i < reactors.size(); i++)
+            reactors[i]->stop();
     }
-        
-    std::cout << "Image Size:" << imgSize << std::endl;
+    return NULL;
+}
+
+void *shmPublish(void *){
+    ShmRing *shm = NULL;
+    uint64_t lastSeq = 0;
 
-	cap.set(CV_CAP_PROP_POS_MSEC, 300); //start the video at 300ms
-	double fps = cap.get(CV_CAP_PROP_FPS); //get the frames per seconds of the video
-	cout << "Frame per seconds : " << fps << endl;
-	
     while(1) {
-                
-            /* get a frame from camera */
-                cap >> img;
-            
-                //do video processing here 
-                cvtColor(img, imgGray, CV_BGR2GRAY);
-
-                //send processed image
-                if ((bytes = send(socket, imgGray.data, imgSize, 0)) < 0){
-                	 close(socket);
-                     std::cerr << "bytes = " << bytes << std::endl;
-                     break;
-                } 
-    }
-
-	close(socket);
+
+            /* wait for the next frame at the end of the chain */
+                FrameSlot *slot = cameras[0]->streams[0]->acquire(lastSeq);
+                if (slot == NULL)
+                    break;
+                lastSeq = slot->seq;
+
+                const Mat &f = slot->frame;
+                size_t imgSize = f.total() * f.elemSize();
+
+                //the segment is sized from the first frame we see
+                if (shm == NULL) {
+                    shm = ShmRing::create(shmName, kShmSlots, imgSize);
+                    if (shm == NULL) {
+                        cameras[0]->streams[0]->release(slot);
+                        break;
+                    }
+                    std::cout << "Shared memory: " << shmName << std::endl;
+                }
+
+                FrameHeader h;
+                h.seq        = slot->seq;
+                h.stampNs    = slot->stampNs;
+                h.width      = f.cols;
+                h.height     = f.rows;
+                h.type       = f.type();
+                h.stride     = f.cols * f.elemSize();
+                h.payloadLen = imgSize;
+                h.codec      = CODEC_RAW;
+                h.camera     = 0;
+                h.pair       = slot->pair;
+                if (!shm->publish(h, f.data))
+                    std::cerr << "frame " << h.seq << " too large for " << shmName << std::endl;
+
+                cameras[0]->streams[0]->release(slot);
+    }
+
+    delete shm;
+    return NULL;
 }
 
+void *mcastPublish(void *){
+    McastSender *mcast = McastSender::create(mcastGroup, mcastTtl);
+    if (mcast == NULL)
+        return NULL;
+
+    //the last stage encodes for us like for any TCP client
+    cameras[0]->streams[0]->addCodecUser(mcastCodec);
+    std::cout << "Multicast: " << inet_ntoa(mcastGroup.sin_addr) << ":"
+              << ntohs(mcastGroup.sin_port) << " codec " << codecName(mcastCodec) << std::endl;
+
+    uint64_t lastSeq = 0;
+    while(1) {
+
+            /* wait for the next frame at the end of the chain */
+                FrameSlot *slot = cameras[0]->streams[0]->acquire(lastSeq);
+                if (slot == NULL)
+                    break;
+                lastSeq = slot->seq;
+
+                const Mat &f = slot->frame;
+                FrameHeader h;
+                const uchar *data;
+                h.seq        = slot->seq;
+                h.stampNs    = slot->stampNs;
+                h.width      = f.cols;
+                h.height     = f.rows;
+                h.type       = f.type();
+                h.stride     = f.cols * f.elemSize();
+                h.codec      = mcastCodec;
+                h.camera     = 0;
+                h.pair       = slot->pair;
+                if (mcastCodec == CODEC_RAW) {
+                    data         = f.data;
+                    h.payloadLen = f.total() * f.elemSize();
+                } else {
+                    data         = slot->encoded[mcastCodec].empty() ? NULL : &slot->encoded[mcastCodec][0];
+                    h.payloadLen = slot->encoded[mcastCodec].size();
+                }
+
+                if (data != NULL)
+                    mcast->send(h, data);
+
+                cameras[0]->streams[0]->release(slot);
+    }
+
+    cameras[0]->streams[0]->removeCodecUser(mcastCodec);
+    delete mcast;
+    return NULL;
+}
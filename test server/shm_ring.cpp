@@ -0,0 +1,216 @@
+#include "shm_ring.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+
+static const uint32_t kShmMagic   = 0x534d4c53; // "SLMS"
+static const uint32_t kShmVersion = 1;
+static const size_t   kShmAlign   = 64;         // cache line
+
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t slotBytes;     // slot header + payload capacity, kShmAlign multiple
+    uint64_t latest;        // seq of the newest complete frame, 0 = none
+    uint32_t futex;         // bumped on every publish, readers wait on it
+    uint32_t waiters;       // readers currently in FUTEX_WAIT
+    uint8_t  pad[kShmAlign - 40];
+};
+
+//per slot: lock is 2*seq+1 while the writer fills the slot, 2*seq after
+struct ShmSlotHeader {
+    uint64_t lock;
+    uint8_t  frame[kFrameHeaderSize];
+    uint8_t  pad[kShmAlign - 8 - kFrameHeaderSize];
+};
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    //no FUTEX_PRIVATE_FLAG, the word is shared between processes
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+ShmRing::ShmRing()
+    : owner_(false),
+      base_(NULL),
+      size_(0),
+      hdr_(NULL),
+      readLock_(NULL),
+      readTicket_(0)
+{
+}
+
+ShmRing::~ShmRing()
+{
+    if (base_ != NULL)
+        munmap(base_, size_);
+    if (owner_)
+        shm_unlink(name_.c_str());
+}
+
+ShmRing *ShmRing::create(const char *name, int slots, size_t maxPayload)
+{
+    size_t slotBytes = sizeof(ShmSlotHeader) + (maxPayload + kShmAlign - 1) / kShmAlign * kShmAlign;
+    size_t size = sizeof(ShmRingHeader) + slotBytes * slots;
+
+    //a previous run may have left its segment behind, start clean so that
+    //readers still mapping the old one don't see our frames at odd sizes
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ShmRing *r = new ShmRing();
+    r->name_  = name;
+    r->owner_ = true;
+    r->base_  = (uint8_t *)p;
+    r->size_  = size;
+    r->hdr_   = (ShmRingHeader *)p;
+
+    //ftruncate zero-filled everything, so latest and all slot locks are 0
+    r->hdr_->slots     = slots;
+    r->hdr_->slotBytes = slotBytes;
+    r->hdr_->version   = kShmVersion;
+    __atomic_store_n(&r->hdr_->magic, kShmMagic, __ATOMIC_RELEASE);
+    return r;
+}
+
+ShmRing *ShmRing::open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmRingHeader)) {
+        close(fd);
+        return NULL;
+    }
+    //readers write too: the futex word and the waiter count
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    ShmRingHeader *h = (ShmRingHeader *)p;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != kShmMagic || h->version != kShmVersion
+        || sizeof(ShmRingHeader) + h->slotBytes * h->slots > (size_t)st.st_size) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+
+    ShmRing *r = new ShmRing();
+    r->name_ = name;
+    r->base_ = (uint8_t *)p;
+    r->size_ = st.st_size;
+    r->hdr_  = h;
+    return r;
+}
+
+size_t ShmRing::maxPayload() const
+{
+    return hdr_->slotBytes - sizeof(ShmSlotHeader);
+}
+
+uint8_t *ShmRing::slot(uint64_t seq) const
+{
+    return base_ + sizeof(ShmRingHeader) + ((seq - 1) % hdr_->slots) * hdr_->slotBytes;
+}
+
+bool ShmRing::publish(const FrameHeader &h, const uint8_t *data)
+{
+    if (h.payloadLen > maxPayload())
+        return false;
+
+    uint8_t *s = slot(h.seq);
+    ShmSlotHeader *sh = (ShmSlotHeader *)s;
+
+    //odd lock: readers of the frame that lived here will see it change
+    __atomic_store_n(&sh->lock, 2 * h.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    packFrameHeader(h, sh->frame);
+    memcpy(s + sizeof(ShmSlotHeader), data, h.payloadLen);
+
+    __atomic_store_n(&sh->lock, 2 * h.seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr_->latest, h.seq, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&hdr_->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr_->waiters, __ATOMIC_SEQ_CST) > 0)
+        futex(&hdr_->futex, FUTEX_WAKE, INT_MAX, NULL);
+    return true;
+}
+
+const uint8_t *ShmRing::wait(uint64_t lastSeq, int timeoutMs, FrameHeader &h)
+{
+    struct timespec ts;
+    ts.tv_sec  = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+
+    for (;;) {
+        uint32_t f = __atomic_load_n(&hdr_->futex, __ATOMIC_SEQ_CST);
+        uint64_t seq = __atomic_load_n(&hdr_->latest, __ATOMIC_ACQUIRE);
+
+        if (seq > lastSeq) {
+            uint8_t *s = slot(seq);
+            ShmSlotHeader *sh = (ShmSlotHeader *)s;
+            uint64_t lock = __atomic_load_n(&sh->lock, __ATOMIC_ACQUIRE);
+            if (lock != 2 * seq)
+                continue;   // already being overwritten, take the next one
+
+            if (!unpackFrameHeader(sh->frame, h))
+                return NULL;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&sh->lock, __ATOMIC_RELAXED) != lock)
+                continue;
+            //a header that passed the lock check is the writer's own, one
+            //claiming more than a slot holds means the segment is not ours
+            if (h.payloadLen > maxPayload())
+                return NULL;
+
+            readLock_   = &sh->lock;
+            readTicket_ = lock;
+            return s + sizeof(ShmSlotHeader);
+        }
+
+        //publish() bumps the futex word after latest, so if nothing changed
+        //since we read f the kernel puts us to sleep, otherwise returns
+        __atomic_add_fetch(&hdr_->waiters, 1, __ATOMIC_SEQ_CST);
+        long rc = futex(&hdr_->futex, FUTEX_WAIT, f, &ts);
+        int err = errno;
+        __atomic_sub_fetch(&hdr_->waiters, 1, __ATOMIC_SEQ_CST);
+        if (rc < 0 && err == ETIMEDOUT)
+            return NULL;
+    }
+}
+
+bool ShmRing::stillValid() const
+{
+    if (readLock_ == NULL)
+        return false;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(readLock_, __ATOMIC_RELAXED) == readTicket_;
+}
@@ -0,0 +1,65 @@
+/**
+ * Same-host frame transport over a POSIX shared memory ring.
+ *
+ * One writer process creates the segment (shm_open) and publishes frames
+ * into a fixed number of slots; any number of reader processes map it and
+ * read frames in place, so delivery costs the writer one memcpy and the
+ * reader none. Readers never hold the writer back: each slot is guarded by
+ * a sequence lock and a reader that was too slow finds out through
+ * stillValid() and drops the frame. Readers sleep on a futex in the segment
+ * header, which the writer only wakes when somebody is actually waiting.
+ *
+ * Segment layout: a 64 byte ShmRingHeader, then `slots` slots of slotBytes
+ * each, every slot a 64 byte slot header (lock word + packed FrameHeader)
+ * followed by the payload.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include "frame_protocol.h"
+#include <stddef.h>
+#include <string>
+
+struct ShmRingHeader;
+
+class ShmRing {
+public:
+    ~ShmRing();
+
+    //writer: create (replacing any stale segment of that name) with room
+    //for payloads of up to maxPayload bytes; NULL on failure
+    static ShmRing *create(const char *name, int slots, size_t maxPayload);
+
+    //publish a frame under h.seq; false if the payload doesn't fit
+    bool publish(const FrameHeader &h, const uint8_t *data);
+
+    //reader: map an existing segment, NULL if it isn't there (yet)
+    static ShmRing *open(const char *name);
+
+    //wait up to timeoutMs for a frame newer than lastSeq and return a
+    //pointer to its payload inside the segment, NULL on timeout or a frame
+    //larger than a slot; the bytes may be overwritten at any time, check
+    //stillValid() once done with them
+    const uint8_t *wait(uint64_t lastSeq, int timeoutMs, FrameHeader &h);
+    bool           stillValid() const;
+
+    size_t maxPayload() const;
+
+private:
+    ShmRing();
+    ShmRing(const ShmRing &);
+    ShmRing &operator=(const ShmRing &);
+
+    uint8_t *slot(uint64_t seq) const;
+
+    std::string    name_;
+    bool           owner_;     // writer unlinks the segment on destruction
+    uint8_t       *base_;
+    size_t         size_;
+    ShmRingHeader *hdr_;
+    const uint64_t *readLock_; // lock word of the slot last returned by wait()
+    uint64_t       readTicket_;
+};
+
+#endif
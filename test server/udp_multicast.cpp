@@ -0,0 +1,322 @@
+#include "udp_multicast.h"
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <algorithm>
+
+static const uint32_t kFragmentMagic = 0x554d4c53; // "SLMU" on the wire
+static const int      kSendBatch     = 64;         // datagrams per sendmmsg
+static const int      kRecvBatch     = 32;         // datagrams per recvmmsg
+static const size_t   kMaxDatagram   = 2048;
+static const size_t   kMaxPartial    = 8;          // frames reassembled at once
+static const int      kRcvBuf        = 8 * 1024 * 1024;
+static const uint64_t kRestartGap    = 1000;       // seq jump back = new sender
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool parseGroup(const char *spec, struct sockaddr_in &addr)
+{
+    std::string s(spec);
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(atoi(s.c_str() + colon + 1));
+    return inet_pton(AF_INET, s.substr(0, colon).c_str(), &addr.sin_addr) == 1
+        && IN_MULTICAST(ntohl(addr.sin_addr.s_addr)) && addr.sin_port != 0;
+}
+
+//--------------------------------------------------------
+//sender
+//--------------------------------------------------------
+
+McastSender *McastSender::create(const struct sockaddr_in &group, int ttl)
+{
+    int sokt = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sokt < 0) {
+        perror("socket(multicast)");
+        return NULL;
+    }
+
+    unsigned char t = ttl, loop = 1;
+    setsockopt(sokt, IPPROTO_IP, IP_MULTICAST_TTL, &t, sizeof(t));
+    //viewers on this host should see the stream too
+    setsockopt(sokt, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    return new McastSender(sokt, group);
+}
+
+McastSender::McastSender(int sokt, const struct sockaddr_in &group)
+    : sokt_(sokt),
+      group_(group)
+{
+}
+
+McastSender::~McastSender()
+{
+    close(sokt_);
+}
+
+bool McastSender::send(const FrameHeader &h, const uint8_t *payload)
+{
+    uint8_t hdr[kFrameHeaderSize];
+    packFrameHeader(h, hdr);
+
+    size_t total = kFrameHeaderSize + h.payloadLen;
+    size_t count = (total + kFragmentData - 1) / kFragmentData;
+    if (count > 0xffff)
+        return false;
+
+    headers_.resize(count * kFragmentHeaderSize);
+
+    struct mmsghdr msgs[kSendBatch];
+    struct iovec   iovs[kSendBatch][3];
+
+    for (size_t first = 0; first < count; first += kSendBatch) {
+        int batch = (int)std::min((size_t)kSendBatch, count - first);
+
+        for (int b = 0; b < batch; b++) {
+            size_t i     = first + b;
+            size_t begin = i * kFragmentData;
+            size_t end   = std::min(begin + kFragmentData, total);
+
+            uint8_t *fh = &headers_[i * kFragmentHeaderSize];
+            putLE(fh + 0, kFragmentMagic, 4);
+            putLE(fh + 4, h.seq, 8);
+            putLE(fh + 12, i, 2);
+            putLE(fh + 14, count, 2);
+            putLE(fh + 16, total, 4);
+
+            //the fragment covers [begin, end) of header followed by payload,
+            //point into both instead of copying them together
+            int n = 0;
+            iovs[b][n].iov_base = fh;
+            iovs[b][n].iov_len  = kFragmentHeaderSize;
+            n++;
+            if (begin < kFrameHeaderSize) {
+                size_t e = std::min(end, kFrameHeaderSize);
+                iovs[b][n].iov_base = hdr + begin;
+                iovs[b][n].iov_len  = e - begin;
+                n++;
+                begin = e;
+            }
+            if (begin < end) {
+                iovs[b][n].iov_base = (void *)(payload + (begin - kFrameHeaderSize));
+                iovs[b][n].iov_len  = end - begin;
+                n++;
+            }
+
+            memset(&msgs[b], 0, sizeof(msgs[b]));
+            msgs[b].msg_hdr.msg_name    = &group_;
+            msgs[b].msg_hdr.msg_namelen = sizeof(group_);
+            msgs[b].msg_hdr.msg_iov     = iovs[b];
+            msgs[b].msg_hdr.msg_iovlen  = n;
+        }
+
+        int sent = 0;
+        while (sent < batch) {
+            int r = sendmmsg(sokt_, msgs + sent, batch - sent, 0);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("sendmmsg");
+                return false;
+            }
+            sent += r;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------
+//receiver
+//--------------------------------------------------------
+
+McastReceiver *McastReceiver::create(const struct sockaddr_in &group, int deadlineMs)
+{
+    int sokt = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sokt < 0) {
+        perror("socket(multicast)");
+        return NULL;
+    }
+
+    //several viewers on one host all bind the group port
+    int reuse = 1;
+    setsockopt(sokt, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    //a whole frame arrives as a burst of datagrams
+    setsockopt(sokt, SOL_SOCKET, SO_RCVBUF, &kRcvBuf, sizeof(kRcvBuf));
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family      = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port        = group.sin_port;
+    if (bind(sokt, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("bind(multicast)");
+        close(sokt);
+        return NULL;
+    }
+
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr        = group.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sokt, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        close(sokt);
+        return NULL;
+    }
+
+    return new McastReceiver(sokt, deadlineMs);
+}
+
+McastReceiver::McastReceiver(int sokt, int deadlineMs)
+    : sokt_(sokt),
+      deadlineNs_((uint64_t)deadlineMs * 1000000ull),
+      lastSeq_(0),
+      incomplete_(0),
+      cancelled_(false)
+{
+}
+
+McastReceiver::~McastReceiver()
+{
+    close(sokt_);
+}
+
+void McastReceiver::expire(uint64_t nowNs)
+{
+    while (!partial_.empty() && nowNs - partial_.front().firstNs > deadlineNs_) {
+        partial_.pop_front();
+        incomplete_++;
+    }
+}
+
+bool McastReceiver::onDatagram(const uint8_t *d, size_t len, uint64_t nowNs)
+{
+    if (len < kFragmentHeaderSize || getLE(d, 4) != kFragmentMagic)
+        return false;
+
+    uint64_t seq   = getLE(d + 4, 8);
+    uint16_t index = (uint16_t)getLE(d + 12, 2);
+    uint16_t count = (uint16_t)getLE(d + 14, 2);
+    uint32_t total = (uint32_t)getLE(d + 16, 4);
+    size_t   off   = (size_t)index * kFragmentData;
+    size_t   n     = len - kFragmentHeaderSize;
+
+    //the sender restarted and counts from 1 again
+    if (seq + kRestartGap < lastSeq_)
+        lastSeq_ = 0;
+
+    //late fragments of frames we delivered or gave up on
+    if (seq <= lastSeq_ || index >= count || total < kFrameHeaderSize
+        || (total + kFragmentData - 1) / kFragmentData != count
+        || off + n > total || (index + 1 < count && n != kFragmentData))
+        return false;
+
+    //partial_ stays sorted by seq, frames normally arrive in order
+    std::deque<Partial>::iterator p = partial_.begin();
+    while (p != partial_.end() && p->seq < seq)
+        ++p;
+    if (p == partial_.end() || p->seq != seq) {
+        if (partial_.size() >= kMaxPartial) {
+            partial_.pop_front();
+            incomplete_++;
+            p = partial_.begin();
+            while (p != partial_.end() && p->seq < seq)
+                ++p;
+        }
+        Partial fresh;
+        fresh.seq     = seq;
+        fresh.total   = total;
+        fresh.count   = count;
+        fresh.got     = 0;
+        fresh.firstNs = nowNs;
+        p = partial_.insert(p, fresh);
+        p->buf.resize(total);
+        p->have.assign(count, false);
+    }
+    if (p->total != total || p->count != count || p->have[index])
+        return false;
+
+    memcpy(&p->buf[off], d + kFragmentHeaderSize, n);
+    p->have[index] = true;
+    if (++p->got < p->count)
+        return false;
+
+    //complete; anything older still missing pieces is stale now
+    done_.swap(p->buf);
+    lastSeq_ = seq;
+    while (!partial_.empty() && partial_.front().seq <= seq) {
+        if (partial_.front().seq < seq)
+            incomplete_++;
+        partial_.pop_front();
+    }
+    return true;
+}
+
+bool McastReceiver::next(FrameHeader &h, const uint8_t *&data)
+{
+    struct mmsghdr msgs[kRecvBatch];
+    struct iovec   iovs[kRecvBatch];
+
+    while (!__atomic_load_n(&cancelled_, __ATOMIC_RELAXED)) {
+        //wake up at least every few ms so that stale frames expire
+        struct pollfd pfd;
+        pfd.fd     = sokt_;
+        pfd.events = POLLIN;
+        int pr = poll(&pfd, 1, 10);
+        if (pr < 0 && errno != EINTR) {
+            perror("poll(multicast)");
+            return false;
+        }
+        expire(monotonicNs());
+        if (pr <= 0)
+            continue;
+
+        recvBuf_.resize(kRecvBatch * kMaxDatagram);
+        for (int i = 0; i < kRecvBatch; i++) {
+            iovs[i].iov_base = &recvBuf_[i * kMaxDatagram];
+            iovs[i].iov_len  = kMaxDatagram;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov    = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(sokt_, msgs, kRecvBatch, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            perror("recvmmsg");
+            return false;
+        }
+
+        //should one batch complete two frames only the newer is returned,
+        //the older one shows up as a gap in seq like any other loss
+        uint64_t now = monotonicNs();
+        bool complete = false;
+        for (int i = 0; i < n; i++) {
+            if (onDatagram(&recvBuf_[i * kMaxDatagram], msgs[i].msg_len, now))
+                complete = true;
+        }
+        if (!complete)
+            continue;
+
+        if (!unpackFrameHeader(&done_[0], h) || kFrameHeaderSize + h.payloadLen > done_.size())
+            continue;
+        data = &done_[0] + kFrameHeaderSize;
+        return true;
+    }
+    return false;
+}
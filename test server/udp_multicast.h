@@ -0,0 +1,99 @@
+/**
+ * UDP multicast frame transport: one send per frame regardless of how many
+ * viewers have joined the group.
+ *
+ * Each frame (packed FrameHeader followed by the payload) is cut into
+ * fragments that fit one Ethernet MTU. Every datagram carries a 20 byte
+ * little-endian fragment header:
+ *
+ *   off size field
+ *     0    4 magic       'SLMU'
+ *     4    8 seq         frame seq, same as in the FrameHeader
+ *    12    2 index       fragment number, 0 based
+ *    14    2 count       fragments in this frame
+ *    16    4 total       bytes of header + payload in this frame
+ *
+ * followed by up to kFragmentData bytes at offset index * kFragmentData.
+ * The receiver reassembles frames and gives up on any that are still
+ * incomplete after a deadline, UDP being free to lose fragments.
+ */
+
+#ifndef UDP_MULTICAST_H
+#define UDP_MULTICAST_H
+
+#include "frame_protocol.h"
+#include <netinet/in.h>
+#include <vector>
+#include <deque>
+
+static const size_t kFragmentHeaderSize = 20;
+//1500 byte MTU - 20 IPv4 - 8 UDP - our header, rounded down
+static const size_t kFragmentData       = 1440;
+
+//"239.1.2.3:5000" into addr, false if malformed
+bool parseGroup(const char *spec, struct sockaddr_in &addr);
+
+class McastSender {
+public:
+    //ttl 1 keeps the stream on the local subnet
+    static McastSender *create(const struct sockaddr_in &group, int ttl);
+    ~McastSender();
+
+    //fragment and send one frame; false on a socket error
+    bool send(const FrameHeader &h, const uint8_t *payload);
+
+private:
+    McastSender(int sokt, const struct sockaddr_in &group);
+    McastSender(const McastSender &);
+    McastSender &operator=(const McastSender &);
+
+    int                  sokt_;
+    struct sockaddr_in   group_;
+    std::vector<uint8_t> headers_;  // one fragment header per datagram
+};
+
+class McastReceiver {
+public:
+    static McastReceiver *create(const struct sockaddr_in &group, int deadlineMs);
+    ~McastReceiver();
+
+    //block until the next complete frame; data stays valid until the next
+    //call. false on a socket error or once cancel() was called
+    bool next(FrameHeader &h, const uint8_t *&data);
+
+    //make next() in another thread return false within one poll interval
+    void cancel() { __atomic_store_n(&cancelled_, true, __ATOMIC_RELAXED); }
+
+    //frames dropped because fragments were missing at the deadline
+    uint64_t incomplete() const { return incomplete_; }
+
+private:
+    struct Partial {
+        uint64_t             seq;
+        uint32_t             total;
+        uint16_t             count;
+        uint16_t             got;
+        uint64_t             firstNs;   // monotonic time of first fragment
+        std::vector<uint8_t> buf;
+        std::vector<bool>    have;
+    };
+
+    McastReceiver(int sokt, int deadlineMs);
+    McastReceiver(const McastReceiver &);
+    McastReceiver &operator=(const McastReceiver &);
+
+    //returns true and fills done_ when dgram completes a frame
+    bool onDatagram(const uint8_t *dgram, size_t len, uint64_t nowNs);
+    void expire(uint64_t nowNs);
+
+    int                  sokt_;
+    uint64_t             deadlineNs_;
+    uint64_t             lastSeq_;  // newest frame handed out
+    uint64_t             incomplete_;
+    bool                 cancelled_;
+    std::deque<Partial>  partial_;  // oldest first
+    std::vector<uint8_t> done_;     // last completed frame
+    std::vector<uint8_t> recvBuf_;  // recvmmsg landing area
+};
+
+#endif
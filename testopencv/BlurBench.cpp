@@ -0,0 +1,136 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include "gaussian_blur.h"
+#include "box_blur.h"
+
+using namespace std;
+using namespace cv;
+
+/// Every blur the benchmark knows, compared against OpenCV's
+typedef bool (*BlurFn)(const Mat &src, Mat &dst, int ksize);
+
+static bool opencvBlur(const Mat &src, Mat &dst, int ksize)
+{
+    GaussianBlur( src, dst, Size( ksize, ksize ), 0, 0 );
+    return true;
+}
+
+static bool simdBlur(const Mat &src, Mat &dst, int ksize)
+{
+    return separableGaussianBlur( src, dst, ksize );
+}
+
+/// As many threads as OpenCV gets
+static int tiledThreads = 1;
+
+static bool tiledBlur(const Mat &src, Mat &dst, int ksize)
+{
+    return tiledGaussianBlur( src, dst, ksize, 0, tiledThreads );
+}
+
+/// An approximation: its diff is up to boxBlurErrorBound(), not rounding
+static bool boxBlur(const Mat &src, Mat &dst, int ksize)
+{
+    return boxGaussianBlur( src, dst, ksize );
+}
+
+struct Method {
+    const char *name;
+    BlurFn      fn;
+};
+
+static const Method methods[] = {
+    { "opencv", opencvBlur },
+    { "simd",   simdBlur },
+    { "tiled",  tiledBlur },
+    { "box",    boxBlur },
+};
+static const int methodCount = sizeof(methods) / sizeof(methods[0]);
+
+/// Mean time of one call in ms, repeated for at least minSecs
+static double timeMs(BlurFn fn, const Mat &src, Mat &dst, int ksize, double minSecs)
+{
+    if (!fn(src, dst, ksize))          // also the warm-up that sizes dst
+        return -1;
+
+    int64 start = getTickCount();
+    int64 limit = (int64)(minSecs * getTickFrequency());
+    int   iters = 0;
+    do {
+        fn(src, dst, ksize);
+        iters++;
+    } while (getTickCount() - start < limit);
+
+    return (getTickCount() - start) * 1000.0 / getTickFrequency() / iters;
+}
+
+int main( int argc, char** argv )
+{
+    const char *path = argc > 1 ? argv[1] : "fruits.jpg";
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    tiledThreads = threads;
+
+    /// Load the source image, noise if there isn't one
+    Mat image = imread( path, 1 );
+    if (image.empty()) {
+        fprintf(stderr, "can't read %s, using noise\n", path);
+        image.create(1080, 1920, CV_8UC3);
+        randu(image, Scalar::all(0), Scalar::all(255));
+    }
+
+    /// Single threaded OpenCV by default so the kernels are compared like for like
+    setNumThreads(threads);
+
+    static const Size sizes[] = { Size(640, 480), Size(1280, 720), Size(1920, 1080), Size(3840, 2160) };
+    static const int  ksizes[] = { 3, 5, 9, 15, 31, 61, 101 };
+    static const int  types[] = { CV_8UC3, CV_8UC1, CV_32FC1 };
+
+    printf("simd: %s, opencv and tiled threads: %d\n", blurSimdName(), threads);
+    printf("%-10s %-6s %5s", "size", "type", "ksize");
+    for (int m = 0; m < methodCount; m++)
+        printf(" %9s ms", methods[m].name);
+    for (int m = 1; m < methodCount; m++)
+        printf(" %7s x %7s diff", methods[m].name, methods[m].name);
+    printf("\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        Mat sized;
+        resize(image, sized, sizes[s], 0, 0, INTER_AREA);
+
+        for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+            Mat src;
+            int type = types[t];
+            if (CV_MAT_CN(type) == 1)
+                cvtColor(sized, src, CV_BGR2GRAY);
+            else
+                src = sized;
+            if (CV_MAT_DEPTH(type) == CV_32F)
+                src.convertTo(src, CV_32F, 1.0 / 255);
+
+            for (size_t k = 0; k < sizeof(ksizes) / sizeof(ksizes[0]); k++) {
+                char label[32];
+                snprintf(label, sizeof(label), "%dx%d", src.cols, src.rows);
+                printf("%-10s %-6s %5d", label,
+                       type == CV_8UC3 ? "8UC3" : type == CV_8UC1 ? "8UC1" : "32FC1", ksizes[k]);
+
+                Mat ref, dst;
+                double ms[methodCount], diff[methodCount];
+                ms[0] = timeMs(methods[0].fn, src, ref, ksizes[k], 0.2);
+                for (int m = 1; m < methodCount; m++) {
+                    ms[m] = timeMs(methods[m].fn, src, dst, ksizes[k], 0.2);
+                    diff[m] = ms[m] < 0 ? -1 : norm(ref, dst, NORM_INF);
+                }
+
+                for (int m = 0; m < methodCount; m++)
+                    printf(" %12.3f", ms[m]);
+                for (int m = 1; m < methodCount; m++)
+                    printf(" %9.2f %12.4g", ms[m] > 0 ? ms[0] / ms[m] : 0.0, diff[m]);
+                printf("\n");
+            }
+        }
+    }
+
+    return 0;
+}
@@ -1,27 +1,146 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "gaussian_blur.h"
+#include "box_blur.h"
+#include "batch_blur.h"
 
 using namespace std;
 using namespace cv;
 
-Mat src; Mat dst;
+Mat src;
 char window_name1[] = "Unprocessed Image";
 char window_name2[] = "Processed Image";
 
+/// The blurs to choose from by name
+static bool opencvBlur(const Mat &src, Mat &dst, int ksize, int)
+{
+    GaussianBlur( src, dst, Size( ksize, ksize ), 0, 0 );
+    return true;
+}
+
+static bool simdBlur(const Mat &src, Mat &dst, int ksize, int)
+{
+    return separableGaussianBlur( src, dst, ksize );
+}
+
+/// simd on every core, or on the threads given, in strips and L2-sized tiles
+static bool tiledBlur(const Mat &src, Mat &dst, int ksize, int threads)
+{
+    return tiledGaussianBlur( src, dst, ksize, 0, threads );
+}
+
+/// Constant time for any ksize, within boxBlurErrorBound() of the exact blur
+static bool boxBlur(const Mat &src, Mat &dst, int ksize, int)
+{
+    return boxGaussianBlur( src, dst, ksize );
+}
+
+struct Method {
+    const char *name;
+    BlurFn      fn;
+};
+
+static const Method methods[] = {
+    { "opencv", opencvBlur },
+    { "simd",   simdBlur },
+    { "tiled",  tiledBlur },
+    { "box",    boxBlur },
+};
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: BlurImage <image> [opencv|simd|tiled|box] [ksize=15]\n"
+            "       BlurImage -o <out dir> [-j threads] [-n in flight] <dir|list|image> [method] [ksize]\n"
+            "-o dir      : batch mode, no windows: blur every image of a directory, or\n"
+            "              every path listed one per line in a file, and write the\n"
+            "              results to dir under the same names\n"
+            "-j threads  : batch decode/blur/encode workers (one per core default)\n"
+            "-n images   : most images read but not yet written at once (2 per worker default)\n");
+}
+
 int main( int argc, char** argv )
 {
+    const char *outDir = NULL;
+    int threads = 0, inFlight = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:j:n:")) != -1) {
+        switch (opt) {
+        case 'o':
+            outDir = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            inFlight = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    /// Positional arguments from here on, argv[1] being the first of them
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    const char *name = argc > 2 ? argv[2] : "opencv";
+    int ksize = argc > 3 ? atoi(argv[3]) : 15;
+    if (ksize < 1 || !(ksize & 1)) {
+        fprintf(stderr, "ksize must be odd and positive\n");
+        return 1;
+    }
+    BlurFn blurFn = NULL;
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        if (strcmp(name, methods[m].name) == 0)
+            blurFn = methods[m].fn;
+    }
+    if (blurFn == NULL) {
+        fprintf(stderr, "unknown method %s\n", name);
+        return 1;
+    }
+
+    if (outDir != NULL) {
+        std::vector<BatchItem> items = listBatchInputs(argv[1]);
+        if (items.empty()) {
+            fprintf(stderr, "no images in %s\n", argv[1]);
+            return 1;
+        }
+        /// The pool runs one image per core, OpenCV must not split each one again
+        setNumThreads(1);
+        BatchOptions opts = { blurFn, ksize, threads, inFlight };
+        return runBatchBlur(items, outDir, opts) == 0 ? 0 : 1;
+    }
+
     /// Load the source image
     src = imread( argv[1], 1 );
+    if (src.empty()) {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 1;
+    }
 
     namedWindow( window_name1, WINDOW_AUTOSIZE );
     imshow("Unprocessed Image",src);
 
-    dst = src.clone();
-    GaussianBlur( src, dst, Size( 15, 15 ), 0, 0 );
+    /// In place: every method handles src == dst without a full-size copy,
+    /// and imshow() has already taken its own copy of the original
+    if (!blurFn( src, src, ksize, 0 )) {
+        fprintf(stderr, "%s can't blur this image\n", name);
+        return 1;
+    }
 
     namedWindow( window_name2, WINDOW_AUTOSIZE );
-    imshow("Processed Image",dst);
+    imshow("Processed Image",src);
 
     waitKey();
     return 0;
-}
\ No newline at end of file
+}
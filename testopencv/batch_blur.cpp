@@ -0,0 +1,465 @@
+#include "batch_blur.h"
+#include "opencv2/highgui/highgui.hpp"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+
+using namespace cv;
+
+namespace {
+
+double monotonicSecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool isImageFile(const std::string &name)
+{
+    static const char *exts[] = { ".jpg", ".jpeg", ".png", ".bmp", ".pgm", ".ppm", ".tif", ".tiff" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (strcasecmp(name.c_str() + dot, exts[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+std::string baseName(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+//".jpg" and the like, which also picks the encoder; empty if there is none
+std::string extension(const std::string &path)
+{
+    std::string base = baseName(path);
+    size_t dot = base.rfind('.');
+    return dot == std::string::npos ? "" : base.substr(dot);
+}
+
+bool byName(const BatchItem &a, const BatchItem &b)
+{
+    return a.name < b.name;
+}
+
+//output name for a list file entry: the relative path without a leading
+//./, or just the file name if it is absolute or climbs out with ..
+std::string outputName(const std::string &path)
+{
+    if (path.empty() || path[0] == '/')
+        return baseName(path);
+    std::string name = path;
+    while (name.compare(0, 2, "./") == 0)
+        name.erase(0, 2);
+    if (name == ".." || name.compare(0, 3, "../") == 0 || name.find("/../") != std::string::npos)
+        return baseName(path);
+    return name;
+}
+
+bool readFile(const std::string &path, std::vector<uchar> &bytes)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        bytes.resize(st.st_size);
+        size_t got = 0;
+        while (got < bytes.size()) {
+            ssize_t n = read(fd, &bytes[got], bytes.size() - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        ok = got == bytes.size();
+    }
+    close(fd);
+    return ok;
+}
+
+bool writeFile(const std::string &path, const std::vector<uchar> &bytes)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    bool ok = bytes.empty() || fwrite(&bytes[0], 1, bytes.size(), f) == bytes.size();
+    return fclose(f) == 0 && ok;
+}
+
+//mkdir -p for the directory part of path
+bool makeParentDirs(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos;
+         slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+//one image on its way through; bytes hold the file as read, then as
+//encoded for writing
+struct Job {
+    const BatchItem    *item;
+    std::vector<uchar>  bytes;
+};
+
+//unbounded FIFO handing jobs between the stages; the bound on the
+//pipeline as a whole is the in-flight count
+class JobQueue {
+public:
+    JobQueue() : closed_(false)
+    {
+        pthread_mutex_init(&lock_, NULL);
+        pthread_cond_init(&ready_, NULL);
+    }
+
+    ~JobQueue()
+    {
+        pthread_cond_destroy(&ready_);
+        pthread_mutex_destroy(&lock_);
+    }
+
+    void push(Job *job)
+    {
+        pthread_mutex_lock(&lock_);
+        jobs_.push_back(job);
+        pthread_cond_signal(&ready_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+    //blocks for the next job, NULL once closed and drained
+    Job *pop()
+    {
+        pthread_mutex_lock(&lock_);
+        while (jobs_.empty() && !closed_)
+            pthread_cond_wait(&ready_, &lock_);
+        Job *job = NULL;
+        if (!jobs_.empty()) {
+            job = jobs_.front();
+            jobs_.pop_front();
+        }
+        pthread_mutex_unlock(&lock_);
+        return job;
+    }
+
+    void close()
+    {
+        pthread_mutex_lock(&lock_);
+        closed_ = true;
+        pthread_cond_broadcast(&ready_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+private:
+    JobQueue(const JobQueue &);
+    JobQueue &operator=(const JobQueue &);
+
+    std::deque<Job *> jobs_;
+    bool              closed_;
+    pthread_mutex_t   lock_;
+    pthread_cond_t    ready_;
+};
+
+class BatchPipeline {
+public:
+    BatchPipeline(const std::vector<BatchItem> &items, const std::string &outDir,
+                  const BatchOptions &opts)
+        : items_(items),
+          outDir_(outDir),
+          opts_(opts),
+          inFlight_(0),
+          done_(0),
+          failed_(0),
+          bytesIn_(0),
+          bytesOut_(0)
+    {
+        pthread_mutex_init(&lock_, NULL);
+        pthread_cond_init(&slotFree_, NULL);
+    }
+
+    ~BatchPipeline()
+    {
+        pthread_cond_destroy(&slotFree_);
+        pthread_mutex_destroy(&lock_);
+    }
+
+    size_t run()
+    {
+        start_ = lastReport_ = monotonicSecs();
+
+        //threads that can't be started leave their stage to this one: the
+        //reading, or with no worker or no writer to hand images to, all of it
+        std::vector<pthread_t> workers(opts_.threads);
+        pthread_t reader, writer;
+        size_t started = 0;
+        bool writing = pthread_create(&writer, NULL, writerMain, this) == 0;
+        while (writing && started < workers.size()
+               && pthread_create(&workers[started], NULL, workerMain, this) == 0)
+            started++;
+        bool reading = started > 0 && pthread_create(&reader, NULL, readerMain, this) == 0;
+
+        if (started == 0) {
+            fprintf(stderr, "can't start threads, blurring on one\n");
+            if (writing) {
+                toWrite_.close();
+                pthread_join(writer, NULL);
+            }
+            processAll();
+        } else {
+            //each stage closes the queue after it once everything before it
+            //is done
+            if (reading)
+                pthread_join(reader, NULL);
+            else
+                readAll();
+            toWork_.close();
+            for (size_t i = 0; i < started; i++)
+                pthread_join(workers[i], NULL);
+            toWrite_.close();
+            pthread_join(writer, NULL);
+        }
+
+        double secs = monotonicSecs() - start_;
+        fprintf(stderr, "%zu images in %.1f s, %.1f images/s, %.1f MB read, %.1f MB written, %zu failed\n",
+                done_, secs, secs > 0 ? done_ / secs : 0.0, bytesIn_ / 1e6, bytesOut_ / 1e6,
+                failed_);
+        return failed_;
+    }
+
+private:
+    BatchPipeline(const BatchPipeline &);
+    BatchPipeline &operator=(const BatchPipeline &);
+
+    static void *readerMain(void *self)
+    {
+        static_cast<BatchPipeline *>(self)->readAll();
+        return NULL;
+    }
+
+    static void *workerMain(void *self)
+    {
+        static_cast<BatchPipeline *>(self)->work();
+        return NULL;
+    }
+
+    static void *writerMain(void *self)
+    {
+        static_cast<BatchPipeline *>(self)->writeAll();
+        return NULL;
+    }
+
+    void readAll()
+    {
+        for (size_t i = 0; i < items_.size(); i++) {
+            pthread_mutex_lock(&lock_);
+            while (inFlight_ >= opts_.maxInFlight)
+                pthread_cond_wait(&slotFree_, &lock_);
+            inFlight_++;
+            pthread_mutex_unlock(&lock_);
+
+            Job *job = new Job;
+            job->item = &items_[i];
+            if (readJob(job))
+                toWork_.push(job);
+        }
+    }
+
+    void work()
+    {
+        Mat img;
+        Job *job;
+        while ((job = toWork_.pop()) != NULL) {
+            if (blurJob(job, img))
+                toWrite_.push(job);
+        }
+    }
+
+    void writeAll()
+    {
+        Job *job;
+        while ((job = toWrite_.pop()) != NULL)
+            writeJob(job);
+    }
+
+    //the three stages in turn on the calling thread, one image at a time
+    void processAll()
+    {
+        Mat img;
+        for (size_t i = 0; i < items_.size(); i++) {
+            inFlight_++;    // finish() takes it back
+            Job *job = new Job;
+            job->item = &items_[i];
+            if (readJob(job) && blurJob(job, img))
+                writeJob(job);
+        }
+    }
+
+    //one job through one stage; false if it failed there and was finished
+    bool readJob(Job *job)
+    {
+        if (!readFile(job->item->path, job->bytes)) {
+            fprintf(stderr, "can't read %s: %s\n", job->item->path.c_str(), strerror(errno));
+            finish(job, false);
+            return false;
+        }
+        __atomic_add_fetch(&bytesIn_, job->bytes.size(), __ATOMIC_RELAXED);
+        return true;
+    }
+
+    bool blurJob(Job *job, Mat &img)
+    {
+        const std::string &name = job->item->name;
+        bool ok = false;
+        //blurred over itself, so a worker holds one decoded image at a
+        //time, and on its own thread: the pool already has one per core
+        try {
+            img = imdecode(job->bytes, CV_LOAD_IMAGE_COLOR);
+            if (img.empty())
+                fprintf(stderr, "can't decode %s\n", job->item->path.c_str());
+            else if (!opts_.blur(img, img, opts_.ksize, 1))
+                fprintf(stderr, "can't blur %s\n", job->item->path.c_str());
+            else if (extension(name).empty() || !imencode(extension(name), img, job->bytes))
+                fprintf(stderr, "can't encode %s\n", name.c_str());
+            else
+                ok = true;
+        } catch (const cv::Exception &e) {
+            fprintf(stderr, "%s: %s\n", job->item->path.c_str(), e.what());
+        }
+        if (!ok)
+            finish(job, false);
+        return ok;
+    }
+
+    //finishes the job either way
+    void writeJob(Job *job)
+    {
+        std::string path = outDir_ + "/" + job->item->name;
+        bool ok = makeParentDirs(path) && writeFile(path, job->bytes);
+        if (ok)
+            __atomic_add_fetch(&bytesOut_, job->bytes.size(), __ATOMIC_RELAXED);
+        else
+            fprintf(stderr, "can't write %s: %s\n", path.c_str(), strerror(errno));
+        finish(job, ok);
+        report();
+    }
+
+    //the job leaves the pipeline, making room for the reader
+    void finish(Job *job, bool ok)
+    {
+        delete job;
+        pthread_mutex_lock(&lock_);
+        done_++;
+        if (!ok)
+            failed_++;
+        inFlight_--;
+        pthread_cond_signal(&slotFree_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+    //a progress line every few seconds, from whichever thread writes
+    void report()
+    {
+        double now = monotonicSecs();
+        if (now - lastReport_ < 5)
+            return;
+        lastReport_ = now;
+        pthread_mutex_lock(&lock_);
+        size_t done = done_, failed = failed_;
+        pthread_mutex_unlock(&lock_);
+        fprintf(stderr, "%zu/%zu images, %.1f images/s, %zu failed\n",
+                done, items_.size(), done / (now - start_), failed);
+    }
+
+    const std::vector<BatchItem> &items_;
+    const std::string             outDir_;
+    const BatchOptions            opts_;
+    JobQueue                      toWork_, toWrite_;
+    pthread_mutex_t               lock_;
+    pthread_cond_t                slotFree_;   // signalled when inFlight_ drops
+    int                           inFlight_;
+    size_t                        done_, failed_;
+    size_t                        bytesIn_, bytesOut_;
+    double                        start_, lastReport_;
+};
+
+} // namespace
+
+std::vector<BatchItem> listBatchInputs(const std::string &path)
+{
+    std::vector<BatchItem> items;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+        return items;
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path.c_str());
+        if (d == NULL)
+            return items;
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (!isImageFile(e->d_name))
+                continue;
+            BatchItem item = { path + "/" + e->d_name, e->d_name };
+            items.push_back(item);
+        }
+        closedir(d);
+        std::sort(items.begin(), items.end(), byName);
+        return items;
+    }
+
+    if (isImageFile(path)) {
+        BatchItem item = { path, baseName(path) };
+        items.push_back(item);
+        return items;
+    }
+
+    std::ifstream list(path.c_str());
+    std::string line;
+    while (std::getline(list, line)) {
+        //trailing whitespace, including the \r of lists written on Windows
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#')
+            continue;
+        BatchItem item = { line, outputName(line) };
+        items.push_back(item);
+    }
+    return items;
+}
+
+size_t runBatchBlur(const std::vector<BatchItem> &items, const std::string &outDir,
+                    const BatchOptions &opts)
+{
+    BatchOptions o = opts;
+    if (o.threads <= 0)
+        o.threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    if (o.maxInFlight <= 0)
+        o.maxInFlight = 2 * o.threads;
+
+    if (mkdir(outDir.c_str(), 0777) < 0 && errno != EEXIST) {
+        perror(outDir.c_str());
+        return items.size();
+    }
+
+    BatchPipeline pipeline(items, outDir, o);
+    return pipeline.run();
+}
@@ -0,0 +1,49 @@
+/**
+ * Batch blur for dataset preprocessing: every image of a directory or a
+ * list file is read, decoded, blurred, encoded in its own format and
+ * written to an output directory.
+ *
+ * One reader thread does the file reads, a pool of workers decodes, blurs
+ * and encodes, and one writer thread does the file writes, so disk I/O on
+ * either side overlaps the compute. At most maxInFlight images are
+ * anywhere between being read and being written, which bounds memory no
+ * matter how long the list is.
+ */
+
+#ifndef BATCH_BLUR_H
+#define BATCH_BLUR_H
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include <string>
+#include <vector>
+
+//threads for one image, 0 = one per core, for the blurs that can use them
+typedef bool (*BlurFn)(const cv::Mat &src, cv::Mat &dst, int ksize, int threads);
+
+struct BatchItem {
+    std::string path;   // where to read it
+    std::string name;   // where to write it, relative to the output directory
+};
+
+struct BatchOptions {
+    BlurFn blur;        // called in place, src == dst
+    int    ksize;
+    int    threads;     // workers, 0 = one per core
+    int    maxInFlight; // 0 = two per worker
+};
+
+//the images to process, from:
+//  - a directory: its image files sorted by name, written under the same name
+//  - an image file: just that one
+//  - anything else, a list file: one path per line, blank lines and lines
+//    starting with # skipped; relative paths keep their subdirectories in
+//    the output, absolute ones are written under their file name
+//empty if the path can't be read
+std::vector<BatchItem> listBatchInputs(const std::string &path);
+
+//blur every item into outDir, creating it and any subdirectories needed.
+//Progress and a summary go to stderr; returns how many images failed
+size_t runBatchBlur(const std::vector<BatchItem> &items, const std::string &outDir,
+                    const BatchOptions &opts);
+
+#endif
@@ -0,0 +1,284 @@
+#include "box_blur.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+using namespace cv;
+
+namespace {
+
+//index i folded into [0, n) by mirroring about the first and last element
+//without repeating them (BORDER_REFLECT_101)
+int reflect101(int i, int n)
+{
+    if (n == 1)
+        return 0;
+    while (i < 0 || i >= n) {
+        if (i < 0)
+            i = -i;
+        if (i >= n)
+            i = 2 * (n - 1) - i;
+    }
+    return i;
+}
+
+//1-D kernel of the three boxes convolved, and its L1 distance to g with
+//both centred
+double boxKernelDistance(const int w[3], const std::vector<double> &g)
+{
+    std::vector<double> k(1, 1.0);
+    for (int b = 0; b < 3; b++) {
+        std::vector<double> next(k.size() + w[b] - 1, 0.0);
+        for (size_t i = 0; i < k.size(); i++)
+            for (int j = 0; j < w[b]; j++)
+                next[i + j] += k[i] / w[b];
+        k.swap(next);
+    }
+
+    int len = (int)std::max(k.size(), g.size());
+    int ko = (len - (int)k.size()) / 2, go = (len - (int)g.size()) / 2;
+    double l1 = 0;
+    for (int i = 0; i < len; i++) {
+        double a = i >= ko && i < ko + (int)k.size() ? k[i - ko] : 0;
+        double b = i >= go && i < go + (int)g.size() ? g[i - go] : 0;
+        l1 += fabs(a - b);
+    }
+    return l1;
+}
+
+//the widths for ksize/sigma and how far they are from the real kernel
+double chooseWidths(int ksize, double sigma, int widths[3])
+{
+    Mat gk = getGaussianKernel(ksize, sigma, CV_64F);
+    std::vector<double> g(gk.ptr<double>(), gk.ptr<double>() + ksize);
+    if (sigma <= 0)
+        sigma = 0.3 * ((ksize - 1) * 0.5 - 1) + 0.8;
+
+    //three boxes of width w have variance 3 (w^2 - 1) / 12; try the odd
+    //widths around the one that matches and keep the closest combination
+    int ideal = (int)sqrt(4 * sigma * sigma + 1);
+    if (ideal % 2 == 0)
+        ideal--;
+    double best = -1;
+    for (int a = std::max(1, ideal - 2); a <= ideal + 4; a += 2)
+        for (int b = a; b <= ideal + 4; b += 2)
+            for (int c = b; c <= ideal + 4; c += 2) {
+                int w[3] = { a, b, c };
+                double d = boxKernelDistance(w, g);
+                if (best < 0 || d < best) {
+                    best = d;
+                    memcpy(widths, w, sizeof(w));
+                }
+            }
+    return best;
+}
+
+//one box pass along a row of CN interleaved channels, in place: the first
+//len - 2r pixels become the sums of 2r + 1 pixels starting at each. A
+//running sum per channel adds the pixel entering the window and drops the
+//one leaving it
+template<int CN>
+void boxPass(uint32_t *buf, int len, int r)
+{
+    const int span = (2 * r + 1) * CN, n = (len - 2 * r) * CN;
+    uint32_t sum[CN];
+    for (int c = 0; c < CN; c++)
+        sum[c] = 0;
+    for (int i = 0; i < span; i += CN)
+        for (int c = 0; c < CN; c++)
+            sum[c] += buf[i + c];
+    for (int i = 0; i < n - CN; i += CN) {
+        for (int c = 0; c < CN; c++) {
+            uint32_t s = sum[c];
+            sum[c] += buf[i + span + c] - buf[i + c];
+            buf[i + c] = s;
+        }
+    }
+    for (int c = 0; c < CN; c++)
+        buf[n - CN + c] = sum[c];
+}
+
+typedef void (*BoxPassFn)(uint32_t *buf, int len, int r);
+const BoxPassFn boxPasses[4] = { boxPass<1>, boxPass<2>, boxPass<3>, boxPass<4> };
+
+//a producer of Q8 rows for the stage after it; the rows it hands out stay
+//valid while the consumer asks for rows no further back than it said
+class Stage {
+public:
+    virtual ~Stage() {}
+    virtual const uint16_t *row(int y) = 0;
+};
+
+//all three horizontal boxes applied to rows of the source image. cache
+//is how many rows the consumer may hold on to.
+//
+//A box filter keeps a signal that is mirrored about its ends mirrored, so
+//the row is extended once by the three radii together and each pass only
+//keeps the part it has a whole window for. The sums stay exact integers
+//until the product of the widths is divided out at the end
+class SourceStage : public Stage {
+public:
+    SourceStage(const Mat &src, const int widths[3], int cache)
+        : src_(src),
+          box_(boxPasses[src.channels() - 1]),
+          cn_(src.channels()),
+          n_(src.cols * src.channels()),
+          cache_(cache),
+          rows_((size_t)cache * n_),
+          tag_(cache, -1)
+    {
+        memcpy(widths_, widths, sizeof(widths_));
+        pad_ = widths[0] / 2 + widths[1] / 2 + widths[2] / 2;
+        ext_.resize((size_t)(src.cols + 2 * pad_) * cn_);
+        //Q8 out = sum * 256 / (w0 w1 w2); float is off by under 1/100 of
+        //a Q8 step, and vectorises
+        scale_ = 256.0f / ((float)widths[0] * widths[1] * widths[2]);
+    }
+
+    const uint16_t *row(int y)
+    {
+        int slot = y % cache_;
+        uint16_t *out = &rows_[(size_t)slot * n_];
+        if (tag_[slot] == y)
+            return out;
+
+        const uchar *s = src_.ptr<uchar>(y);
+        uint32_t *e = &ext_[0];
+        const int width = src_.cols, cn = cn_, n = n_, pad = pad_;
+        for (int x = -pad; x < 0; x++)
+            for (int c = 0; c < cn; c++) {
+                e[(pad + x) * cn + c] = s[reflect101(x, width) * cn + c];
+                e[(pad + width - 1 - x) * cn + c] = s[reflect101(width - 1 - x, width) * cn + c];
+            }
+        for (int i = 0; i < n; i++)
+            e[pad * cn + i] = s[i];
+
+        int len = width + 2 * pad;
+        for (int b = 0; b < 3; b++) {
+            box_(e, len, widths_[b] / 2);
+            len -= widths_[b] - 1;
+        }
+        const float scale = scale_;
+        for (int i = 0; i < n; i++)
+            out[i] = (uint16_t)(int)(e[i] * scale + 0.5f);
+        tag_[slot] = y;
+        return out;
+    }
+
+private:
+    const Mat            &src_;
+    BoxPassFn             box_;
+    int                   widths_[3];
+    int                   cn_, n_, cache_, pad_;
+    float                 scale_;
+    std::vector<uint16_t> rows_;
+    std::vector<int>      tag_;
+    std::vector<uint32_t> ext_;
+};
+
+//one vertical box as a running sum down the columns: row y adds the row
+//entering the window and takes out the one leaving it, so rows are made in
+//order and the previous stage is asked for nothing older than y - r - 1
+class VerticalStage : public Stage {
+public:
+    VerticalStage(Stage &prev, int height, int n, int width, int cache)
+        : prev_(prev),
+          height_(height),
+          n_(n),
+          r_(width / 2),
+          inv_(1.0f / width),
+          next_(0),
+          cache_(cache),
+          rows_((size_t)cache * n),
+          sum_(n)
+    {
+    }
+
+    const uint16_t *row(int y)
+    {
+        while (next_ <= y)
+            produce(next_++);
+        return &rows_[(size_t)(y % cache_) * n_];
+    }
+
+private:
+    void produce(int y)
+    {
+        const int n = n_;
+        int32_t  *sum = &sum_[0];
+        uint16_t *out = &rows_[(size_t)(y % cache_) * n];
+        if (y == 0) {
+            std::fill(sum_.begin(), sum_.end(), 0);
+            for (int k = -r_; k <= r_; k++) {
+                const uint16_t *in = prev_.row(reflect101(k, height_));
+                for (int i = 0; i < n; i++)
+                    sum[i] += in[i];
+            }
+            for (int i = 0; i < n; i++)
+                out[i] = (uint16_t)(sum[i] * inv_ + 0.5f);
+            return;
+        }
+
+        const uint16_t *add = prev_.row(reflect101(y + r_, height_));
+        const uint16_t *sub = prev_.row(reflect101(y - r_ - 1, height_));
+        for (int i = 0; i < n; i++) {
+            int32_t s = sum[i] + add[i] - sub[i];
+            sum[i] = s;
+            out[i] = (uint16_t)(s * inv_ + 0.5f);
+        }
+    }
+
+    Stage                &prev_;
+    int                   height_, n_, r_;
+    float                 inv_;
+    int                   next_, cache_;
+    std::vector<uint16_t> rows_;
+    std::vector<int32_t>  sum_;
+};
+
+} // namespace
+
+void boxBlurWidths(int ksize, double sigma, int widths[3])
+{
+    chooseWidths(ksize, sigma, widths);
+}
+
+double boxBlurErrorBound(int ksize, double sigma)
+{
+    int widths[3];
+    //separable: |a(x)a - g(x)g| <= |a - g| + |a - g| in L1, plus the
+    //final rounding
+    return 255 * 2 * chooseWidths(ksize, sigma, widths) + 1;
+}
+
+bool boxGaussianBlur(const Mat &src, Mat &dst, int ksize, double sigma)
+{
+    if (src.empty() || ksize < 1 || !(ksize & 1) || src.channels() > 4 || src.depth() != CV_8U)
+        return false;
+
+    //the horizontal sums are kept in 32 bits, which holds widths up to 256
+    //(ksize about 800)
+    int w[3];
+    chooseWidths(ksize, sigma, w);
+    if (255ull * w[0] * w[1] * w[2] > 0xffffffffull)
+        return false;
+
+    //each stage keeps as many rows as the one after it may still look back
+    //at: its whole window plus the row that leaves it next
+    const int n = src.cols * src.channels();
+    dst.create(src.size(), src.type());
+    SourceStage   h(src, w, w[0] + 1);
+    VerticalStage v1(h, src.rows, n, w[0], w[1] + 1);
+    VerticalStage v2(v1, src.rows, n, w[1], w[2] + 1);
+    VerticalStage v3(v2, src.rows, n, w[2], 1);
+
+    for (int y = 0; y < src.rows; y++) {
+        const uint16_t *q = v3.row(y);
+        uchar *d = dst.ptr<uchar>(y);
+        for (int i = 0; i < n; i++)
+            d[i] = (uchar)std::min(255, (q[i] + 128) >> 8);
+    }
+    return true;
+}
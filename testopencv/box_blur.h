@@ -0,0 +1,39 @@
+/**
+ * Gaussian blur approximated by three successive box filters, each a
+ * running sum, so the cost per pixel is the same for any kernel size. For
+ * the large kernels used for background estimation (31x31 and up) it is
+ * several times cheaper than the exact separable kernel.
+ *
+ * The three widths are the odd ones whose combined kernel is closest (in
+ * L1) to the kernel cv::GaussianBlur uses for the same ksize and sigma.
+ *
+ * Accuracy, for ksize 15 to 201 with sigma derived from ksize: the L1
+ * distance between the 1-D kernels is 0.032 to 0.048. That gives, on 8-bit
+ * images:
+ *   - at most 2.3 levels across a straight edge, which is where a
+ *     difference would show;
+ *   - at most 255 * 2 * L1 (16 to 25 levels) on any input at all, reached
+ *     only by patterns alternating at the scale of the kernel.
+ * Small kernels fit badly (ksize 9: L1 0.13) and should use the exact
+ * blur. boxBlurErrorBound() gives the worst case for a given ksize/sigma.
+ *
+ * Rows stream through a few caches of about 2 * box radius rows each, so
+ * scratch is O(kernel x width) and src may be dst.
+ */
+
+#ifndef BOX_BLUR_H
+#define BOX_BLUR_H
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+//CV_8U with 1 to 4 channels, odd ksize up to about 800; sigma <= 0 derives
+//it from ksize like OpenCV. false for anything else
+bool boxGaussianBlur(const cv::Mat &src, cv::Mat &dst, int ksize, double sigma = 0);
+
+//the three box widths used for ksize/sigma
+void boxBlurWidths(int ksize, double sigma, int widths[3]);
+
+//worst case difference from cv::GaussianBlur in 8-bit levels, any input
+double boxBlurErrorBound(int ksize, double sigma = 0);
+
+#endif
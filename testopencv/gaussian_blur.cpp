@@ -0,0 +1,512 @@
+#include "gaussian_blur.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLUR_NEON 1
+#endif
+
+using namespace cv;
+
+namespace {
+
+//index i folded into [0, n) by mirroring about the first and last element
+//without repeating them (BORDER_REFLECT_101)
+int reflect101(int i, int n)
+{
+    if (n == 1)
+        return 0;
+    while (i < 0 || i >= n) {
+        if (i < 0)
+            i = -i;
+        if (i >= n)
+            i = 2 * (n - 1) - i;
+    }
+    return i;
+}
+
+//kd quantised to integers summing to one, kept symmetric: everything is
+//rounded down and the units left over go to the taps that lost the most,
+//mirrored pairs at two units a time. Piling them on the centre instead
+//visibly sharpens large kernels
+void quantise(const double *kd, int ksize, int one, std::vector<uint16_t> &q)
+{
+    int r = ksize / 2;
+    int left = one;
+    std::vector<std::pair<double, int> > frac;
+    for (int i = 0; i <= r; i++) {
+        double x = kd[i] * one;
+        q[i] = q[ksize - 1 - i] = (uint16_t)x;
+        left -= i == r ? q[i] : 2 * q[i];
+        frac.push_back(std::make_pair(x - q[i], i));
+    }
+    std::sort(frac.rbegin(), frac.rend());
+    if (left & 1) {
+        q[r]++;
+        left--;
+    }
+    for (size_t j = 0; j < frac.size() && left >= 2; j++) {
+        int i = frac[j].second;
+        if (i == r)
+            continue;
+        q[i]++;
+        q[ksize - 1 - i]++;
+        left -= 2;
+    }
+    q[r] += left;
+}
+
+//the kernel in the two forms the passes want; taps are symmetric so the
+//horizontal pass adds mirrored pixels before multiplying
+struct Taps {
+    int                   ksize, radius;
+    std::vector<float>    f;    // float
+    std::vector<uint16_t> q;    // Q16, sums to 65535, for both 8-bit passes
+
+    Taps(int ksize_, double sigma)
+        : ksize(ksize_), radius(ksize_ / 2), f(ksize_), q(ksize_)
+    {
+        Mat k = getGaussianKernel(ksize, sigma, CV_64F);
+        const double *kd = k.ptr<double>();
+        for (int i = 0; i < ksize; i++)
+            f[i] = (float)kd[i];
+        //65535 rather than 65536 for one so that a kernel with all the
+        //weight on the centre still fits; the 0.002% it loses never shows
+        quantise(kd, ksize, 65535, q);
+    }
+};
+
+//--------------------------------------------------------
+//row kernels: horizontal from a padded source row, vertical over ksize
+//horizontally filtered rows. n counts elements, not pixels
+//--------------------------------------------------------
+
+//8-bit: out = round(sum(q * px) / 256), a Q8 value that fits u16 since q
+//sums to 65535. The sums take 32 bits, under 255 x 65535
+void hRow(const uchar *pad, uint16_t *out, int n, int cn, const Taps &t)
+{
+    const int r = t.radius;
+    const uchar *c = pad + r * cn;
+    int i = 0;
+#if defined(__AVX2__)
+    //madd multiplies signed 16 bits in pairs: mirrored pixel sums of two
+    //taps at a time, off-centre taps being under half of 65535, and the
+    //centre pixel as px x a + 2px x b with a + 2b its tap and both under
+    //32768
+    const int b3 = t.q[r] / 3;
+    const __m256i wc = _mm256_set1_epi32((t.q[r] - 2 * b3) | b3 << 16);
+    const __m256i half = _mm256_set1_epi32(128);
+    for (; i + 16 <= n; i += 16) {
+        __m256i p = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i)));
+        __m256i p2 = _mm256_add_epi16(p, p);
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(p, p2), wc);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(p, p2), wc);
+        for (int k = 1; k <= r; k += 2) {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i - k * cn)));
+            __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i + k * cn)));
+            __m256i ab0 = _mm256_add_epi16(a, b), ab1 = _mm256_setzero_si256();
+            int w1 = 0;
+            if (k < r) {
+                a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i - (k + 1) * cn)));
+                b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(c + i + (k + 1) * cn)));
+                ab1 = _mm256_add_epi16(a, b);
+                w1 = t.q[r - k - 1];
+            }
+            __m256i w = _mm256_set1_epi32(t.q[r - k] | w1 << 16);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(ab0, ab1), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(ab0, ab1), w));
+        }
+        //unpack and pack both work within 128 bit lanes, so the pixels come
+        //back in order
+        lo = _mm256_srli_epi32(_mm256_add_epi32(lo, half), 8);
+        hi = _mm256_srli_epi32(_mm256_add_epi32(hi, half), 8);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi32(lo, hi));
+    }
+#elif defined(BLUR_NEON)
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t p = vmovl_u8(vld1_u8(c + i));
+        uint32x4_t lo = vmull_n_u16(vget_low_u16(p), t.q[r]);
+        uint32x4_t hi = vmull_n_u16(vget_high_u16(p), t.q[r]);
+        for (int k = 1; k <= r; k++) {
+            uint16x8_t ab = vaddl_u8(vld1_u8(c + i - k * cn), vld1_u8(c + i + k * cn));
+            lo = vmlal_n_u16(lo, vget_low_u16(ab), t.q[r - k]);
+            hi = vmlal_n_u16(hi, vget_high_u16(ab), t.q[r - k]);
+        }
+        vst1q_u16(out + i, vcombine_u16(vrshrn_n_u32(lo, 8), vrshrn_n_u32(hi, 8)));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t acc = (uint32_t)c[i] * t.q[r];
+        for (int k = 1; k <= r; k++)
+            acc += (uint32_t)(c[i - k * cn] + c[i + k * cn]) * t.q[r - k];
+        out[i] = (uint16_t)((acc + 128) >> 8);
+    }
+}
+
+//8-bit: out = round(sum(mulhi(row, v)) / 256); mulhi keeps it all in 16 bits.
+//Each mulhi truncates, half a unit low on average, which the rounding
+//constant puts back
+void vRow(const uint16_t *const *rows, uchar *out, int n, const Taps &t)
+{
+    const int ks = t.ksize;
+    const uint16_t round = (uint16_t)(128 + ks / 2);
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int k = 0; k < ks; k++) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+            acc = _mm256_add_epi16(acc, _mm256_mulhi_epu16(x, _mm256_set1_epi16((short)t.q[k])));
+        }
+        acc = _mm256_srli_epi16(_mm256_add_epi16(acc, _mm256_set1_epi16(round)), 8);
+        __m128i px = _mm_packus_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        _mm_storeu_si128((__m128i *)(out + i), px);
+    }
+#elif defined(BLUR_NEON)
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        for (int k = 0; k < ks; k++) {
+            uint16x8_t x = vld1q_u16(rows[k] + i);
+            uint16x4_t lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(x), t.q[k]), 16);
+            uint16x4_t hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(x), t.q[k]), 16);
+            acc = vaddq_u16(acc, vcombine_u16(lo, hi));
+        }
+        vst1_u8(out + i, vqshrn_n_u16(vqaddq_u16(acc, vdupq_n_u16(round)), 8));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t acc = 0;
+        for (int k = 0; k < ks; k++)
+            acc += ((uint32_t)rows[k][i] * t.q[k]) >> 16;
+        out[i] = (uchar)std::min<uint32_t>(255, (acc + round) >> 8);
+    }
+}
+
+void hRow(const float *pad, float *out, int n, int cn, const Taps &t)
+{
+    const int r = t.radius;
+    const float *c = pad + r * cn;
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(c + i), _mm256_set1_ps(t.f[r]));
+        for (int k = 1; k <= r; k++) {
+            __m256 ab = _mm256_add_ps(_mm256_loadu_ps(c + i - k * cn), _mm256_loadu_ps(c + i + k * cn));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(ab, _mm256_set1_ps(t.f[r - k])));
+        }
+        _mm256_storeu_ps(out + i, acc);
+    }
+#elif defined(BLUR_NEON)
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t acc = vmulq_n_f32(vld1q_f32(c + i), t.f[r]);
+        for (int k = 1; k <= r; k++) {
+            float32x4_t ab = vaddq_f32(vld1q_f32(c + i - k * cn), vld1q_f32(c + i + k * cn));
+            acc = vmlaq_n_f32(acc, ab, t.f[r - k]);
+        }
+        vst1q_f32(out + i, acc);
+    }
+#endif
+    for (; i < n; i++) {
+        float acc = c[i] * t.f[r];
+        for (int k = 1; k <= r; k++)
+            acc += (c[i - k * cn] + c[i + k * cn]) * t.f[r - k];
+        out[i] = acc;
+    }
+}
+
+void vRow(const float *const *rows, float *out, int n, const Taps &t)
+{
+    const int ks = t.ksize;
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < ks; k++)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(rows[k] + i), _mm256_set1_ps(t.f[k])));
+        _mm256_storeu_ps(out + i, acc);
+    }
+#elif defined(BLUR_NEON)
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t acc = vdupq_n_f32(0);
+        for (int k = 0; k < ks; k++)
+            acc = vmlaq_n_f32(acc, vld1q_f32(rows[k] + i), t.f[k]);
+        vst1q_f32(out + i, acc);
+    }
+#endif
+    for (; i < n; i++) {
+        float acc = 0;
+        for (int k = 0; k < ks; k++)
+            acc += rows[k][i] * t.f[k];
+        out[i] = acc;
+    }
+}
+
+//--------------------------------------------------------
+//the line buffer: T is the pixel type, W what the passes hand over
+//--------------------------------------------------------
+
+template <typename T, typename W>
+class LineFilter {
+public:
+    //tileCols is the widest column range run() will be given
+    LineFilter(const Mat &src, const Taps &t, int tileCols)
+        : t_(t),
+          width_(src.cols),
+          cn_(src.channels()),
+          x0_(0),
+          x1_(0),
+          y0_(0),
+          y1_(0),
+          saved_(NULL),
+          pad_((tileCols + 2 * t.radius) * src.channels()),
+          ring_((size_t)t.ksize * tileCols * src.channels()),
+          tag_(t.ksize, -1),
+          rows_(t.ksize)
+    {
+    }
+
+    //blur rows [y0, y1) and columns [x0, x1) of src into dst; rows and
+    //columns outside the range are read as the halo. src may be dst: a row
+    //is always filtered into the ring before its output overwrites it.
+    //saved, if given, has copies of the halo rows outside [y0, y1) for
+    //when other threads are overwriting those in place
+    void run(const Mat &src, Mat &dst, int y0, int y1, int x0, int x1,
+             const std::vector<const uchar *> *saved = NULL)
+    {
+        if (x0 != x0_ || x1 != x1_) {
+            std::fill(tag_.begin(), tag_.end(), -1);
+            x0_ = x0;
+            x1_ = x1;
+        }
+        y0_ = y0;
+        y1_ = y1;
+        saved_ = saved;
+        const int n = (x1 - x0) * cn_;
+        for (int y = y0; y < y1; y++) {
+            for (int k = 0; k < t_.ksize; k++)
+                rows_[k] = row(src, reflect101(y - t_.radius + k, src.rows));
+            vRow(&rows_[0], dst.ptr<T>(y) + x0 * cn_, n, t_);
+        }
+    }
+
+private:
+    //source row y filtered horizontally. The rows one output row needs are
+    //a run of at most ksize, so slot y % ksize never evicts one still in use
+    const W *row(const Mat &src, int y)
+    {
+        int slot = y % t_.ksize;
+        const int n = (x1_ - x0_) * cn_;
+        W *out = &ring_[(size_t)slot * n];
+        if (tag_[slot] == y)
+            return out;
+
+        //the tile plus radius columns each side, mirrored where that
+        //crosses the image edge
+        const T *s = saved_ != NULL && (y < y0_ || y >= y1_)
+                     ? reinterpret_cast<const T *>((*saved_)[y]) : src.ptr<T>(y);
+        const int lo = x0_ - t_.radius, hi = x1_ + t_.radius;
+        const int inLo = std::max(lo, 0), inHi = std::min(hi, width_);
+        memcpy(&pad_[(inLo - lo) * cn_], s + inLo * cn_, (inHi - inLo) * cn_ * sizeof(T));
+        for (int x = lo; x < inLo; x++)
+            memcpy(&pad_[(x - lo) * cn_], s + reflect101(x, width_) * cn_, cn_ * sizeof(T));
+        for (int x = inHi; x < hi; x++)
+            memcpy(&pad_[(x - lo) * cn_], s + reflect101(x, width_) * cn_, cn_ * sizeof(T));
+        hRow(&pad_[0], out, n, cn_, t_);
+        tag_[slot] = y;
+        return out;
+    }
+
+    const Taps      &t_;
+    int              width_, cn_;
+    int              x0_, x1_;  // columns the ring holds
+    int              y0_, y1_;  // rows being written
+    const std::vector<const uchar *> *saved_;
+    std::vector<T>   pad_;
+    std::vector<W>   ring_;
+    std::vector<int> tag_;    // source row in each ring slot, -1 if none
+    std::vector<const W *> rows_;
+};
+
+} // namespace
+
+bool separableGaussianBlur(const Mat &src, Mat &dst, int ksize, double sigma)
+{
+    if (src.empty() || ksize < 1 || !(ksize & 1) || src.channels() > 4
+        || (src.depth() != CV_8U && src.depth() != CV_32F))
+        return false;
+    if (ksize == 1) {
+        src.copyTo(dst);
+        return true;
+    }
+
+    Taps t(ksize, sigma);
+    dst.create(src.size(), src.type());
+    if (src.depth() == CV_8U) {
+        LineFilter<uchar, uint16_t> f(src, t, src.cols);
+        f.run(src, dst, 0, src.rows, 0, src.cols);
+    } else {
+        LineFilter<float, float> f(src, t, src.cols);
+        f.run(src, dst, 0, src.rows, 0, src.cols);
+    }
+    return true;
+}
+
+//--------------------------------------------------------
+//tiled: strips x column tiles spread over threads
+//--------------------------------------------------------
+
+namespace {
+
+size_t l2CacheBytes()
+{
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 > 0)
+        return l2;
+#elif defined(__APPLE__)
+    uint64_t l2 = 0;
+    size_t   len = sizeof(l2);
+    if (sysctlbyname("hw.l2cachesize", &l2, &len, NULL, 0) == 0 && l2 > 0)
+        return l2;
+#endif
+    return 256 * 1024;
+}
+
+//the image cut into strips x tiles; threads take them in turn until none
+//are left
+struct TileJob {
+    const Mat  *src;
+    Mat        *dst;
+    const Taps *taps;
+    int         stripRows, strips;
+    int         tileCols, tiles;
+    int         next;       // next tile to take, shared by the threads
+    //in place only: copies of the rows near strip boundaries, by row
+    const std::vector<const uchar *> *saved;
+    void      (*run)(TileJob &job);
+};
+
+template <typename T, typename W>
+void runTiles(TileJob &job)
+{
+    const Mat &src = *job.src;
+    LineFilter<T, W> f(src, *job.taps, job.tileCols);
+    int i;
+    while ((i = __atomic_fetch_add(&job.next, 1, __ATOMIC_RELAXED)) < job.strips * job.tiles) {
+        int y0 = i / job.tiles * job.stripRows, x0 = i % job.tiles * job.tileCols;
+        f.run(src, *job.dst, y0, std::min(y0 + job.stripRows, src.rows),
+              x0, std::min(x0 + job.tileCols, src.cols), job.saved);
+    }
+}
+
+void *tileThread(void *arg)
+{
+    TileJob *job = static_cast<TileJob *>(arg);
+    job->run(*job);
+    return NULL;
+}
+
+} // namespace
+
+bool tiledGaussianBlur(const Mat &src, Mat &dst, int ksize, double sigma, int threads)
+{
+    if (src.empty() || ksize < 1 || !(ksize & 1) || src.channels() > 4
+        || (src.depth() != CV_8U && src.depth() != CV_32F))
+        return false;
+    dst.create(src.size(), src.type());
+    if (ksize == 1)
+        return separableGaussianBlur(src, dst, ksize, sigma);
+    const bool inPlace = src.data == dst.data;
+
+    if (threads <= 0)
+        threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+    const int r = ksize / 2;
+    int tileCols, tiles, stripRows, strips;
+    if (!inPlace) {
+        //a tile's ring of ksize filtered rows gets half of L2, the other
+        //half is for the source and output rows passing through. Tiles
+        //narrower than 4 kernels would spend too much on the column halo
+        const int cn = src.channels(), wsize = src.depth() == CV_8U ? 2 : 4;
+        tileCols = (int)(l2CacheBytes() / 2 / ((size_t)ksize * cn * wsize));
+        tileCols = std::max(tileCols, std::max(64, 4 * ksize));
+        tiles = (src.cols + tileCols - 1) / tileCols;
+        tileCols = std::min(src.cols, ((src.cols + tiles - 1) / tiles + 15) & ~15);
+        tiles = (src.cols + tileCols - 1) / tileCols;
+
+        //about four tiles per thread to even out the load, in strips no
+        //shorter than 4 kernels for the same reason
+        strips = std::max(1, (4 * threads + tiles - 1) / tiles);
+        stripRows = std::max((src.rows + strips - 1) / strips, 4 * ksize);
+    } else {
+        //in place, a strip's neighbours overwrite its halo rows, so those
+        //are copied first. That is 2r rows per boundary, so one full-width
+        //strip per thread rather than many tiles
+        tileCols = src.cols;
+        tiles = 1;
+        stripRows = std::max((src.rows + threads - 1) / threads, 4 * ksize);
+    }
+    strips = (src.rows + stripRows - 1) / stripRows;
+    if (inPlace && strips == 1)
+        return separableGaussianBlur(src, dst, ksize, sigma);
+
+    //rows within r of a strip boundary, copied before any strip is written
+    Mat halo;
+    std::vector<const uchar *> saved;
+    if (inPlace) {
+        saved.resize(src.rows, NULL);
+        std::vector<int> rows;
+        for (int b = stripRows; b < src.rows; b += stripRows)
+            for (int y = std::max(0, b - r); y < std::min(src.rows, b + r); y++)
+                if (rows.empty() || y > rows.back())
+                    rows.push_back(y);
+        halo.create((int)rows.size(), src.cols, src.type());
+        for (size_t i = 0; i < rows.size(); i++) {
+            memcpy(halo.ptr((int)i), src.ptr(rows[i]), src.cols * src.elemSize());
+            saved[rows[i]] = halo.ptr((int)i);
+        }
+    }
+
+    Taps t(ksize, sigma);
+    TileJob job = { &src, &dst, &t, stripRows, strips, tileCols, tiles, 0,
+                    inPlace ? &saved : NULL,
+                    src.depth() == CV_8U ? runTiles<uchar, uint16_t> : runTiles<float, float> };
+    threads = std::min(threads, strips * tiles);
+    //tiles are taken, not handed out, so if a thread can't be started the
+    //ones that could, and this one, do its share
+    std::vector<pthread_t> pool(threads - 1);
+    size_t started = 0;
+    while (started < pool.size() && pthread_create(&pool[started], NULL, tileThread, &job) == 0)
+        started++;
+    job.run(job);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(pool[i], NULL);
+    return true;
+}
+
+bool gaussianBlurInPlace(Mat &img, int ksize, double sigma, int threads)
+{
+    if (threads == 1)
+        return separableGaussianBlur(img, img, ksize, sigma);
+    return tiledGaussianBlur(img, img, ksize, sigma, threads);
+}
+
+const char *blurSimdName()
+{
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(BLUR_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,52 @@
+/**
+ * Separable Gaussian blur, a drop-in for cv::GaussianBlur(src, dst,
+ * Size(ksize, ksize), sigma, sigma) with the default BORDER_REFLECT_101.
+ *
+ * Each source row is filtered horizontally once into a ring of ksize rows
+ * and every output row is the vertical filter over that ring, so the two
+ * passes meet in a buffer of ksize x width that stays in cache instead of
+ * a full-size intermediate image.
+ *
+ * 8-bit images run in fixed point with Q16 taps for both passes: the
+ * horizontal one sums in 32 bits and rounds its rows to Q8 in a u16, the
+ * vertical one applies its taps as a high-half multiply. Every pixel is
+ * within 1 of the exactly rounded result. Float images use the same
+ * scheme in float.
+ * AVX2 or NEON is used when the compiler targets it, plain C++ otherwise;
+ * all three give identical 8-bit output.
+ *
+ * tiledGaussianBlur() gives the same output on several threads. The image
+ * is cut into horizontal strips and, when a ring of full rows would not
+ * fit in half the L2 cache, into column tiles as well; each tile is
+ * filtered with its halo of ksize / 2 rows and columns by one thread, in
+ * that thread's own ring.
+ *
+ * Both also work in place (src is dst): every source row reaches the ring
+ * before its output row overwrites it, so the only scratch is the ring of
+ * ksize x width per thread, and in the threaded case a copy of the ksize - 1
+ * rows around each boundary between threads. gaussianBlurInPlace() spells
+ * that out.
+ */
+
+#ifndef GAUSSIAN_BLUR_H
+#define GAUSSIAN_BLUR_H
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+//CV_8U or CV_32F with 1 to 4 channels, odd ksize; sigma <= 0 derives it
+//from ksize like OpenCV. false for anything else
+bool separableGaussianBlur(const cv::Mat &src, cv::Mat &dst, int ksize, double sigma = 0);
+
+//same output, strips x tiles spread over threads (0 = one per core). In
+//place it uses one full-width strip per thread instead
+bool tiledGaussianBlur(const cv::Mat &src, cv::Mat &dst, int ksize, double sigma = 0,
+                       int threads = 0);
+
+//img blurred over itself without a full-size temporary, on threads
+//(0 = one per core)
+bool gaussianBlurInPlace(cv::Mat &img, int ksize, double sigma = 0, int threads = 1);
+
+//which vector unit the blur was built for: "avx2", "neon" or "scalar"
+const char *blurSimdName();
+
+#endif